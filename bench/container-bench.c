@@ -0,0 +1,196 @@
+/**
+ * File: container-bench.c
+ * -----------------------
+ * Compares the generic librssnews hashset/vector with the typed containers that
+ * searchdb.c now uses, on the operations indexing and querying lean on:
+ * word lookups, recording occurrances and sorting postings.
+ *
+ * Both sides get the same element layouts, the same linear congruence hash
+ * and the same token stream, so the difference is the containers: memcpy and
+ * calls through function pointers against inlined, typed code.
+ *
+ * Usage: container-bench [n_words] [n_tokens]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "searchdb.h"
+
+typedef struct {
+  char word[WORD_N_BYTES];
+  vector occurrances;
+} generic_term_t;
+
+static long long NowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Generic-side callbacks, shaped like the ones searchdb.c used to hand the hashset.
+
+static int GenericTermHash(const void *elem, int numBuckets) {
+  return StringHash(((const generic_term_t*)elem)->word, numBuckets);
+}
+
+static int GenericTermCompare(const void *a, const void *b) {
+  return strcasecmp(((const generic_term_t*)a)->word, ((const generic_term_t*)b)->word);
+}
+
+static void GenericTermFree(void *elem) {
+  VectorDispose(&((generic_term_t*)elem)->occurrances);
+}
+
+static int GenericOccurranceCompare(const void *a, const void *b) {
+  return ((const occurrance_t*)b)->count - ((const occurrance_t*)a)->count;
+}
+
+static void SortGenericTerm(void *elem, void *n_postings) {
+  generic_term_t *term = (generic_term_t*)elem;
+  VectorSort(&term->occurrances, GenericOccurranceCompare);
+  *(int*)n_postings += VectorLength(&term->occurrances);
+}
+
+static inline bool TypedOccurranceRanksAhead(const occurrance_t *a, const occurrance_t *b) {
+  return a->count > b->count;
+}
+
+DECLARE_TYPED_VECTOR_SORT(occurrance_vector_t, OccurranceVector, occurrance_t, TypedOccurranceRanksAhead)
+
+// Workload /////////////////
+
+// Random lowercase words of 3 to 12 letters.  Some will repeat, which is fine.
+static char (*MakeVocabulary(int n_words))[WORD_N_BYTES] {
+  char (*words)[WORD_N_BYTES] = malloc(n_words * WORD_N_BYTES);
+  for (int i = 0; i < n_words; i++) {
+    int length = 3 + rand() % 10;
+    for (int j = 0; j < length; j++) words[i][j] = 'a' + rand() % 26;
+    words[i][length] = '\0';
+  }
+  return words;
+}
+
+// A token stream skewed toward the front of the vocabulary, the way real text
+// leans on a few common words.  Every 64 tokens starts a new "article".
+static int *MakeTokens(int n_words, int n_tokens) {
+  int *tokens = malloc(n_tokens * sizeof(int));
+  for (int i = 0; i < n_tokens; i++) {
+    double u = (double)rand() / RAND_MAX;
+    tokens[i] = (int)(n_words * u * u * u) % n_words;
+  }
+  return tokens;
+}
+
+static void Report(const char *name, long long generic_ns, long long typed_ns, int n_ops) {
+  printf("%-24s %12.1f %12.1f %9.2fx\n", name,
+         (double)generic_ns / n_ops, (double)typed_ns / n_ops, (double)generic_ns / typed_ns);
+}
+
+int main(int argc, char **argv) {
+  int n_words = (argc > 1) ? atoi(argv[1]) : 50000;
+  int n_tokens = (argc > 2) ? atoi(argv[2]) : 2000000;
+  char (*words)[WORD_N_BYTES];
+  int *tokens;
+  long long start, generic_ns, typed_ns;
+  hashset generic;
+  term_set_t typed;
+  int i;
+
+  srand(107);
+  words = MakeVocabulary(n_words);
+  tokens = MakeTokens(n_words, n_tokens);
+
+  HashSetNew(&generic, sizeof(generic_term_t), kword_buckets, GenericTermHash, GenericTermCompare, GenericTermFree);
+  TermSetNew(&typed, kword_buckets);
+
+  printf("%d words, %d tokens\n\n", n_words, n_tokens);
+  printf("%-24s %12s %12s %10s\n", "benchmark", "generic ns", "typed ns", "speedup");
+
+  // Indexing: look the token up, add it if it's new, then bump or append an occurrance.
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) {
+    int doc_id = i / 64;
+    generic_term_t *term = HashSetLookup(&generic, words[tokens[i]]);
+    if (term == NULL) {
+      generic_term_t new_term;
+      strcpy(new_term.word, words[tokens[i]]);
+      VectorNew(&new_term.occurrances, sizeof(occurrance_t), NULL, 4);
+      HashSetEnter(&generic, &new_term);
+      term = HashSetLookup(&generic, words[tokens[i]]);
+    }
+    int n = VectorLength(&term->occurrances);
+    occurrance_t *last = (n > 0) ? VectorNth(&term->occurrances, n - 1) : NULL;
+    if (last != NULL && last->doc_id == doc_id) last->count++;
+    else {
+      occurrance_t occurrance = { 1, doc_id };
+      VectorAppend(&term->occurrances, &occurrance);
+    }
+  }
+  generic_ns = NowNs() - start;
+
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) {
+    int doc_id = i / 64;
+    occurrance_list_t *term = TermSetLookup(&typed, words[tokens[i]]);
+    if (term == NULL) {
+      occurrance_list_t new_term;
+      strcpy(new_term.word, words[tokens[i]]);
+      OccurranceVectorNew(&new_term.occurrances, 4);
+      new_term.ranked = false;
+      term = TermSetEnter(&typed, &new_term);
+    }
+    occurrance_t *last = OccurranceVectorLast(&term->occurrances);
+    if (last != NULL && last->doc_id == doc_id) last->count++;
+    else {
+      occurrance_t occurrance = { 1, doc_id };
+      OccurranceVectorAppend(&term->occurrances, &occurrance);
+    }
+  }
+  typed_ns = NowNs() - start;
+  Report("record occurrance", generic_ns, typed_ns, n_tokens);
+
+  // Querying: pure lookups, all hits.  The hit counts keep the compiler from 
+  // dropping lookups whose results would otherwise go unused. 
+  int generic_hits = 0, typed_hits = 0;
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) generic_hits += HashSetLookup(&generic, words[tokens[i]]) != NULL;
+  generic_ns = NowNs() - start;
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) typed_hits += TermSetLookup(&typed, words[tokens[i]]) != NULL;
+  typed_ns = NowNs() - start;
+  Report("lookup (hit)", generic_ns, typed_ns, n_tokens);
+
+  // Lookups of words that were never entered: each vocabulary word with a digit tacked on.
+  char (*misses)[WORD_N_BYTES] = malloc(n_words * WORD_N_BYTES);
+  for (i = 0; i < n_words; i++) snprintf(misses[i], WORD_N_BYTES, "%s9", words[i]);
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) generic_hits += HashSetLookup(&generic, misses[tokens[i]]) != NULL;
+  generic_ns = NowNs() - start;
+  start = NowNs();
+  for (i = 0; i < n_tokens; i++) typed_hits += TermSetLookup(&typed, misses[tokens[i]]) != NULL;
+  typed_ns = NowNs() - start;
+  Report("lookup (miss)", generic_ns, typed_ns, n_tokens);
+  assert(generic_hits == typed_hits);
+
+  // Sorting every postings list, as SortOccurrances does.
+  int n_postings = 0;
+  start = NowNs();
+  HashSetMap(&generic, SortGenericTerm, &n_postings);
+  generic_ns = NowNs() - start;
+  start = NowNs();
+  for (i = 0; i < TermSetCount(&typed); i++)
+    OccurranceVectorSort(&TermSetAt(&typed, i)->occurrances);
+  typed_ns = NowNs() - start;
+  Report("sort postings (per elem)", generic_ns, typed_ns, n_postings);
+
+  HashSetDispose(&generic);
+  for (i = 0; i < TermSetCount(&typed); i++)
+    OccurranceVectorDispose(&TermSetAt(&typed, i)->occurrances);
+  TermSetDispose(&typed);
+  free(tokens);
+  free(misses);
+  free(words);
+  return 0;
+}
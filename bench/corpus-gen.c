@@ -0,0 +1,400 @@
+/**
+ * File: corpus-gen.c
+ * ------------------
+ * Generates a synthetic crawl: RSS feeds and the HTML articles they link to, written
+ * as a fetch archive (see curlconnection.h) along with a matching feeds file.  Run
+ * the search against it with --replay, so indexing can be load tested at 10^5 to 10^6
+ * articles without the network:
+ *
+ *   corpus-gen --articles 100000 --out /tmp/corpus
+ *   rss-news-search /tmp/corpus/feeds.txt --replay /tmp/corpus
+ *
+ * Article text draws from a Zipfian vocabulary of made-up words, mixed with the stop
+ * words in data/stop-words.txt, and is wrapped in the usual noise: <script> and <style>
+ * blocks, comments, navigation, ads and HTML escapes.  Two kinds of duplicates can be
+ * mixed in.  --dup-rate is the share of feed items that repeat an item from another
+ * feed, as syndicated stories do.  --copy-rate is the share of articles that republish
+ * an earlier article's text under a new title and url, with a few words changed.
+ *
+ * Everything derives from --seed, so a given command line always writes the same corpus.
+ *
+ * Usage: corpus-gen [--articles n] [--hosts n] [--feeds-per-host n] [--words n]
+ *                   [--vocabulary n] [--zipf s] [--dup-rate r] [--copy-rate r]
+ *                   [--seed n] --out dir
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "curlconnection.h"
+
+// The crawler takes at most this many domains, and feeds per domain (see news-thread.h).
+#define MAX_HOSTS 10
+#define MAX_FEEDS_PER_HOST 30
+
+typedef struct {
+  int n_articles;
+  int n_hosts;
+  int feeds_per_host;
+  int mean_words;
+  int n_vocabulary;
+  double zipf_s;
+  double dup_rate;
+  double copy_rate;
+  unsigned long long seed;
+  const char *out_dir;
+} corpus_config_t;
+
+typedef struct {
+  char (*words)[24];
+  double *cdf;        // cdf[i] is the probability of drawing one of words 0..i
+  int n_words;
+  char (*stop_words)[24];
+  int n_stop_words;
+} vocabulary_t;
+
+// Random numbers /////////////////
+
+typedef struct { unsigned long long state; } rng_t;
+
+// SplitMix64: good enough for text, and seeded per article so any article can be
+// regenerated on its own.
+static inline unsigned long long RngNext(rng_t *rng) {
+  unsigned long long z = (rng->state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline double RngDouble(rng_t *rng) {
+  return (RngNext(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline int RngBelow(rng_t *rng, int n) {
+  return (int)(RngDouble(rng) * n);
+}
+
+static rng_t RngFor(const corpus_config_t *config, unsigned long long stream, int index) {
+  rng_t rng = { config->seed * 0x100000001b3ULL ^ (stream << 40) ^ (unsigned long long)index };
+  RngNext(&rng);
+  return rng;
+}
+
+enum { kTitleStream = 1, kTextStream, kCopyStream, kFeedStream };
+
+// Vocabulary /////////////////
+
+static const char *const kOnsets[] = { "b", "c", "d", "f", "g", "h", "j", "k", "l", "m", "n", "p", "r", "s",
+  "t", "v", "w", "z", "br", "ch", "cl", "dr", "fl", "gr", "pl", "pr", "sh", "st", "str", "th", "tr" };
+static const char *const kNuclei[] = { "a", "e", "i", "o", "u", "ai", "ea", "ee", "io", "ou", "oa" };
+static const char *const kCodas[] = { "", "", "n", "r", "s", "t", "l", "m", "nd", "st", "rk", "ng", "ck", "ll", "nt" };
+#define N_ELEMS(array) ((int)(sizeof(array) / sizeof(array[0])))
+
+// Words are made of 1 to 3 syllables, so at most 21 letters.  Duplicates are possible, and harmless: they
+// only merge two ranks.
+static void MakeWord(rng_t *rng, char word[24]) {
+  int n_syllables = 1 + RngBelow(rng, 3);
+  word[0] = '\0';
+  for (int i = 0; i < n_syllables; i++) {
+    strcat(word, kOnsets[RngBelow(rng, N_ELEMS(kOnsets))]);
+    strcat(word, kNuclei[RngBelow(rng, N_ELEMS(kNuclei))]);
+    strcat(word, kCodas[RngBelow(rng, N_ELEMS(kCodas))]);
+  }
+}
+
+static void LoadStopWords(vocabulary_t *vocabulary) {
+  char line[64];
+  FILE *infile = fopen("data/stop-words.txt", "r");
+  vocabulary->stop_words = NULL;
+  vocabulary->n_stop_words = 0;
+  if (infile == NULL) return;   // just no stop words then
+  while (fgets(line, sizeof(line), infile) != NULL) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || strlen(line) >= 24) continue;
+    vocabulary->stop_words = realloc(vocabulary->stop_words, (vocabulary->n_stop_words + 1) * 24);
+    strcpy(vocabulary->stop_words[vocabulary->n_stop_words++], line);
+  }
+  fclose(infile);
+}
+
+static void VocabularyNew(vocabulary_t *vocabulary, const corpus_config_t *config) {
+  rng_t rng = RngFor(config, 0, 0);
+  vocabulary->n_words = config->n_vocabulary;
+  vocabulary->words = malloc(vocabulary->n_words * sizeof(vocabulary->words[0]));
+  vocabulary->cdf = malloc(vocabulary->n_words * sizeof(double));
+  double total = 0;
+  for (int i = 0; i < vocabulary->n_words; i++) {
+    MakeWord(&rng, vocabulary->words[i]);
+    total += pow(i + 1, -config->zipf_s);
+    vocabulary->cdf[i] = total;
+  }
+  for (int i = 0; i < vocabulary->n_words; i++) vocabulary->cdf[i] /= total;
+  LoadStopWords(vocabulary);
+}
+
+static void VocabularyDispose(vocabulary_t *vocabulary) {
+  free(vocabulary->words);
+  free(vocabulary->cdf);
+  free(vocabulary->stop_words);
+}
+
+// About a third of running English is stop words, so a third of draws are.
+static const char *DrawWord(const vocabulary_t *vocabulary, rng_t *rng) {
+  if (vocabulary->n_stop_words > 0 && RngBelow(rng, 3) == 0)
+    return vocabulary->stop_words[RngBelow(rng, vocabulary->n_stop_words)];
+  double u = RngDouble(rng);
+  int low = 0, high = vocabulary->n_words - 1;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (vocabulary->cdf[mid] < u) low = mid + 1;
+    else high = mid;
+  }
+  return vocabulary->words[low];
+}
+
+// Articles /////////////////
+
+// The article's title.  Titles are how the crawler spots repeated items, so each
+// carries its article number.
+static void MakeTitle(const corpus_config_t *config, const vocabulary_t *vocabulary, int article, char *title, int size) {
+  rng_t rng = RngFor(config, kTitleStream, article);
+  int length = snprintf(title, size, "%d:", article);
+  int n_words = 4 + RngBelow(&rng, 6);
+  for (int i = 0; i < n_words && length < size - 25; i++)
+    length += snprintf(title + length, size - length, " %s", DrawWord(vocabulary, &rng));
+}
+
+static void MakeArticleURL(const corpus_config_t *config, int article, char *url, int size) {
+  snprintf(url, size, "http://host%d.example/news/%07d.html", article % config->n_hosts, article);
+}
+
+static void MakeFeedURL(int host, int feed, char *url, int size) {
+  snprintf(url, size, "http://host%d.example/rss/feed-%d.xml", host, feed);
+}
+
+// An earlier article that article republishes, or -1 if its text is its own.
+static int CopySource(const corpus_config_t *config, int article) {
+  if (article == 0) return -1;
+  rng_t rng = RngFor(config, kCopyStream, article);
+  if (RngDouble(&rng) >= config->copy_rate) return -1;
+  return RngBelow(&rng, article);
+}
+
+static void WriteNoise(FILE *out, const vocabulary_t *vocabulary, rng_t *rng) {
+  const char *a = DrawWord(vocabulary, rng), *b = DrawWord(vocabulary, rng);
+  switch (RngBelow(rng, 5)) {
+    case 0:
+      fprintf(out, "<script type=\"text/javascript\">var %s = {\"%s\": %d, \"html\": \"<div>%s</div>\"};"
+              " if (a < b && c > d) { track('%s'); }</script>\n", a, b, RngBelow(rng, 10000), a, b);
+      break;
+    case 1:
+      fprintf(out, "<style>.%s { color: #%06x; margin: 0 %dpx; } p > a:hover { %s: none; }</style>\n",
+              a, RngBelow(rng, 0xffffff), RngBelow(rng, 40), b);
+      break;
+    case 2:
+      fprintf(out, "<!-- %s > %s -- %s -->\n", a, b, a);
+      break;
+    case 3:
+      fprintf(out, "<div class=\"ad-slot\" data-id=\"%d\"><img src=\"/img/%s.png\" alt=\"%s\"/></div>\n",
+              RngBelow(rng, 1000), a, b);
+      break;
+    default:
+      fprintf(out, "<SCRIPT src=\"/js/%s.js\"/>\n", a);
+  }
+}
+
+// One sentence of text.  mutations, when not NULL, swaps the occasional word so a
+// copied article isn't byte for byte the same as its source.
+static void WriteSentence(FILE *out, const vocabulary_t *vocabulary, rng_t *rng, rng_t *mutations) {
+  int n_words = 6 + RngBelow(rng, 16);
+  for (int i = 0; i < n_words; i++) {
+    const char *word = DrawWord(vocabulary, rng);
+    if (mutations != NULL && RngBelow(mutations, 50) == 0) word = DrawWord(vocabulary, mutations);
+    const char *glue = (i == 0) ? "" : " ";
+    switch (RngBelow(rng, 40)) {
+      case 0: glue = " &amp; "; break;
+      case 1: glue = " &mdash; "; break;
+      case 2: glue = (i == 0) ? "" : "&#39;s "; break;
+    }
+    fprintf(out, "%s%s", glue, word);
+  }
+  fputs(RngBelow(rng, 8) == 0 ? "? " : ". ", out);
+}
+
+static void WriteArticle(FILE *out, const corpus_config_t *config, const vocabulary_t *vocabulary, int article) {
+  char title[400];
+  int source = CopySource(config, article);
+  rng_t text = RngFor(config, kTextStream, source >= 0 ? source : article);
+  rng_t mutations = RngFor(config, kCopyStream, article);
+  rng_t *mutate = (source >= 0) ? &mutations : NULL;
+
+  MakeTitle(config, vocabulary, article, title, sizeof(title));
+  fprintf(out, "<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<meta charset=\"utf-8\">\n<title>%s</title>\n", title);
+  for (int i = RngBelow(&text, 3); i >= 0; i--) WriteNoise(out, vocabulary, &text);
+  fputs("</head>\n<body>\n<nav><ul>", out);
+  for (int i = 0; i < 6; i++) {
+    const char *word = DrawWord(vocabulary, &text);
+    fprintf(out, "<li><a href=\"/section/%s\">%s</a></li>", word, word);
+  }
+  fprintf(out, "</ul></nav>\n<article>\n<h1>%s</h1>\n", title);
+
+  // article lengths spread evenly from half to one and a half times the mean.
+  int n_words = config->mean_words / 2 + RngBelow(&text, config->mean_words + 1), written = 0;
+  while (written < n_words) {
+    fputs("<p>", out);
+    for (int i = 2 + RngBelow(&text, 5); i > 0 && written < n_words; i--, written += 13)
+      WriteSentence(out, vocabulary, &text, mutate);
+    fputs("</p>\n", out);
+    if (RngBelow(&text, 4) == 0) WriteNoise(out, vocabulary, &text);
+  }
+  fputs("</article>\n<footer>&copy; 2026 All rights reserved.</footer>\n</body>\n</html>\n", out);
+}
+
+// Feeds /////////////////
+
+static void WriteItem(FILE *out, const corpus_config_t *config, const vocabulary_t *vocabulary, int article) {
+  char title[400], url[128];
+  rng_t rng = RngFor(config, kTextStream, article);
+  MakeTitle(config, vocabulary, article, title, sizeof(title));
+  MakeArticleURL(config, article, url, sizeof(url));
+  fprintf(out, "<item>\n  <title>%s</title>\n  <link>%s</link>\n  <description>", title, url);
+  WriteSentence(out, vocabulary, &rng, NULL);
+  fprintf(out, "</description>\n  <pubDate>Sun, 18 Oct 2026 %02d:%02d:00 GMT</pubDate>\n</item>\n",
+          article / 60 % 24, article % 60);
+}
+
+// Articles are dealt out to the feeds in turn.  Each item may be followed by a
+// repeat of an earlier article's item, which will usually come from another feed.
+static void WriteFeed(FILE *out, const corpus_config_t *config, const vocabulary_t *vocabulary, int feed, int n_feeds) {
+  rng_t rng = RngFor(config, kFeedStream, feed);
+  fprintf(out, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<rss version=\"2.0\">\n<channel>\n"
+          "<title>Synthetic feed %d</title>\n<description>Generated by corpus-gen</description>\n", feed);
+  for (int article = feed; article < config->n_articles; article += n_feeds) {
+    WriteItem(out, config, vocabulary, article);
+    if (article > 0 && RngDouble(&rng) < config->dup_rate)
+      WriteItem(out, config, vocabulary, RngBelow(&rng, article));
+  }
+  fputs("</channel>\n</rss>\n", out);
+}
+
+// Archive /////////////////
+
+typedef struct {
+  const char *dir;
+  FILE *index;
+} archive_writer_t;
+
+// Opens the file url's body goes in, and adds url to the index as a successful fetch.
+static FILE *ArchiveAdd(archive_writer_t *archive, const char *url) {
+  char name[17], path[4096];
+  CurlConnectionArchiveBodyName(url, name);
+  snprintf(path, sizeof(path), "%s/bodies/%s", archive->dir, name);
+  FILE *body = fopen(path, "w");
+  if (body == NULL) {
+    perror(path);
+    exit(1);
+  }
+  fprintf(archive->index, "%s\t%d\t%s\n", name, CURLE_OK, url);
+  return body;
+}
+
+static void Usage(void) {
+  fprintf(stderr, "Usage: corpus-gen [--articles n] [--hosts n] [--feeds-per-host n] [--words n]\n"
+                  "                  [--vocabulary n] [--zipf s] [--dup-rate r] [--copy-rate r]\n"
+                  "                  [--seed n] --out dir\n");
+  exit(1);
+}
+
+static void ParseArguments(int argc, char **argv, corpus_config_t *config) {
+  config->n_articles = 10000;
+  config->n_hosts = 8;
+  config->feeds_per_host = 4;
+  config->mean_words = 600;
+  config->n_vocabulary = 50000;
+  config->zipf_s = 1.0;
+  config->dup_rate = 0.05;
+  config->copy_rate = 0.02;
+  config->seed = 107;
+  config->out_dir = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) Usage();
+    const char *flag = argv[i], *value = argv[++i];
+    if (strcmp(flag, "--articles") == 0) config->n_articles = atoi(value);
+    else if (strcmp(flag, "--hosts") == 0) config->n_hosts = atoi(value);
+    else if (strcmp(flag, "--feeds-per-host") == 0) config->feeds_per_host = atoi(value);
+    else if (strcmp(flag, "--words") == 0) config->mean_words = atoi(value);
+    else if (strcmp(flag, "--vocabulary") == 0) config->n_vocabulary = atoi(value);
+    else if (strcmp(flag, "--zipf") == 0) config->zipf_s = atof(value);
+    else if (strcmp(flag, "--dup-rate") == 0) config->dup_rate = atof(value);
+    else if (strcmp(flag, "--copy-rate") == 0) config->copy_rate = atof(value);
+    else if (strcmp(flag, "--seed") == 0) config->seed = strtoull(value, NULL, 10);
+    else if (strcmp(flag, "--out") == 0) config->out_dir = value;
+    else Usage();
+  }
+  if (config->out_dir == NULL || config->n_articles < 1 || config->n_vocabulary < 1 || config->mean_words < 1)
+    Usage();
+  if (config->n_hosts < 1 || config->n_hosts > MAX_HOSTS || config->feeds_per_host < 1 ||
+      config->feeds_per_host > MAX_FEEDS_PER_HOST) {
+    fprintf(stderr, "The crawler takes at most %d hosts and %d feeds per host.\n", MAX_HOSTS, MAX_FEEDS_PER_HOST);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv) {
+  corpus_config_t config;
+  vocabulary_t vocabulary;
+  archive_writer_t archive;
+  char path[4096], url[128];
+
+  ParseArguments(argc, argv, &config);
+  snprintf(path, sizeof(path), "%s/bodies", config.out_dir);
+  if ((mkdir(config.out_dir, 0777) != 0 && errno != EEXIST) || (mkdir(path, 0777) != 0 && errno != EEXIST)) {
+    perror(path);
+    return 1;
+  }
+  archive.dir = config.out_dir;
+  snprintf(path, sizeof(path), "%s/index.txt", config.out_dir);
+  archive.index = fopen(path, "w");
+  snprintf(path, sizeof(path), "%s/feeds.txt", config.out_dir);
+  FILE *feeds = fopen(path, "w");
+  if (archive.index == NULL || feeds == NULL) {
+    perror(path);
+    return 1;
+  }
+
+  VocabularyNew(&vocabulary, &config);
+
+  // Feeds are listed host by host, since the crawler groups consecutive feeds of
+  // the same host into one domain.
+  int n_feeds = config.n_hosts * config.feeds_per_host;
+  for (int host = 0; host < config.n_hosts; host++) {
+    for (int i = 0; i < config.feeds_per_host; i++) {
+      int feed = host * config.feeds_per_host + i;
+      MakeFeedURL(host, feed, url, sizeof(url));
+      fprintf(feeds, "Synthetic Feed %d: %s\n", feed, url);
+      FILE *out = ArchiveAdd(&archive, url);
+      WriteFeed(out, &config, &vocabulary, feed, n_feeds);
+      fclose(out);
+    }
+  }
+  fclose(feeds);
+
+  for (int article = 0; article < config.n_articles; article++) {
+    MakeArticleURL(&config, article, url, sizeof(url));
+    FILE *out = ArchiveAdd(&archive, url);
+    WriteArticle(out, &config, &vocabulary, article);
+    fclose(out);
+    if ((article + 1) % 100000 == 0) fprintf(stderr, "%d articles written\n", article + 1);
+  }
+  fclose(archive.index);
+  VocabularyDispose(&vocabulary);
+
+  printf("Wrote %d feeds and %d articles to %s.  Index them with:\n"
+         "  rss-news-search %s/feeds.txt --replay %s\n",
+         n_feeds, config.n_articles, config.out_dir, config.out_dir, config.out_dir);
+  return 0;
+}
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Usage: crawl-bench.sh n_articles routes-file [rss-news-search flags]
+#
+# Generates a corpus (once per size), serves it with mock-feed-server on a free
+# local port, and times a full crawl and index by rss-news-search against it.  The
+# server's summary afterwards gives the request latency percentiles.  Any further
+# arguments are passed on to rss-news-search, as in --fetch-cache bench-crawl/cache
+# to time a recrawl.
+
+n_articles=$1
+routes=$2
+shift 2
+corpus=bench-crawl/corpus-$n_articles
+port=${PORT:-18108}
+
+if [ ! -f "$corpus/feeds.txt" ]; then
+  ./corpus-gen --articles "$n_articles" --out "$corpus" > /dev/null || exit 1
+fi
+
+./mock-feed-server --archive "$corpus" --port "$port" --routes "$routes" > bench-crawl/server.txt &
+server=$!
+trap 'kill $server 2> /dev/null' EXIT
+sleep 0.5
+
+start=$(date +%s%N)
+./rss-news-search "$corpus/feeds.txt" --connect-to "127.0.0.1:$port" "$@" < /dev/null > bench-crawl/crawl.txt 2>&1
+end=$(date +%s%N)
+
+kill -INT $server
+wait $server 2> /dev/null
+trap - EXIT
+
+echo "crawl of $n_articles articles with $routes"
+grep -E "^(Processed|Downloads took|Processing took|Fetch cache|Content store)| came over as |so they weren't indexed" bench-crawl/crawl.txt
+echo "fetch failures reported: $(grep -c -E '^(Problem connecting|Could not get)' bench-crawl/crawl.txt)"
+echo "wall time: $(( (end - start) / 1000000 )) ms"
+echo
+tail -n +2 bench-crawl/server.txt
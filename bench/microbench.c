@@ -0,0 +1,472 @@
+/**
+ * File: microbench.c
+ * ------------------
+ * Microbenchmarks for the hot paths of indexing and querying, run over the offline
+ * corpus in data/pgo: hashing words, looking them up in db->words, recording
+ * occurrances, ranking postings, tokenizing, skipping markup and decoding escapes.
+ *
+ * Each benchmark runs in batches of at least kMinBatchNs, five times over, and the
+ * median batch is reported as ns/op.  Allocations are counted by wrapping malloc,
+ * calloc and realloc at link time (-Wl,--wrap=...), so bytes/op and allocs/op
+ * count what our code asks for.  Allocations made inside libc, by open_memstream
+ * and strdup for instance, aren't seen.
+ *
+ * Usage: microbench [--csv file] [--json file] [--filter substring]
+ * Run it from the top of the checkout, where data/pgo is.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <dirent.h>
+#include "searchdb.h"
+#include "streamtokenizer.h"
+#include "html-utils.h"
+
+// Allocation counting /////////////////
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+static long long allocated_bytes = 0, n_allocations = 0;
+
+void *__wrap_malloc(size_t size) {
+  allocated_bytes += size;
+  n_allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocated_bytes += n * size;
+  n_allocations++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *p, size_t size) {
+  allocated_bytes += size;
+  n_allocations++;
+  return __real_realloc(p, size);
+}
+
+// Timing /////////////////
+
+// Benchmarks bracket just the code being measured with BenchStart and BenchStop, so
+// setup like building a fresh database isn't counted.
+typedef struct {
+  long long ns, bytes, allocs, ops;
+  long long start_ns, start_bytes, start_allocs;
+} bench_timer_t;
+
+static bench_timer_t timer;
+
+static long long NowNs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void BenchStart(void) {
+  timer.start_bytes = allocated_bytes;
+  timer.start_allocs = n_allocations;
+  timer.start_ns = NowNs();
+}
+
+static void BenchStop(long long ops) {
+  timer.ns += NowNs() - timer.start_ns;
+  timer.bytes += allocated_bytes - timer.start_bytes;
+  timer.allocs += n_allocations - timer.start_allocs;
+  timer.ops += ops;
+}
+
+// Keeps results alive so the compiler can't drop the work that produced them.
+static volatile long long sink;
+
+// Corpus /////////////////
+
+static const char *const kTextDelimiters = " \t\n\r\b!@$%^*()_+={[}]|\\'\":;/?.>,<~`";
+
+typedef struct {
+  char *text;
+  size_t length;
+} document_t;
+
+typedef struct {
+  document_t *articles, *feeds;
+  int n_articles, n_feeds;
+  char (*words)[WORD_N_BYTES];   // every indexable word of every article, in order
+  int *word_article;             // which article each word came from
+  int n_words;
+  char (*misses)[WORD_N_BYTES];  // words that aren't in the corpus
+  char (*escaped)[256];          // text snippets with HTML escapes
+  int n_escaped;
+} corpus_t;
+
+static bool ReadDocument(const char *path, document_t *document) {
+  FILE *infile = fopen(path, "r");
+  if (infile == NULL) return false;
+  fseek(infile, 0, SEEK_END);
+  document->length = ftell(infile);
+  rewind(infile);
+  document->text = malloc(document->length + 1);
+  document->length = fread(document->text, 1, document->length, infile);
+  document->text[document->length] = '\0';
+  fclose(infile);
+  return true;
+}
+
+static int CompareNames(const void *a, const void *b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Reads every file in dir whose name ends in suffix, in name order.
+static document_t *ReadDocuments(const char *dir, const char *suffix, int *n_documents) {
+  DIR *d = opendir(dir);
+  char *names[1024];
+  int n_names = 0;
+  struct dirent *entry;
+  if (d == NULL) {
+    perror(dir);
+    exit(1);
+  }
+  while ((entry = readdir(d)) != NULL && n_names < 1024) {
+    size_t length = strlen(entry->d_name);
+    if (length > strlen(suffix) && strcmp(entry->d_name + length - strlen(suffix), suffix) == 0)
+      names[n_names++] = strdup(entry->d_name);
+  }
+  closedir(d);
+  qsort(names, n_names, sizeof(char*), CompareNames);
+
+  document_t *documents = malloc(n_names * sizeof(document_t));
+  for (int i = 0; i < n_names; i++) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+    if (!ReadDocument(path, &documents[i])) {
+      perror(path);
+      exit(1);
+    }
+    free(names[i]);
+  }
+  *n_documents = n_names;
+  return documents;
+}
+
+// Runs the same token loop ProcessArticle does, collecting the words it would index.
+static void ExtractWords(corpus_t *corpus) {
+  int allocated = 1 << 16;
+  char word[1024];
+  corpus->words = malloc(allocated * WORD_N_BYTES);
+  corpus->word_article = malloc(allocated * sizeof(int));
+  corpus->n_words = 0;
+  for (int i = 0; i < corpus->n_articles; i++) {
+    FILE *stream = fmemopen(corpus->articles[i].text, corpus->articles[i].length, "r");
+    streamtokenizer st;
+    STNew(&st, stream, kTextDelimiters, false);
+    while (STNextToken(&st, word, sizeof(word))) {
+      if (strcmp(word, "<") == 0) {
+        SkipIrrelevantContent(&st);
+        continue;
+      }
+      RemoveEscapeCharacters(word);
+      if (!WordIsWellFormed(word) || strlen(word) >= WORD_N_BYTES) continue;
+      if (corpus->n_words == allocated) {
+        allocated *= 2;
+        corpus->words = realloc(corpus->words, allocated * WORD_N_BYTES);
+        corpus->word_article = realloc(corpus->word_article, allocated * sizeof(int));
+      }
+      strcpy(corpus->words[corpus->n_words], word);
+      corpus->word_article[corpus->n_words++] = i;
+    }
+    STDispose(&st);
+    fclose(stream);
+  }
+
+  corpus->misses = malloc(corpus->n_words * WORD_N_BYTES);
+  for (int i = 0; i < corpus->n_words; i++)
+    snprintf(corpus->misses[i], WORD_N_BYTES, "%.29s9q", corpus->words[i]);
+}
+
+// Pulls every title and description out of the feeds, escapes and all.
+static void ExtractEscapedText(corpus_t *corpus) {
+  corpus->escaped = malloc(4096 * sizeof(corpus->escaped[0]));
+  corpus->n_escaped = 0;
+  for (int i = 0; i < corpus->n_feeds; i++) {
+    const char *text = corpus->feeds[i].text;
+    while (corpus->n_escaped < 4096 && (text = strstr(text, "<title>")) != NULL) {
+      text += strlen("<title>");
+      int length = strcspn(text, "<");
+      if (length > 255) length = 255;
+      memcpy(corpus->escaped[corpus->n_escaped], text, length);
+      corpus->escaped[corpus->n_escaped++][length] = '\0';
+    }
+  }
+}
+
+static void LoadCorpus(corpus_t *corpus) {
+  corpus->articles = ReadDocuments("data/pgo/articles", ".html", &corpus->n_articles);
+  corpus->feeds = ReadDocuments("data/pgo", ".xml.in", &corpus->n_feeds);
+  ExtractWords(corpus);
+  ExtractEscapedText(corpus);
+}
+
+// A database holding the corpus's articles, with no words recorded yet.  Article
+// i gets doc id i.
+static void BuildArticles(const corpus_t *corpus, search_db_t *db) {
+  char title[TITLE_N_BYTES];
+  InitDatabase(db);
+  for (int i = 0; i < corpus->n_articles; i++) {
+    snprintf(title, TITLE_N_BYTES, "article %d", i);
+    AddArticle(title, "", "", db);
+  }
+}
+
+static void RecordAllWords(const corpus_t *corpus, search_db_t *db) {
+  for (int i = 0; i < corpus->n_words; i++) {
+    char word[WORD_N_BYTES];
+    strcpy(word, corpus->words[i]);   // RecordOccurrance may truncate its argument
+    RecordOccurrance(word, corpus->word_article[i], db);
+  }
+}
+
+// Benchmarks /////////////////
+
+static void BenchStringHash(const corpus_t *corpus) {
+  long long total = 0;
+  BenchStart();
+  for (int i = 0; i < corpus->n_words; i++) total += StringHash(corpus->words[i], kword_buckets);
+  BenchStop(corpus->n_words);
+  sink = total;
+}
+
+// The shared database for the lookup benchmarks, built on first use.
+static search_db_t lookup_db;
+static bool lookup_db_built = false;
+
+static void EnsureLookupDatabase(const corpus_t *corpus) {
+  if (lookup_db_built) return;
+  BuildArticles(corpus, &lookup_db);
+  RecordAllWords(corpus, &lookup_db);
+  lookup_db_built = true;
+}
+
+static void BenchWordLookupHit(const corpus_t *corpus) {
+  long long hits = 0;
+  EnsureLookupDatabase(corpus);
+  BenchStart();
+  for (int i = 0; i < corpus->n_words; i++) hits += TermSetLookup(&lookup_db.words, corpus->words[i]) != NULL;
+  BenchStop(corpus->n_words);
+  sink = hits;
+}
+
+static void BenchWordLookupMiss(const corpus_t *corpus) {
+  long long hits = 0;
+  EnsureLookupDatabase(corpus);
+  BenchStart();
+  for (int i = 0; i < corpus->n_words; i++) hits += TermSetLookup(&lookup_db.words, corpus->misses[i]) != NULL;
+  BenchStop(corpus->n_words);
+  sink = hits;
+}
+
+static void BenchRecordOccurrance(const corpus_t *corpus) {
+  search_db_t db;
+  BuildArticles(corpus, &db);
+  BenchStart();
+  RecordAllWords(corpus, &db);
+  BenchStop(corpus->n_words);
+  DisposeDatabase(&db);
+}
+
+// Counted per posting sorted.
+static void BenchSortOccurrances(const corpus_t *corpus) {
+  search_db_t db;
+  long long n_postings = 0;
+  BuildArticles(corpus, &db);
+  RecordAllWords(corpus, &db);
+  for (int i = 0; i < TermSetCount(&db.words); i++)
+    n_postings += OccurranceVectorLength(&TermSetAt(&db.words, i)->occurrances);
+  BenchStart();
+  SortOccurrances(&db);
+  BenchStop(n_postings);
+  DisposeDatabase(&db);
+}
+
+// Counted per byte of article text, so the three scanning benchmarks compare.
+static void BenchNextToken(const corpus_t *corpus) {
+  char word[1024];
+  long long n_tokens = 0;
+  for (int i = 0; i < corpus->n_articles; i++) {
+    FILE *stream = fmemopen(corpus->articles[i].text, corpus->articles[i].length, "r");
+    streamtokenizer st;
+    STNew(&st, stream, kTextDelimiters, false);
+    BenchStart();
+    while (STNextToken(&st, word, sizeof(word))) n_tokens++;
+    BenchStop(corpus->articles[i].length);
+    STDispose(&st);
+    fclose(stream);
+  }
+  sink = n_tokens;
+}
+
+static void BenchGetNextTag(const corpus_t *corpus) {
+  char tag[1024];
+  long long n_tags = 0;
+  for (int i = 0; i < corpus->n_feeds; i++) {
+    FILE *stream = fmemopen(corpus->feeds[i].text, corpus->feeds[i].length, "r");
+    streamtokenizer st;
+    STNew(&st, stream, kTextDelimiters, false);
+    BenchStart();
+    while (GetNextTag(&st, tag, sizeof(tag))) n_tags++;
+    BenchStop(corpus->feeds[i].length);
+    STDispose(&st);
+    fclose(stream);
+  }
+  sink = n_tags;
+}
+
+// The token loop of ProcessArticle without the indexing: tokens, markup skipping,
+// escapes and the well-formedness check.
+static void BenchScanArticle(const corpus_t *corpus) {
+  char word[1024];
+  long long n_words = 0;
+  for (int i = 0; i < corpus->n_articles; i++) {
+    FILE *stream = fmemopen(corpus->articles[i].text, corpus->articles[i].length, "r");
+    streamtokenizer st;
+    STNew(&st, stream, kTextDelimiters, false);
+    BenchStart();
+    while (STNextToken(&st, word, sizeof(word))) {
+      if (word[0] == '<' && word[1] == '\0') SkipIrrelevantContent(&st);
+      else {
+        RemoveEscapeCharacters(word);
+        n_words += WordIsWellFormed(word);
+      }
+    }
+    BenchStop(corpus->articles[i].length);
+    STDispose(&st);
+    fclose(stream);
+  }
+  sink = n_words;
+}
+
+static void BenchRemoveEscapeCharacters(const corpus_t *corpus) {
+  char text[256];
+  long long n_bytes = 0;
+  for (int i = 0; i < corpus->n_escaped; i++) {
+    strcpy(text, corpus->escaped[i]);
+    BenchStart();
+    RemoveEscapeCharacters(text);
+    BenchStop(1);
+    n_bytes += strlen(text);
+  }
+  sink = n_bytes;
+}
+
+typedef struct {
+  const char *name;
+  const char *unit;    // what one op is
+  void (*run)(const corpus_t *corpus);
+} benchmark_t;
+
+static const benchmark_t kBenchmarks[] = {
+  { "string_hash", "word", BenchStringHash },
+  { "word_lookup_hit", "lookup", BenchWordLookupHit },
+  { "word_lookup_miss", "lookup", BenchWordLookupMiss },
+  { "record_occurrance", "word", BenchRecordOccurrance },
+  { "sort_occurrances", "posting", BenchSortOccurrances },
+  { "st_next_token", "byte", BenchNextToken },
+  { "get_next_tag", "byte", BenchGetNextTag },
+  { "scan_article", "byte", BenchScanArticle },
+  { "remove_escape_characters", "string", BenchRemoveEscapeCharacters },
+};
+
+// Harness /////////////////
+
+static const long long kMinBatchNs = 100000000;
+#define N_BATCHES 5
+
+typedef struct {
+  const benchmark_t *benchmark;
+  long long ops;
+  double ns_per_op, bytes_per_op, allocs_per_op;
+} result_t;
+
+static int CompareResultsByNs(const void *a, const void *b) {
+  double x = ((const result_t*)a)->ns_per_op, y = ((const result_t*)b)->ns_per_op;
+  return (x > y) - (x < y);
+}
+
+static result_t RunBenchmark(const benchmark_t *benchmark, const corpus_t *corpus) {
+  result_t batches[N_BATCHES];
+  benchmark->run(corpus);   // warm up, and build anything built on first use
+  for (int i = 0; i < N_BATCHES; i++) {
+    memset(&timer, 0, sizeof(timer));
+    while (timer.ns < kMinBatchNs) benchmark->run(corpus);
+    batches[i].benchmark = benchmark;
+    batches[i].ops = timer.ops;
+    batches[i].ns_per_op = (double)timer.ns / timer.ops;
+    batches[i].bytes_per_op = (double)timer.bytes / timer.ops;
+    batches[i].allocs_per_op = (double)timer.allocs / timer.ops;
+  }
+  qsort(batches, N_BATCHES, sizeof(result_t), CompareResultsByNs);
+  return batches[N_BATCHES / 2];
+}
+
+static void WriteCSV(const char *path, const result_t results[], int n_results) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(out, "benchmark,unit,ops,ns_per_op,bytes_per_op,allocs_per_op\n");
+  for (int i = 0; i < n_results; i++)
+    fprintf(out, "%s,%s,%lld,%.3f,%.3f,%.4f\n", results[i].benchmark->name, results[i].benchmark->unit,
+            results[i].ops, results[i].ns_per_op, results[i].bytes_per_op, results[i].allocs_per_op);
+  fclose(out);
+}
+
+static void WriteJSON(const char *path, const result_t results[], int n_results) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(out, "[\n");
+  for (int i = 0; i < n_results; i++)
+    fprintf(out, "  {\"benchmark\": \"%s\", \"unit\": \"%s\", \"ops\": %lld, \"ns_per_op\": %.3f, "
+            "\"bytes_per_op\": %.3f, \"allocs_per_op\": %.4f}%s\n",
+            results[i].benchmark->name, results[i].benchmark->unit, results[i].ops, results[i].ns_per_op,
+            results[i].bytes_per_op, results[i].allocs_per_op, (i + 1 < n_results) ? "," : "");
+  fprintf(out, "]\n");
+  fclose(out);
+}
+
+int main(int argc, char **argv) {
+  const char *csv = NULL, *json = NULL, *filter = NULL;
+  const int n_benchmarks = sizeof(kBenchmarks) / sizeof(kBenchmarks[0]);
+  result_t results[sizeof(kBenchmarks) / sizeof(kBenchmarks[0])];
+  int n_results = 0;
+  corpus_t corpus;
+
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--csv") == 0) csv = argv[i + 1];
+    else if (strcmp(argv[i], "--json") == 0) json = argv[i + 1];
+    else if (strcmp(argv[i], "--filter") == 0) filter = argv[i + 1];
+  }
+
+  LoadCorpus(&corpus);
+  printf("%d articles, %d feeds, %d words\n\n", corpus.n_articles, corpus.n_feeds, corpus.n_words);
+  printf("%-26s %-8s %12s %12s %12s\n", "benchmark", "per", "ns/op", "bytes/op", "allocs/op");
+  for (int i = 0; i < n_benchmarks; i++) {
+    if (filter != NULL && strstr(kBenchmarks[i].name, filter) == NULL) continue;
+    result_t *result = &results[n_results++];
+    *result = RunBenchmark(&kBenchmarks[i], &corpus);
+    printf("%-26s %-8s %12.2f %12.2f %12.4f\n", kBenchmarks[i].name, kBenchmarks[i].unit,
+           result->ns_per_op, result->bytes_per_op, result->allocs_per_op);
+    fflush(stdout);
+  }
+
+  if (csv != NULL) WriteCSV(csv, results, n_results);
+  if (json != NULL) WriteJSON(json, results, n_results);
+  return 0;
+}
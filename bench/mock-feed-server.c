@@ -0,0 +1,676 @@
+/**
+ * File: mock-feed-server.c
+ * ------------------------
+ * A small HTTP/1.1 server that stands in for the news sites, so crawls can be
+ * benchmarked without the internet.  It serves a fetch archive (see curlconnection.h),
+ * either one recorded with --record or one written by corpus-gen, looking each
+ * request up as http://<Host header><path>.  Point the crawler at it with
+ * --connect-to, which sends every host to this one port:
+ *
+ *   mock-feed-server --archive /tmp/corpus --port 8108 --routes bench/crawl-routes.txt
+ *   rss-news-search /tmp/corpus/feeds.txt --connect-to 127.0.0.1:8108
+ *
+ * How each request is answered comes from the routes file.  Each line is a path
+ * prefix followed by settings, and a request takes the line with the longest prefix
+ * that matches its path.  A prefix that doesn't start with '/' is matched against
+ * the host and path together, as in host3.example/news/, for one host's settings.
+ * Settings left out keep their defaults (no delay, no errors, Content-Length bodies,
+ * no compression, no redirects, validators sent, no concurrency limit):
+ *
+ *   /rss/    latency=uniform:20:80 error=0.02:503
+ *   /news/   latency=lognormal:40:0.8 chunked=1 gzip=1 redirects=2 bandwidth=512
+ *
+ *   latency=fixed:ms | uniform:min_ms:max_ms | lognormal:median_ms:sigma
+ *             delay before the response starts
+ *   error=rate[:status]   share of requests that fail, with status 500 unless given
+ *   chunked=1             Transfer-Encoding: chunked instead of Content-Length
+ *   gzip=1                gzip the body for clients that send Accept-Encoding: gzip
+ *   redirects=n           answer with a chain of n 302s before the real response
+ *   bandwidth=KB/s        pace the body
+ *   keepalive=0           close the connection after each response
+ *   validators=0          no ETag or Last-Modified, and no 304s
+ *   concurrency=n         answer 429 at once to any request that would make more
+ *                         than n in flight to its host
+ *
+ * Otherwise every body goes out with an ETag (a hash of the body) and a
+ * Last-Modified (the body file's mtime), and a request that sends a matching
+ * If-None-Match, or an If-Modified-Since no earlier than the mtime, is answered
+ * 304 Not Modified.  Rewriting a body file in the archive makes it "change".
+ *
+ * Connections are kept alive unless a route or the client says otherwise.  Each
+ * connection gets its own thread; the crawler opens at most one per download thread.
+ * SIGINT or SIGTERM stops the server and prints a summary of what it served,
+ * including percentiles of the time spent on each request.
+ *
+ * Usage: mock-feed-server --archive dir [--port n] [--routes file] [--seed n]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <semaphore.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <zlib.h>
+#include "curlconnection.h"
+
+#define HEADER_N_BYTES 16384
+#define MAX_ROUTES 64
+#define MAX_SAMPLES (1 << 20)
+#define MAX_HOSTS 256
+
+typedef enum { LATENCY_NONE, LATENCY_FIXED, LATENCY_UNIFORM, LATENCY_LOGNORMAL } latency_kind_t;
+
+typedef struct {
+  char prefix[256];
+  latency_kind_t latency;
+  double latency_a, latency_b;   // fixed: a | uniform: a..b | lognormal: median a, sigma b
+  double error_rate;
+  int error_status;
+  bool chunked;
+  bool gzip;
+  int redirects;
+  long bandwidth_kbs;            // 0 means unlimited
+  bool keepalive;
+  bool validators;
+  int concurrency;               // 0 means unlimited
+} route_t;
+
+typedef struct {
+  route_t routes[MAX_ROUTES];
+  int n_routes;
+  route_t default_route;
+  unsigned long long seed;
+} server_config_t;
+
+typedef struct {
+  char host[256];
+  int in_flight;
+  long n_refused;                // 429s for going over a route's concurrency
+} host_load_t;
+
+// What the server did, for the summary at exit.
+typedef struct {
+  sem_t lock;
+  host_load_t hosts[MAX_HOSTS];  // for routes with a concurrency; also under lock
+  int n_hosts;
+  long n_requests, n_connections;
+  long n_by_class[6];            // 1xx..5xx, by status / 100
+  long long bytes_sent;
+  double *ms;                    // time from request to last byte, one per request
+  int n_ms;
+} server_stats_t;
+
+typedef struct {
+  int fd;
+  const server_config_t *config;
+  server_stats_t *stats;
+  unsigned long long rng;
+} connection_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void RequestStop(int signal_number) {
+  stop_requested = 1;
+}
+
+static double NowMs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
+
+static void SleepMs(double ms) {
+  if (ms <= 0) return;
+  struct timespec delay = { (time_t)(ms / 1000), (long)(fmod(ms, 1000) * 1e6) };
+  while (nanosleep(&delay, &delay) != 0 && errno == EINTR && !stop_requested) ;
+}
+
+// xorshift64*, one per connection so threads don't share state.
+static double RandomDouble(unsigned long long *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double DrawLatencyMs(const route_t *route, unsigned long long *rng) {
+  switch (route->latency) {
+    case LATENCY_FIXED: return route->latency_a;
+    case LATENCY_UNIFORM: return route->latency_a + RandomDouble(rng) * (route->latency_b - route->latency_a);
+    case LATENCY_LOGNORMAL: {
+      // Box-Muller for a standard normal draw.
+      double u1 = RandomDouble(rng), u2 = RandomDouble(rng);
+      double z = sqrt(-2 * log(u1 > 0 ? u1 : 1e-12)) * cos(2 * M_PI * u2);
+      return route->latency_a * exp(route->latency_b * z);
+    }
+    default: return 0;
+  }
+}
+
+// Routes /////////////////
+
+static void DefaultRoute(route_t *route, const char *prefix) {
+  memset(route, 0, sizeof(*route));
+  snprintf(route->prefix, sizeof(route->prefix), "%s", prefix);
+  route->error_status = 500;
+  route->keepalive = true;
+  route->validators = true;
+}
+
+static bool ParseSetting(route_t *route, const char *setting) {
+  if (strncmp(setting, "latency=fixed:", 14) == 0) {
+    route->latency = LATENCY_FIXED;
+    return sscanf(setting + 14, "%lf", &route->latency_a) == 1;
+  }
+  if (strncmp(setting, "latency=uniform:", 16) == 0) {
+    route->latency = LATENCY_UNIFORM;
+    return sscanf(setting + 16, "%lf:%lf", &route->latency_a, &route->latency_b) == 2;
+  }
+  if (strncmp(setting, "latency=lognormal:", 18) == 0) {
+    route->latency = LATENCY_LOGNORMAL;
+    return sscanf(setting + 18, "%lf:%lf", &route->latency_a, &route->latency_b) == 2;
+  }
+  if (strncmp(setting, "error=", 6) == 0)
+    return sscanf(setting + 6, "%lf:%d", &route->error_rate, &route->error_status) >= 1;
+  int flag;
+  if (sscanf(setting, "chunked=%d", &flag) == 1) { route->chunked = flag; return true; }
+  if (sscanf(setting, "gzip=%d", &flag) == 1) { route->gzip = flag; return true; }
+  if (sscanf(setting, "keepalive=%d", &flag) == 1) { route->keepalive = flag; return true; }
+  if (sscanf(setting, "validators=%d", &flag) == 1) { route->validators = flag; return true; }
+  if (sscanf(setting, "redirects=%d", &route->redirects) == 1) return true;
+  if (sscanf(setting, "bandwidth=%ld", &route->bandwidth_kbs) == 1) return true;
+  if (sscanf(setting, "concurrency=%d", &route->concurrency) == 1) return true;
+  return false;
+}
+
+static void LoadRoutes(server_config_t *config, const char *routes_file) {
+  char line[1024];
+  FILE *infile = fopen(routes_file, "r");
+  if (infile == NULL) {
+    perror(routes_file);
+    exit(1);
+  }
+  for (int line_number = 1; fgets(line, sizeof(line), infile) != NULL; line_number++) {
+    char *saveptr, *field = strtok_r(line, " \t\r\n", &saveptr);
+    if (field == NULL || field[0] == '#') continue;
+    if (config->n_routes == MAX_ROUTES) {
+      fprintf(stderr, "%s:%d: only %d routes are supported\n", routes_file, line_number, MAX_ROUTES);
+      exit(1);
+    }
+    route_t *route = &config->routes[config->n_routes++];
+    DefaultRoute(route, field);
+    while ((field = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+      if (!ParseSetting(route, field)) {
+        fprintf(stderr, "%s:%d: can't make sense of \"%s\"\n", routes_file, line_number, field);
+        exit(1);
+      }
+    }
+  }
+  fclose(infile);
+}
+
+static const route_t *MatchRoute(const server_config_t *config, const char *host, const char *path) {
+  const route_t *best = &config->default_route;
+  size_t best_length = 0;
+  char host_path[4400];
+  snprintf(host_path, sizeof(host_path), "%s%s", host, path);
+  for (int i = 0; i < config->n_routes; i++) {
+    const char *prefix = config->routes[i].prefix;
+    size_t length = strlen(prefix);
+    if (length >= best_length && strncmp(prefix[0] == '/' ? path : host_path, prefix, length) == 0) {
+      best = &config->routes[i];
+      best_length = length;
+    }
+  }
+  return best;
+}
+
+// Responses /////////////////
+
+static bool SendAll(int fd, const void *data, size_t length) {
+  const char *bytes = data;
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) continue;
+    if (sent <= 0) return false;
+    bytes += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// Sends the body in pieces, pacing them to the route's bandwidth, and framing them
+// as chunks if asked.
+static bool SendBody(int fd, const route_t *route, const char *body, size_t length) {
+  const size_t kPiece = 16384;
+  for (size_t offset = 0; offset < length; offset += kPiece) {
+    size_t n = (length - offset < kPiece) ? length - offset : kPiece;
+    if (route->bandwidth_kbs > 0) SleepMs(n * 1000.0 / (route->bandwidth_kbs * 1024.0));
+    if (route->chunked) {
+      char size_line[32];
+      int size_length = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+      if (!SendAll(fd, size_line, size_length)) return false;
+    }
+    if (!SendAll(fd, body + offset, n)) return false;
+    if (route->chunked && !SendAll(fd, "\r\n", 2)) return false;
+  }
+  return !route->chunked || SendAll(fd, "0\r\n\r\n", 5);
+}
+
+// gzip's the body into a new buffer, which the caller frees.
+static char *Gzip(const char *body, size_t length, size_t *gzipped_length) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+  size_t bound = deflateBound(&z, length);
+  char *out = malloc(bound);
+  z.next_in = (Bytef*)body;
+  z.avail_in = length;
+  z.next_out = (Bytef*)out;
+  z.avail_out = bound;
+  deflate(&z, Z_FINISH);
+  *gzipped_length = z.total_out;
+  deflateEnd(&z);
+  return out;
+}
+
+static char *ReadFile(const char *path, size_t *length) {
+  FILE *infile = fopen(path, "r");
+  if (infile == NULL) return NULL;
+  fseek(infile, 0, SEEK_END);
+  *length = ftell(infile);
+  rewind(infile);
+  char *contents = malloc(*length + 1);
+  *length = fread(contents, 1, *length, infile);
+  fclose(infile);
+  return contents;
+}
+
+static const char *StatusText(int status) {
+  switch (status) {
+    case 200: return "OK";
+    case 302: return "Found";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "Status";
+  }
+}
+
+// Sends a short plain-text response.  Returns false if the connection died.
+static bool SendSimple(int fd, int status, const char *extra_headers, bool keepalive, long long *bytes_sent) {
+  char response[1024], text[64];
+  int text_length = snprintf(text, sizeof(text), "%d %s\n", status, StatusText(status));
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 %d %s\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n%sConnection: %s\r\n\r\n%s",
+                        status, StatusText(status), text_length, extra_headers,
+                        keepalive ? "keep-alive" : "close", text);
+  *bytes_sent += length;
+  return SendAll(fd, response, length);
+}
+
+// Requests /////////////////
+
+typedef struct {
+  char method[16];
+  char target[4096];
+  char host[256];
+  bool accepts_gzip;
+  bool keepalive;
+  char if_none_match[256];       // "" if not sent
+  char if_modified_since[64];    // likewise
+} request_t;
+
+// Parses the request line and the few headers we care about.  False if malformed.
+static bool ParseRequest(char *header, request_t *request) {
+  char version[16];
+  char *saveptr, *line = strtok_r(header, "\r\n", &saveptr);
+  if (line == NULL || sscanf(line, "%15s %4095s %15s", request->method, request->target, version) != 3) return false;
+  request->host[0] = '\0';
+  request->accepts_gzip = false;
+  request->if_none_match[0] = request->if_modified_since[0] = '\0';
+  request->keepalive = (strcmp(version, "HTTP/1.1") == 0);
+  while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL) {
+    char *value = strchr(line, ':');
+    if (value == NULL) continue;
+    *value++ = '\0';
+    value += strspn(value, " \t");
+    if (strcasecmp(line, "Host") == 0) {
+      snprintf(request->host, sizeof(request->host), "%s", value);
+      request->host[strcspn(request->host, ":")] = '\0';   // the port isn't part of the archive's urls
+    } else if (strcasecmp(line, "Accept-Encoding") == 0) {
+      request->accepts_gzip = (strstr(value, "gzip") != NULL);
+    } else if (strcasecmp(line, "If-None-Match") == 0) {
+      snprintf(request->if_none_match, sizeof(request->if_none_match), "%s", value);
+    } else if (strcasecmp(line, "If-Modified-Since") == 0) {
+      snprintf(request->if_modified_since, sizeof(request->if_modified_since), "%s", value);
+    } else if (strcasecmp(line, "Connection") == 0) {
+      if (strcasecmp(value, "close") == 0) request->keepalive = false;
+      if (strcasecmp(value, "keep-alive") == 0) request->keepalive = true;
+    }
+  }
+  return request->host[0] != '\0';
+}
+
+// Redirect hops are tracked with a "hop" query parameter on the end of the target,
+// which is stripped before the archive lookup.
+static int TakeHop(char *target) {
+  char *hop = strstr(target, "__hop=");
+  if (hop == NULL) return 0;
+  int n = atoi(hop + 6);
+  hop[-1] = '\0';   // drops the '?' or '&' in front of it, and the rest
+  return n;
+}
+
+// Finds host's entry, adding it if there's room.  Called with the stats lock held.
+static host_load_t *HostLoad(server_stats_t *stats, const char *host) {
+  for (int i = 0; i < stats->n_hosts; i++)
+    if (strcmp(stats->hosts[i].host, host) == 0) return &stats->hosts[i];
+  if (stats->n_hosts == MAX_HOSTS) return NULL;
+  host_load_t *load = &stats->hosts[stats->n_hosts++];
+  snprintf(load->host, sizeof(load->host), "%s", host);
+  return load;
+}
+
+static int Answer(connection_t *connection, request_t *request, const route_t *route, int hop, long long *bytes_sent);
+
+// Answers one request.  Returns the status sent, or -1 if the connection died.
+static int Respond(connection_t *connection, request_t *request, long long *bytes_sent) {
+  int hop = TakeHop(request->target);
+  const route_t *route = MatchRoute(connection->config, request->host, request->target);
+  if (route->concurrency <= 0) return Answer(connection, request, route, hop, bytes_sent);
+
+  // the request counts against its host's concurrency until it's been answered.
+  server_stats_t *stats = connection->stats;
+  sem_wait(&stats->lock);
+  host_load_t *load = HostLoad(stats, request->host);
+  bool admitted = load == NULL || load->in_flight < route->concurrency;
+  if (load != NULL) {
+    if (admitted) load->in_flight++;
+    else load->n_refused++;
+  }
+  sem_post(&stats->lock);
+  if (!admitted) {
+    bool keepalive = request->keepalive && route->keepalive;
+    return SendSimple(connection->fd, 429, "Retry-After: 1\r\n", keepalive, bytes_sent) ? 429 : -1;
+  }
+  int status = Answer(connection, request, route, hop, bytes_sent);
+  if (load != NULL) {
+    sem_wait(&stats->lock);
+    load->in_flight--;
+    sem_post(&stats->lock);
+  }
+  return status;
+}
+
+static int Answer(connection_t *connection, request_t *request, const route_t *route, int hop, long long *bytes_sent) {
+  int fd = connection->fd;
+  bool keepalive = request->keepalive && route->keepalive;
+
+  if (strcmp(request->method, "GET") != 0 && strcmp(request->method, "HEAD") != 0)
+    return SendSimple(fd, 405, "", keepalive, bytes_sent) ? 405 : -1;
+
+  SleepMs(DrawLatencyMs(route, &connection->rng));
+  if (route->error_rate > 0 && RandomDouble(&connection->rng) < route->error_rate)
+    return SendSimple(fd, route->error_status, "", keepalive, bytes_sent) ? route->error_status : -1;
+
+  if (hop < route->redirects) {
+    char location[4500];
+    snprintf(location, sizeof(location), "Location: http://%s%s%c__hop=%d\r\n", request->host, request->target,
+             strchr(request->target, '?') ? '&' : '?', hop + 1);
+    return SendSimple(fd, 302, location, keepalive, bytes_sent) ? 302 : -1;
+  }
+
+  char url[4400], path[4096];
+  CURLcode code;
+  size_t length;
+  char *body = NULL;
+  snprintf(url, sizeof(url), "http://%s%s", request->host, request->target);
+  if (!CurlConnectionArchiveLookup(url, path, sizeof(path), &code) || code != CURLE_OK ||
+      (body = ReadFile(path, &length)) == NULL)
+    return SendSimple(fd, 404, "", keepalive, bytes_sent) ? 404 : -1;
+
+  char validators[256] = "";
+  if (route->validators) {
+    struct stat info;
+    char etag[32], last_modified[64];
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)body[i]) * 1099511628211ULL;
+    snprintf(etag, sizeof(etag), "\"%016llx\"", hash);
+    struct tm modified_tm;
+    time_t modified = stat(path, &info) == 0 ? info.st_mtime : 0;
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&modified, &modified_tm));
+    snprintf(validators, sizeof(validators), "ETag: %s\r\nLast-Modified: %s\r\n", etag, last_modified);
+
+    // If-None-Match wins when both are sent, as RFC 7232 has it.
+    bool unchanged;
+    if (request->if_none_match[0] != '\0')
+      unchanged = strstr(request->if_none_match, etag) != NULL || strcmp(request->if_none_match, "*") == 0;
+    else if (request->if_modified_since[0] != '\0') {
+      time_t since = curl_getdate(request->if_modified_since, NULL);
+      unchanged = since >= 0 && modified <= since;
+    }
+    else unchanged = false;
+    if (unchanged) {
+      free(body);
+      char header[512];
+      int header_length = snprintf(header, sizeof(header), "HTTP/1.1 304 Not Modified\r\n%sConnection: %s\r\n\r\n",
+                                   validators, keepalive ? "keep-alive" : "close");
+      *bytes_sent += header_length;
+      return SendAll(fd, header, header_length) ? 304 : -1;
+    }
+  }
+
+  bool gzip = route->gzip && request->accepts_gzip;
+  if (gzip) {
+    size_t gzipped_length;
+    char *gzipped = Gzip(body, length, &gzipped_length);
+    if (gzipped != NULL) {
+      free(body);
+      body = gzipped;
+      length = gzipped_length;
+    } else gzip = false;
+  }
+
+  char header[1024], content_length[64];
+  if (route->chunked) strcpy(content_length, "Transfer-Encoding: chunked\r\n");
+  else snprintf(content_length, sizeof(content_length), "Content-Length: %zu\r\n", length);
+  int header_length = snprintf(header, sizeof(header),
+                               "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s%s%sConnection: %s\r\n\r\n",
+                               strstr(request->target, ".xml") ? "application/rss+xml" : "text/html; charset=utf-8",
+                               content_length, gzip ? "Content-Encoding: gzip\r\n" : "", validators,
+                               keepalive ? "keep-alive" : "close");
+  bool ok = SendAll(fd, header, header_length);
+  if (ok && strcmp(request->method, "GET") == 0) ok = SendBody(fd, route, body, length);
+  *bytes_sent += header_length + length;
+  free(body);
+  return ok ? 200 : -1;
+}
+
+static void RecordRequest(server_stats_t *stats, int status, double ms, long long bytes_sent) {
+  sem_wait(&stats->lock);
+  stats->n_requests++;
+  if (status >= 100 && status < 600) stats->n_by_class[status / 100]++;
+  stats->bytes_sent += bytes_sent;
+  if (stats->n_ms < MAX_SAMPLES) stats->ms[stats->n_ms++] = ms;
+  sem_post(&stats->lock);
+}
+
+// Reads and answers requests until the client closes, asks to close, or a route
+// turns keep-alive off.
+static void *ServeConnection(void *arg) {
+  connection_t *connection = arg;
+  char header[HEADER_N_BYTES + 1] = "";
+  int length = 0;
+
+  while (!stop_requested) {
+    char *end = NULL;
+    while ((end = strstr(header, "\r\n\r\n")) == NULL) {
+      if (length == HEADER_N_BYTES) goto done;
+      ssize_t n = recv(connection->fd, header + length, HEADER_N_BYTES - length, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) goto done;
+      length += n;
+      header[length] = '\0';
+    }
+    double start = NowMs();
+    int header_length = end + 4 - header;
+    end[2] = '\0';
+
+    request_t request;
+    long long bytes_sent = 0;
+    int status;
+    bool keepalive = false;
+    if (!ParseRequest(header, &request)) status = SendSimple(connection->fd, 400, "", false, &bytes_sent) ? 400 : -1;
+    else {
+      status = Respond(connection, &request, &bytes_sent);
+      keepalive = request.keepalive && MatchRoute(connection->config, request.host, request.target)->keepalive;
+    }
+    RecordRequest(connection->stats, status, NowMs() - start, bytes_sent);
+    if (status < 0 || !keepalive) break;
+
+    // requests are bodiless, so whatever follows the header is the next request.
+    memmove(header, header + header_length, length - header_length);
+    length -= header_length;
+    header[length] = '\0';
+  }
+done:
+  close(connection->fd);
+  free(connection);
+  return NULL;
+}
+
+// Main /////////////////
+
+static int CompareDoubles(const void *a, const void *b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void PrintSummary(server_stats_t *stats) {
+  qsort(stats->ms, stats->n_ms, sizeof(double), CompareDoubles);
+  printf("%ld connections, %ld requests, %.1f MB sent\n", stats->n_connections, stats->n_requests,
+         stats->bytes_sent / 1e6);
+  printf("status 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld\n", stats->n_by_class[2], stats->n_by_class[3],
+         stats->n_by_class[4], stats->n_by_class[5]);
+  if (stats->n_ms > 0) {
+    const double kPercentiles[] = { 50, 90, 95, 99, 100 };
+    printf("ms per request:");
+    for (int i = 0; i < 5; i++) {
+      int index = (int)(kPercentiles[i] / 100 * (stats->n_ms - 1) + 0.5);
+      printf("  p%g %.1f", kPercentiles[i], stats->ms[index]);
+    }
+    printf("\n");
+  }
+  for (int i = 0; i < stats->n_hosts; i++)
+    if (stats->hosts[i].n_refused > 0)
+      printf("%s: %ld requests refused with 429 for going over its concurrency\n", stats->hosts[i].host,
+             stats->hosts[i].n_refused);
+  fflush(stdout);
+}
+
+static int Listen(int port) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0), on = 1;
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (fd < 0 || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, 256) != 0) {
+    perror("mock-feed-server");
+    exit(1);
+  }
+  return fd;
+}
+
+static void Usage(void) {
+  fprintf(stderr, "Usage: mock-feed-server --archive dir [--port n] [--routes file] [--seed n]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  server_config_t config;
+  server_stats_t stats;
+  const char *archive_dir = NULL, *routes_file = NULL;
+  int port = 8108;
+
+  config.n_routes = 0;
+  config.seed = 107;
+  DefaultRoute(&config.default_route, "");
+  for (int i = 1; i < argc; i++) {
+    if (i + 1 >= argc) Usage();
+    if (strcmp(argv[i], "--archive") == 0) archive_dir = argv[++i];
+    else if (strcmp(argv[i], "--port") == 0) port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--routes") == 0) routes_file = argv[++i];
+    else if (strcmp(argv[i], "--seed") == 0) config.seed = strtoull(argv[++i], NULL, 10);
+    else Usage();
+  }
+  if (archive_dir == NULL) Usage();
+  if (routes_file != NULL) LoadRoutes(&config, routes_file);
+  if (!CurlConnectionOpenArchive(FETCH_REPLAY, archive_dir)) return 1;
+
+  memset(&stats, 0, sizeof(stats));
+  sem_init(&stats.lock, 0, 1);
+  stats.ms = malloc(MAX_SAMPLES * sizeof(double));
+
+  // No SA_RESTART, so accept() returns when a stop is requested.
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RequestStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  int listen_fd = Listen(port);
+  printf("Serving %s on 127.0.0.1:%d\n", archive_dir, port);
+  fflush(stdout);
+
+  while (!stop_requested) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) continue;
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    connection_t *connection = malloc(sizeof(connection_t));
+    connection->fd = fd;
+    connection->config = &config;
+    connection->stats = &stats;
+    sem_wait(&stats.lock);
+    connection->rng = config.seed * 0x9e3779b97f4a7c15ULL + ++stats.n_connections;
+    sem_post(&stats.lock);
+
+    pthread_t thread;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attributes, ServeConnection, connection) != 0) {
+      close(fd);
+      free(connection);
+    }
+    pthread_attr_destroy(&attributes);
+  }
+
+  close(listen_fd);
+  sem_wait(&stats.lock);
+  PrintSummary(&stats);
+  return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Usage: pgo-report.sh feeds-file queries-file binary...
+#
+# Runs each binary on the same index-and-query workload several times and prints
+# the best and median wall-clock time, so a profile-guided build can be compared
+# with a plain one.  Runs alternate between the binaries so that drift in the
+# machine's load hits them all alike.
+
+RUNS=${RUNS:-7}
+feeds=$1
+queries=$2
+shift 2
+
+times_dir=$(mktemp -d)
+trap 'rm -rf "$times_dir"' EXIT
+
+for run in $(seq "$RUNS"); do
+  for binary in "$@"; do
+    start=$(date +%s%N)
+    "$binary" "$feeds" < "$queries" > /dev/null || exit 1
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000 )) >> "$times_dir/$(basename "$binary")"
+  done
+done
+
+printf "%-28s %12s %12s\n" "binary" "best ms" "median ms"
+for binary in "$@"; do
+  sort -n "$times_dir/$(basename "$binary")" | awk -v name="$(basename "$binary")" '
+    { t[NR] = $1 }
+    END { printf "%-28s %12.1f %12.1f\n", name, t[1] / 1000, t[int((NR + 1) / 2)] / 1000 }'
+done
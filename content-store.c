@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zlib.h>
+#include "content-store.h"
+#include "url-set.h"
+
+static const char kMagic[] = "rss-content-store 1\n";
+
+// What precedes each payload in the file.
+typedef struct {
+  uint64_t url, content;
+  uint32_t length;
+} record_header_t;
+
+static void PutEntry(content_store_t *store, uint64_t url, uint64_t content, const char *payload, int length, bool live) {
+  content_entry_t *entry = ContentEntrySetLookup(&store->entries, url);
+  if (entry == NULL) {
+    content_entry_t new_entry = { url, 0, NULL, 0, false };
+    entry = ContentEntrySetEnter(&store->entries, &new_entry);
+  }
+  MemFree(MEM_CONTENT_STORE, entry->payload, entry->length + 1);
+  entry->payload = MemMalloc(MEM_CONTENT_STORE, length + 1);
+  memcpy(entry->payload, payload, length);
+  entry->length = length;
+  entry->content = content;
+  entry->live = live;
+}
+
+bool ContentStoreOpen(content_store_t *store, const char *path) {
+  char magic[sizeof(kMagic)];
+  record_header_t header;
+
+  store->path = path;
+  ContentEntrySetNew(&store->entries, 1024);
+  sem_init(&store->lock, 0, 1);
+  store->n_loaded = store->n_matched = store->n_stored = 0;
+
+  gzFile in = gzopen(path, "rb");
+  if (in == NULL) return errno == ENOENT;
+  bool ok = gzread(in, magic, sizeof(kMagic) - 1) == sizeof(kMagic) - 1 &&
+            memcmp(magic, kMagic, sizeof(kMagic) - 1) == 0;
+  char *payload = NULL;
+  int payload_allocated = 0;
+  while (ok) {
+    int n = gzread(in, &header, sizeof(header));
+    if (n == 0) break;
+    if (n != sizeof(header) || header.length > (1u << 30)) { ok = false; break; }
+    if ((int)header.length > payload_allocated) {
+      payload_allocated = header.length;
+      payload = realloc(payload, payload_allocated);
+    }
+    if (gzread(in, payload, header.length) != (int)header.length) { ok = false; break; }
+    PutEntry(store, header.url, header.content, payload, header.length, false);
+    store->n_loaded++;
+  }
+  free(payload);
+  gzclose(in);
+  return ok;
+}
+
+bool ContentStoreSave(content_store_t *store) {
+  char temp_path[1024];
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", store->path);
+  gzFile out = gzopen(temp_path, "wb");
+  if (out == NULL) return false;
+
+  bool ok = gzwrite(out, kMagic, sizeof(kMagic) - 1) == sizeof(kMagic) - 1;
+  for (int i = 0; ok && i < ContentEntrySetCount(&store->entries); i++) {
+    const content_entry_t *entry = ContentEntrySetAt(&store->entries, i);
+    if (!entry->live) continue;
+    record_header_t header;
+    memset(&header, 0, sizeof(header));
+    header.url = entry->url;
+    header.content = entry->content;
+    header.length = entry->length;
+    ok = gzwrite(out, &header, sizeof(header)) == sizeof(header) &&
+         (entry->length == 0 || gzwrite(out, entry->payload, entry->length) == entry->length);
+  }
+  ok = gzclose(out) == Z_OK && ok;
+  // renamed into place only once it's complete, so a crash never leaves half a store.
+  if (ok) ok = rename(temp_path, store->path) == 0;
+  else remove(temp_path);
+  return ok;
+}
+
+void ContentStoreDispose(content_store_t *store) {
+  for (int i = 0; i < ContentEntrySetCount(&store->entries); i++) {
+    content_entry_t *entry = ContentEntrySetAt(&store->entries, i);
+    MemFree(MEM_CONTENT_STORE, entry->payload, entry->length + 1);
+  }
+  ContentEntrySetDispose(&store->entries);
+  sem_destroy(&store->lock);
+}
+
+uint64_t ContentHash(const void *data, size_t length) {
+  const unsigned char *bytes = data;
+  uint64_t hash = 14695981039346656037ull ^ length;
+  size_t i = 0;
+  // FNV-1a, but a word at a time rather than a byte at a time.
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    hash = (hash ^ word) * 1099511628211ull;
+    hash ^= hash >> 29;
+  }
+  for (; i < length; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+char *ContentStoreMatch(content_store_t *store, const char *url, uint64_t content, int *length) {
+  char *payload = NULL;
+  uint64_t fingerprint = UrlFingerprint(url);
+  sem_wait(&store->lock);
+  content_entry_t *entry = ContentEntrySetLookup(&store->entries, fingerprint);
+  if (entry != NULL && entry->content == content) {
+    entry->live = true;
+    payload = malloc(entry->length + 1);
+    memcpy(payload, entry->payload, entry->length + 1);
+    *length = entry->length;
+    store->n_matched++;
+  }
+  sem_post(&store->lock);
+  return payload;
+}
+
+void ContentStorePut(content_store_t *store, const char *url, uint64_t content, const char *payload, int length) {
+  uint64_t fingerprint = UrlFingerprint(url);
+  sem_wait(&store->lock);
+  PutEntry(store, fingerprint, content, payload, length, true);
+  store->n_stored++;
+  sem_post(&store->lock);
+}
+
+void ContentStoreReport(const content_store_t *store) {
+  printf("Content store %s: %d entries loaded, %d unchanged urls reused, %d stored.\n",
+         store->path, store->n_loaded, store->n_matched, store->n_stored);
+}
@@ -0,0 +1,76 @@
+
+#ifndef __CONTENT_STORE_
+#define __CONTENT_STORE_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <semaphore.h>
+#include "bool.h"
+#include "typed-hashset.h"
+
+// A store, kept in a file between runs, of a hash of the content last fetched from
+// each url along with whatever the caller made of that content.  When a url serves
+// the same content again, the caller can take back what it made last time instead
+// of parsing the content again.
+//
+// Urls are keyed by their fingerprint (see url-set.h), so urls that differ only in
+// ways UrlCanonicalize drops share an entry.  The file is gzipped.  An entry is
+// only written back if its url was looked up or stored during this run, so urls
+// that drop out of the feeds age out of the file.
+
+typedef struct {
+  uint64_t url;        // UrlFingerprint of the url
+  uint64_t content;    // ContentHash of what it served
+  char *payload;
+  int length;
+  bool live;           // looked up or stored this run
+} content_entry_t;
+
+#define CONTENT_ENTRY_KEY(elem) ((elem)->url)
+static inline unsigned ContentEntryHash(uint64_t url) {
+  return (unsigned)(url ^ (url >> 32));
+}
+static inline bool ContentEntriesMatch(uint64_t a, uint64_t b) {
+  return a == b;
+}
+
+DECLARE_TYPED_HASHSET_TAGGED(content_entry_set_t, ContentEntrySet, content_entry_t, uint64_t,
+                             CONTENT_ENTRY_KEY, ContentEntryHash, ContentEntriesMatch, MEM_CONTENT_STORE)
+
+typedef struct {
+  const char *path;
+  content_entry_set_t entries;
+  sem_t lock;
+  int n_loaded, n_matched, n_stored;   // n_matched and n_stored are updated under lock
+} content_store_t;
+
+// Loads the store kept in path, or starts an empty one if there's no such file.
+// Returns false if the file exists but can't be read.
+bool ContentStoreOpen(content_store_t *store, const char *path);
+
+// Writes the live entries back to the store's file, replacing it.  Returns false if
+// it can't be written.
+bool ContentStoreSave(content_store_t *store);
+
+void ContentStoreDispose(content_store_t *store);
+
+// A 64-bit hash of length bytes of data.
+uint64_t ContentHash(const void *data, size_t length);
+
+/**
+ * Returns a copy of the payload stored for url if the content it served last time
+ * hashed to content, and sets *length to the payload's length.  Returns NULL if url
+ * is new, or served something else last time.  The copy is the caller's to free, so
+ * another thread storing url meanwhile can't pull it out from under the caller.
+ * Safe from any thread.
+ */
+char *ContentStoreMatch(content_store_t *store, const char *url, uint64_t content, int *length);
+
+// Records that url served content, and what was made of it.  Copies the payload.
+// Safe from any thread.
+void ContentStorePut(content_store_t *store, const char *url, uint64_t content, const char *payload, int length);
+
+// Prints how many entries were loaded, matched and stored.
+void ContentStoreReport(const content_store_t *store);
+
+#endif // __CONTENT_STORE_
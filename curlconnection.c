@@ -1,43 +1,1057 @@
-
 #include <stdlib.h>     // strdup() open_memstream() free()
-#include <stdio.h>      
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>    // strcasecmp()
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>       // nanosleep()
 #include <assert.h>
+#include <semaphore.h>
+#include <sys/stat.h>   // mkdir()
+#include <unistd.h>     // ftruncate()
+#include <zlib.h>
 #include "curlconnection.h"
+#include "vector.h"
+#include "typed-hashset.h"
+
+
+// Record/replay archive //////////////////////////
+
+typedef struct {
+    char *url;              // strdup'd
+    char body[17];          // hex name of the body file, in bodies/
+    CURLcode code;
+} archive_entry_t;
+
+typedef struct {
+    char host[256];
+    long latency_ms;
+    long bandwidth_kbs;     // 0 means unlimited
+} host_profile_t;
+
+// 64-bit FNV-1a.  The body files are named after it, so it needs more bits than
+// a bucket index.
+static inline unsigned long long UrlHash64(const char *url) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (; *url != '\0'; url++) hash = (hash ^ (unsigned char)*url) * 1099511628211ULL;
+    return hash;
+}
+
+#define ENTRY_URL(entry) ((entry)->url)
+#define UrlHash(url) ((unsigned)UrlHash64(url))
+#define UrlsMatch(a, b) (strcmp(a, b) == 0)
+DECLARE_TYPED_HASHSET(archive_index_t, ArchiveIndex, archive_entry_t, const char*, ENTRY_URL, UrlHash, UrlsMatch)
+
+// One archive per process, shared read-only by all connections while replaying.
+// While recording, index_lock serializes appends to index.txt.
+static struct {
+    fetch_mode_t mode;
+    char *dir;
+    archive_index_t index;
+    vector hosts;           // of host_profile_t
+    FILE *index_file;
+    sem_t index_lock;
+} archive = { FETCH_LIVE };
+
+static const char *const kIndexFile = "index.txt";
+static const char *const kHostsFile = "hosts.txt";
+static const char *const kBodiesDir = "bodies";
+#define ARCHIVE_PATH_N_BYTES 4096
+#define ARCHIVE_LINE_N_BYTES 4096
+
+// Set by CurlConnectionRouteAllTo.
+static struct curl_slist *connect_to = NULL;
+
+
+// Shared caches //////////////////////////
+
+// Set by CurlConnectionShareCaches.  curl takes one lock per kind of data it
+// shares, so a DNS lookup never waits on a thread taking a pooled connection.
+static struct {
+    CURLSH *share;
+    sem_t locks[CURL_LOCK_DATA_LAST];
+    long max_connections;
+} shared = { NULL };
+
+static void LockShared(CURL *handle, curl_lock_data data, curl_lock_access access, void *arg) {
+    sem_wait(&shared.locks[data]);
+}
+
+static void UnlockShared(CURL *handle, curl_lock_data data, void *arg) {
+    sem_post(&shared.locks[data]);
+}
+
+
+// Timeouts and retries //////////////////////////
+
+// Set by CurlConnectionSetTimeouts, CurlConnectionSetRetries and
+// CurlConnectionSetDeadline, before any fetches.
+static struct {
+    long connect_ms, transfer_ms;   // 0 means unlimited
+    int max_retries;
+    long retry_base_ms;
+    long long deadline_ns;          // 0 means none
+} limits = { 0, 0, 0, 0, 0 };
+
+// However long a Retry-After asks for, a fetch isn't held up longer than this.
+static const long kMaxRetryDelayMs = 4000;
+
+
+// Fetch cache //////////////////////////
+
+#define CACHE_ETAG_N_BYTES 256
+#define CACHE_DATE_N_BYTES 64
+
+typedef struct {
+    char etag[CACHE_ETAG_N_BYTES];              // "" if the response had none
+    char last_modified[CACHE_DATE_N_BYTES];     // likewise
+} validators_t;
+
+typedef struct {
+    char *url;              // strdup'd
+    char body[17];          // hex name of the body file
+    long long bytes;        // -1 once evicted
+    long long used;         // the cache's clock when it was last stored or revalidated
+    validators_t validators;
+} cache_entry_t;
+
+DECLARE_TYPED_HASHSET(cache_index_t, CacheIndex, cache_entry_t, const char*, ENTRY_URL, UrlHash, UrlsMatch)
+
+// One cache per process, shared by all connections.  lock covers everything but
+// dir and budget, which are set before any fetch.
+static struct {
+    char *dir;              // NULL unless the cache is open
+    long long budget;
+    long long total;        // bytes of the bodies in the index
+    long long clock;        // ticks once per store or revalidation, for eviction
+    cache_index_t index;
+    sem_t lock;
+    int n_revalidated, n_stored, n_evicted;
+} cache = { NULL };
+
+
+// Fetch sink //////////////////////////
+
+typedef enum {
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_UNKNOWN        // one we didn't ask for, and can't decode
+} content_encoding_t;
+
+// Where the bytes curl hands over go: inflated if need be, then on to the client's
+// stream, to the archive when recording, and to the cache when there's one.  The
+// header callback fills in how the response being received is encoded, and its
+// validators.
+typedef struct {
+    FILE *stream;
+    FILE *record;
+    FILE *cache;
+    validators_t validators;
+    content_encoding_t encoding;
+    z_stream inflater;
+    bool inflating;         // inflater is initialized
+    bool inflated_all;      // and has reached the end of the compressed body
+    bool bad_encoding;      // the body couldn't be decoded
+    long long wire_bytes, decoded_bytes, decode_ns;
+} fetch_sink_t;
+
+static void SinkNew(fetch_sink_t *sink, FILE *stream) {
+    memset(sink, 0, sizeof(*sink));
+    sink->stream = stream;
+    sink->encoding = ENCODING_IDENTITY;
+}
+
+static size_t WriteDecoded(fetch_sink_t *sink, const void *data, size_t length) {
+    if (sink->record != NULL) fwrite(data, 1, length, sink->record);
+    if (sink->cache != NULL) fwrite(data, 1, length, sink->cache);
+    sink->decoded_bytes += length;
+    return fwrite(data, 1, length, sink->stream);
+}
+
+static long long NowNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// "deflate" is meant to be a zlib stream, but some servers send bare deflate.
+static bool HasZlibHeader(const unsigned char *data, size_t length) {
+    return length >= 2 && (data[0] & 0x0f) == Z_DEFLATED && (data[0] * 256 + data[1]) % 31 == 0;
+}
 
+// Inflates the next piece of a compressed body into the sink, 16 KB at a time, so
+// the compressed body is never held whole.  Returns false if it's corrupt.
+static bool InflateIntoSink(fetch_sink_t *sink, const unsigned char *data, size_t length) {
+    z_stream *z = &sink->inflater;
+    if (!sink->inflating) {
+        // 32 + 15 takes a gzip or a zlib header, whichever it finds. 
+        int window_bits = 32 + MAX_WBITS;
+        if (sink->encoding == ENCODING_DEFLATE && !HasZlibHeader(data, length)) window_bits = -MAX_WBITS;
+        if (inflateInit2(z, window_bits) != Z_OK) return false;
+        sink->inflating = true;
+    }
+    unsigned char out[16384];
+    z->next_in = (Bytef*)data;
+    z->avail_in = length;
+    // anything after the end of the compressed body is ignored, as curl does.
+    while (!sink->inflated_all && (z->avail_in > 0 || z->avail_out == 0)) {
+        z->next_out = out;
+        z->avail_out = sizeof(out);
+        long long start = NowNs();
+        int status = inflate(z, Z_NO_FLUSH);
+        sink->decode_ns += NowNs() - start;
+        if (status == Z_STREAM_END) sink->inflated_all = true;
+        else if (status == Z_BUF_ERROR) break;   // needs more input than this piece had
+        else if (status != Z_OK) return false;
+        size_t n = sizeof(out) - z->avail_out;
+        if (n > 0 && WriteDecoded(sink, out, n) != n) return false;
+    }
+    return true;
+}
+
+// Throws away whatever the sink has taken in, going back to start in its stream, so
+// another response can be put through it instead. 
+static void ResetSink(fetch_sink_t *sink, off_t start) {
+    if (sink->inflating) inflateEnd(&sink->inflater);
+    sink->inflating = sink->inflated_all = sink->bad_encoding = false;
+    sink->wire_bytes = sink->decoded_bytes = sink->decode_ns = 0;
+    fseeko(sink->stream, start, SEEK_SET);
+    FILE *files[2] = { sink->record, sink->cache };
+    for (int i = 0; i < 2; i++) {
+        if (files[i] == NULL) continue;
+        fflush(files[i]);
+        if (ftruncate(fileno(files[i]), 0) != 0) perror("ftruncate");
+        rewind(files[i]);
+    }
+}
+
+static size_t WriteToSink(char *data, size_t size, size_t n, void *arg) {
+    fetch_sink_t *sink = (fetch_sink_t*)arg;
+    size_t length = size * n;
+    sink->wire_bytes += length;
+    switch (sink->encoding) {
+        case ENCODING_IDENTITY:
+            return WriteDecoded(sink, data, length);
+        case ENCODING_GZIP:
+        case ENCODING_DEFLATE:
+            if (InflateIntoSink(sink, (unsigned char*)data, length)) return length;
+            // falls through
+        default:
+            sink->bad_encoding = true;
+            return 0;   // which makes curl give up on the transfer
+    }
+}
+
+// Ends the body, and turns a body that couldn't be decoded, or was cut off
+// partway through its compressed stream, into an error.
+static void SinkFinish(fetch_sink_t *sink, curlconnection_t *cc) {
+    bool truncated = sink->inflating && !sink->inflated_all;
+    if (sink->inflating) inflateEnd(&sink->inflater);
+    sink->inflating = false;
+    if (sink->bad_encoding || (cc->error == CURLE_OK && truncated)) {
+        cc->error = CURLE_BAD_CONTENT_ENCODING;
+        cc->error_str = "Couldn't decode the compressed body";
+    }
+    cc->wire_bytes = sink->wire_bytes;
+    cc->decoded_bytes = sink->decoded_bytes;
+    cc->decode_ns = sink->decode_ns;
+}
+
+// Keeps a hedge's body as it came, to be put through the fetch's own sink if the
+// hedge wins. 
+static size_t WriteRaw(char *data, size_t size, size_t n, void *arg) {
+    fetch_sink_t *sink = (fetch_sink_t*)arg;
+    sink->wire_bytes += size * n;
+    return fwrite(data, size, n, sink->stream) * size;
+}
+
+// Copies the value of header line if it's the header named, and the value fits
+// and won't upset the index.
+static void CopyHeaderValue(const char *line, size_t length, const char *name, char *value, size_t value_size) {
+    size_t name_length = strlen(name);
+    if (length <= name_length || line[name_length] != ':' || strncasecmp(line, name, name_length) != 0) return;
+    line += name_length + 1;
+    length -= name_length + 1;
+    while (length > 0 && isspace((unsigned char)line[0])) line++, length--;
+    while (length > 0 && isspace((unsigned char)line[length - 1])) length--;
+    if (length >= value_size || memchr(line, '\t', length) != NULL) return;
+    memcpy(value, line, length);
+    value[length] = '\0';
+}
+
+// Catches the validators and the encoding of the response.  Every response of a
+// redirect chain starts with its status line, so only the last response's are kept.
+static size_t ReadHeader(char *data, size_t size, size_t n, void *arg) {
+    fetch_sink_t *sink = (fetch_sink_t*)arg;
+    validators_t *validators = &sink->validators;
+    size_t length = size * n;
+    if (length >= 5 && strncmp(data, "HTTP/", 5) == 0) {
+        validators->etag[0] = validators->last_modified[0] = '\0';
+        sink->encoding = ENCODING_IDENTITY;
+    }
+    CopyHeaderValue(data, length, "ETag", validators->etag, sizeof(validators->etag));
+    CopyHeaderValue(data, length, "Last-Modified", validators->last_modified, sizeof(validators->last_modified));
+
+    char encoding[32] = "";
+    CopyHeaderValue(data, length, "Content-Encoding", encoding, sizeof(encoding));
+    if (strcasecmp(encoding, "gzip") == 0 || strcasecmp(encoding, "x-gzip") == 0) sink->encoding = ENCODING_GZIP;
+    else if (strcasecmp(encoding, "deflate") == 0) sink->encoding = ENCODING_DEFLATE;
+    else if (encoding[0] != '\0' && strcasecmp(encoding, "identity") != 0) sink->encoding = ENCODING_UNKNOWN;
+    return length;
+}
+
+
+// Sets up a handle the way every fetch wants it, the hedges' included.
+static void ConfigureHandle(CURL *handle) {
+    // Here we stop trying if we get an error.
+    curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1L);
+    // If the server replies with a header with code 303/304 curl will follow the redirects.
+    curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, WriteToSink);
+    curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION, ReadHeader);
+    // Bodies come gzip'd or deflated if the server will, and WriteToSink inflates
+    // them itself rather than curl, so the time it takes can be counted.
+    curl_easy_setopt(handle, CURLOPT_ACCEPT_ENCODING, "gzip, deflate");
+    curl_easy_setopt(handle, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+    // timeouts are otherwise enforced with signals, which don't mix with threads.
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    if (limits.connect_ms > 0) curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT_MS, limits.connect_ms);
+    if (connect_to != NULL) curl_easy_setopt(handle, CURLOPT_CONNECT_TO, connect_to);
+    if (shared.share != NULL) {
+        curl_easy_setopt(handle, CURLOPT_SHARE, shared.share);
+        // the limit is on the pool, so it has to allow for everyone's connections.
+        curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, shared.max_connections);
+    }
+}
 
 // Initializes a curl connection handle to be used in fetching resources.
-// this does not call global init function. 
+// this does not call global init function.
 void CurlConnectionNew( curlconnection_t *cc ) {
 
     cc->curl_handle = curl_easy_init();
     cc->error = CURLE_OK;
     cc->error_str = "Fetch not called yet";
+    cc->revalidated = false;
+    cc->http_status = 0;
+    cc->hedge_after_ms = 0;
+    cc->hedge_handle = NULL;
+    cc->multi = NULL;
+    cc->retries = 0;
+    cc->hedged = cc->hedge_won = false;
+    cc->rng = (unsigned)NowNs() ^ (unsigned)(size_t)cc;
+    ConfigureHandle(cc->curl_handle);
+}
 
-    // Here we stop trying if we get an error. 
-    curl_easy_setopt(cc->curl_handle, CURLOPT_FAILONERROR, 1L);
-    // If the server replies with a header with code 303/304 curl will follow the redirects.
-    curl_easy_setopt(cc->curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+void CurlConnectionSetTimeouts(long connect_ms, long transfer_ms) {
+    limits.connect_ms = connect_ms;
+    limits.transfer_ms = transfer_ms;
 }
 
+void CurlConnectionSetRetries(int max_retries, long base_delay_ms) {
+    limits.max_retries = max_retries;
+    limits.retry_base_ms = base_delay_ms;
+}
 
-// Fetches the specified URL.
-// stores it in the stream, which is flushed so it is ready to read. 
-int CurlConnectionFetch(const char *url, FILE *stream,  curlconnection_t *cc ) {
-    assert(stream != NULL);
-    
-    // This line tells curl what stream to output the received data to. 
-    curl_easy_setopt(cc->curl_handle, CURLOPT_WRITEDATA, stream);
+void CurlConnectionSetDeadline(long long deadline_ns) {
+    limits.deadline_ns = deadline_ns;
+}
+
+// How long a fetch starting now may take: the transfer timeout, cut short by the
+// deadline.  0 if it may take forever, and -1 if the deadline has passed. 
+static long TransferTimeoutMs(void) {
+    if (limits.deadline_ns == 0) return limits.transfer_ms;
+    long long left_ms = (limits.deadline_ns - NowNs()) / 1000000;
+    if (left_ms <= 0) return -1;
+    return limits.transfer_ms > 0 && limits.transfer_ms < left_ms ? limits.transfer_ms : left_ms;
+}
+
+// Runs the fetch set up on cc's handle.  If it hasn't finished after
+// cc->hedge_after_ms, the same request goes out again on a second handle, and the
+// first of the two to succeed is kept, the other abandoned.  The hedge's body is
+// held back whole, as it came, and put through the sink only if the hedge wins, in
+// place of whatever the first request had written.  Returns the result of the
+// request kept, the first one's unless the hedge won, and sets *kept to its handle.
+static CURLcode PerformHedged(const char *url, struct curl_slist *conditions, curlconnection_t *cc,
+                              fetch_sink_t *sink, CURL **kept) {
+    off_t start = ftello(sink->stream);
+    if (cc->multi == NULL) {
+        cc->multi = curl_multi_init();
+        // otherwise a multi handle trims the shared pool to 4 connections per handle it runs.
+        if (shared.share != NULL) curl_multi_setopt(cc->multi, CURLMOPT_MAXCONNECTS, shared.max_connections);
+    }
+    curl_multi_add_handle(cc->multi, cc->curl_handle);
+
+    CURL *handles[2] = { cc->curl_handle, NULL };
+    CURLcode results[2] = { CURLE_OK, CURLE_OK };
+    bool running[2] = { true, false };
+    fetch_sink_t hedge;
+    char *hedge_body = NULL;
+    size_t hedge_length = 0;
+    long long hedge_at = NowNs() + cc->hedge_after_ms * 1000000LL;
+    int winner = -1;
+
+    while (true) {
+        int n_running, n_queued;
+        CURLMsg *message;
+        curl_multi_perform(cc->multi, &n_running);
+        while ((message = curl_multi_info_read(cc->multi, &n_queued)) != NULL) {
+            if (message->msg != CURLMSG_DONE) continue;
+            int i = message->easy_handle == handles[0] ? 0 : 1;
+            results[i] = message->data.result;
+            running[i] = false;
+            if (results[i] == CURLE_OK && winner < 0) winner = i;
+        }
+        if (winner >= 0 || (!running[0] && !running[1])) break;
+
+        // the hedge only goes out while the first request is still waiting on its answer.
+        long long now = NowNs();
+        long timeout_ms = TransferTimeoutMs();
+        if (running[0] && handles[1] == NULL && now >= hedge_at && timeout_ms >= 0) {
+            if (cc->hedge_handle == NULL) {
+                cc->hedge_handle = curl_easy_init();
+                ConfigureHandle(cc->hedge_handle);
+            }
+            handles[1] = cc->hedge_handle;
+            SinkNew(&hedge, open_memstream(&hedge_body, &hedge_length));
+            curl_easy_setopt(handles[1], CURLOPT_WRITEFUNCTION, WriteRaw);
+            curl_easy_setopt(handles[1], CURLOPT_WRITEDATA, &hedge);
+            curl_easy_setopt(handles[1], CURLOPT_HEADERDATA, &hedge);
+            curl_easy_setopt(handles[1], CURLOPT_HTTPHEADER, conditions);
+            curl_easy_setopt(handles[1], CURLOPT_TIMEOUT_MS, timeout_ms);
+            curl_easy_setopt(handles[1], CURLOPT_URL, url);
+            curl_multi_add_handle(cc->multi, handles[1]);
+            running[1] = true;
+            cc->hedged = true;
+            continue;   // so that it's sent straight away
+        }
+        long wait_ms = 1000;
+        if (handles[1] == NULL && hedge_at > now && (hedge_at - now) / 1000000 + 1 < wait_ms)
+            wait_ms = (hedge_at - now) / 1000000 + 1;
+        curl_multi_poll(cc->multi, NULL, 0, wait_ms, NULL);
+    }
+    for (int i = 0; i < 2; i++)
+        if (handles[i] != NULL) curl_multi_remove_handle(cc->multi, handles[i]);
+    if (handles[1] != NULL) curl_easy_setopt(handles[1], CURLOPT_HTTPHEADER, NULL);
+
+    CURLcode result = results[0];
+    *kept = handles[0];
+    if (winner == 1) {
+        result = CURLE_OK;
+        *kept = handles[1];
+        cc->hedge_won = true;
+        fflush(hedge.stream);
+        ResetSink(sink, start);
+        sink->validators = hedge.validators;
+        sink->encoding = hedge.encoding;
+        // a body that won't decode fails in SinkFinish, as it would have coming in.
+        if (hedge_length > 0 && WriteToSink(hedge_body, 1, hedge_length, sink) != hedge_length && !sink->bad_encoding)
+            result = CURLE_WRITE_ERROR;
+    }
+    if (handles[1] != NULL) {
+        fclose(hedge.stream);
+        free(hedge_body);
+    }
+    return result;
+}
+
+static int ReplayFetch(const char *url, FILE *stream, curlconnection_t *cc);
+static void RecordFetch(const char *url, const char *partial_path, curlconnection_t *cc);
+static bool CacheLookup(const char *url, cache_entry_t *copy);
+static struct curl_slist *ConditionalHeaders(const validators_t *validators);
+static bool ServeCached(const char *url, const cache_entry_t *cached, fetch_sink_t *sink);
+static void CacheStore(const char *url, const char *partial_path, const validators_t *validators);
+static void CacheForget(const char *url);
+static void SleepNs(long long ns);
+
+// Whether the last attempt failed in a way that another might not.
+static bool Retryable(const curlconnection_t *cc) {
+    switch (cc->error) {
+        case CURLE_HTTP_RETURNED_ERROR:
+            return cc->http_status == 429 || cc->http_status >= 500;
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_GOT_NOTHING:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// How long to wait before trying the last attempt again, or -1 if it shouldn't be.
+// The wait is drawn from [d, 2d), where d doubles with each retry, so threads
+// that failed together don't all try again together. 
+static long RetryDelayMs(curlconnection_t *cc) {
+    if (archive.mode == FETCH_REPLAY || cc->retries >= limits.max_retries || !Retryable(cc)) return -1;
+    long delay_ms = limits.retry_base_ms << cc->retries;
+    delay_ms += rand_r(&cc->rng) % (delay_ms + 1);
+    curl_off_t retry_after = 0;
+    curl_easy_getinfo(cc->curl_handle, CURLINFO_RETRY_AFTER, &retry_after);
+    if (retry_after * 1000 > delay_ms) delay_ms = retry_after * 1000;
+    if (delay_ms > kMaxRetryDelayMs) delay_ms = kMaxRetryDelayMs;
+    if (limits.deadline_ns != 0 && NowNs() + delay_ms * 1000000LL >= limits.deadline_ns) return -1;
+    return delay_ms;
+}
+
+// One attempt at a fetch, for CurlConnectionFetch.
+static int FetchOnce(const char *url, FILE *stream, curlconnection_t *cc) {
+    cc->revalidated = false;
+    cc->http_status = 0;
+    cc->wire_bytes = cc->decoded_bytes = cc->decode_ns = 0;
+    long timeout_ms = TransferTimeoutMs();
+    if (timeout_ms < 0) {
+        cc->error = CURLE_OPERATION_TIMEDOUT;
+        cc->error_str = "The deadline passed before the fetch began";
+        return cc->error;
+    }
+    if (archive.mode == FETCH_REPLAY) return ReplayFetch(url, stream, cc);
+
+    fetch_sink_t sink;
+    SinkNew(&sink, stream);
+    char partial_path[ARCHIVE_PATH_N_BYTES], cache_partial_path[ARCHIVE_PATH_N_BYTES];
+    if (archive.mode == FETCH_RECORD) {
+        // partial bodies are named per connection, in case two threads fetch the same url.
+        snprintf(partial_path, sizeof(partial_path), "%s/%s/%016llx.%p.part",
+                 archive.dir, kBodiesDir, UrlHash64(url), (void*)cc);
+        sink.record = fopen(partial_path, "w");
+        if (sink.record == NULL) perror(partial_path);
+    }
+
+    // A url in the cache is only sent again if it's changed since.
+    cache_entry_t cached;
+    bool conditional = false;
+    struct curl_slist *conditions = NULL;
+    if (cache.dir != NULL) {
+        conditional = CacheLookup(url, &cached);
+        if (conditional) conditions = ConditionalHeaders(&cached.validators);
+        snprintf(cache_partial_path, sizeof(cache_partial_path), "%s/%016llx.%p.part",
+                 cache.dir, UrlHash64(url), (void*)cc);
+        sink.cache = fopen(cache_partial_path, "w");
+        if (sink.cache == NULL) perror(cache_partial_path);
+    }
+    curl_easy_setopt(cc->curl_handle, CURLOPT_HTTPHEADER, conditions);
+    curl_easy_setopt(cc->curl_handle, CURLOPT_HEADERDATA, &sink);
 
-    // Sets the url that Curl is going to fetch. 
+    // This line tells curl what stream to output the received data to.
+    curl_easy_setopt(cc->curl_handle, CURLOPT_WRITEDATA, &sink);
+
+    // Sets the url that Curl is going to fetch.
     curl_easy_setopt(cc->curl_handle, CURLOPT_URL, url);
-    
-    cc->error = curl_easy_perform(cc->curl_handle);
+    curl_easy_setopt(cc->curl_handle, CURLOPT_TIMEOUT_MS, timeout_ms);
+
+    CURL *kept = cc->curl_handle;
+    if (cc->hedge_after_ms > 0) cc->error = PerformHedged(url, conditions, cc, &sink, &kept);
+    else cc->error = curl_easy_perform(cc->curl_handle);
     cc->error_str = curl_easy_strerror(cc->error);
+    curl_easy_setopt(cc->curl_handle, CURLOPT_HTTPHEADER, NULL);
+    curl_slist_free_all(conditions);
+    SinkFinish(&sink, cc);
+    curl_easy_getinfo(kept, CURLINFO_RESPONSE_CODE, &cc->http_status);
+
+    if (sink.cache != NULL) {
+        long status = cc->http_status;
+        fclose(sink.cache);
+        sink.cache = NULL;
+        bool validated = sink.validators.etag[0] != '\0' || sink.validators.last_modified[0] != '\0';
+        if (cc->error == CURLE_OK && status == 304 && conditional) {
+            remove(cache_partial_path);
+            cc->revalidated = ServeCached(url, &cached, &sink);
+            cc->decoded_bytes = sink.decoded_bytes;
+            if (!cc->revalidated) {
+                // evicted since the lookup, so it's fetched again without conditions.
+                if (sink.record != NULL) {
+                    fclose(sink.record);
+                    remove(partial_path);
+                }
+                CacheForget(url);
+                return FetchOnce(url, stream, cc);
+            }
+        }
+        else if (cc->error == CURLE_OK && status == 200 && validated)
+            CacheStore(url, cache_partial_path, &sink.validators);
+        else remove(cache_partial_path);
+    }
     fflush(stream);
+
+    if (sink.record != NULL) {
+        fclose(sink.record);
+        RecordFetch(url, partial_path, cc);
+    }
     return cc->error;
 }
 
-// Performs cleanup functions. 
+// Fetches the specified URL.
+// stores it in the stream, which is flushed so it is ready to read.
+int CurlConnectionFetch(const char *url, FILE *stream,  curlconnection_t *cc ) {
+    assert(stream != NULL);
+    cc->retries = 0;
+    cc->hedged = cc->hedge_won = false;
+    off_t start = ftello(stream);
+    while (FetchOnce(url, stream, cc) != CURLE_OK) {
+        long delay_ms = RetryDelayMs(cc);
+        if (delay_ms < 0) break;
+        // whatever the failed attempt wrote is written over.
+        fseeko(stream, start, SEEK_SET);
+        SleepNs(delay_ms * 1000000LL);
+        cc->retries++;
+    }
+    // a failed fetch leaves nothing behind, as far as the stream's length goes.
+    if (cc->error != CURLE_OK) {
+        fseeko(stream, start, SEEK_SET);
+        fflush(stream);
+    }
+    return cc->error;
+}
+
+// Performs cleanup functions.
 void CurlConnectionDispose( curlconnection_t *cc) {
     curl_easy_cleanup(cc->curl_handle);
+    if (cc->hedge_handle != NULL) curl_easy_cleanup(cc->hedge_handle);
+    if (cc->multi != NULL) curl_multi_cleanup(cc->multi);
+}
+
+
+bool CurlConnectionShareCaches(int max_connections) {
+    assert(shared.share == NULL);
+    shared.max_connections = max_connections;
+    shared.share = curl_share_init();
+    if (shared.share == NULL) return false;
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) sem_init(&shared.locks[i], 0, 1);
+    curl_share_setopt(shared.share, CURLSHOPT_LOCKFUNC, LockShared);
+    curl_share_setopt(shared.share, CURLSHOPT_UNLOCKFUNC, UnlockShared);
+    bool ok = curl_share_setopt(shared.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) == CURLSHE_OK &&
+              curl_share_setopt(shared.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) == CURLSHE_OK &&
+              curl_share_setopt(shared.share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) == CURLSHE_OK;
+    if (!ok) CurlConnectionUnshareCaches();
+    return ok;
+}
+
+void CurlConnectionUnshareCaches(void) {
+    if (shared.share == NULL) return;
+    curl_share_cleanup(shared.share);
+    for (int i = 0; i < CURL_LOCK_DATA_LAST; i++) sem_destroy(&shared.locks[i]);
+    shared.share = NULL;
+}
+
+void CurlConnectionArchiveBodyName(const char *url, char name[17]) {
+    snprintf(name, 17, "%016llx", UrlHash64(url));
+}
+
+bool CurlConnectionArchiveLookup(const char *url, char *path, int path_size, CURLcode *code) {
+    assert(archive.mode == FETCH_REPLAY);
+    const archive_entry_t *entry = ArchiveIndexLookup(&archive.index, url);
+    if (entry == NULL) return false;
+    snprintf(path, path_size, "%s/%s/%s", archive.dir, kBodiesDir, entry->body);
+    *code = entry->code;
+    return true;
+}
+
+void CurlConnectionRouteAllTo(const char *host_port) {
+    char entry[512];
+    curl_slist_free_all(connect_to);
+    connect_to = NULL;
+    if (host_port == NULL) return;
+    // an empty host and port in the first two fields match any host and port.
+    snprintf(entry, sizeof(entry), "::%s", host_port);
+    connect_to = curl_slist_append(NULL, entry);
+}
+
+// Moves a finished body into place and appends its line to the index.
+static void RecordFetch(const char *url, const char *partial_path, curlconnection_t *cc) {
+    char body[17], body_path[ARCHIVE_PATH_N_BYTES];
+    CurlConnectionArchiveBodyName(url, body);
+    snprintf(body_path, sizeof(body_path), "%s/%s/%s", archive.dir, kBodiesDir, body);
+    if (rename(partial_path, body_path) != 0) {
+        perror(body_path);
+        return;
+    }
+    sem_wait(&archive.index_lock);
+    fprintf(archive.index_file, "%s\t%d\t%s\n", body, cc->error, url);
+    fflush(archive.index_file);
+    sem_post(&archive.index_lock);
+}
+
+// Copies url's live entry, if it has one. 
+static bool CacheLookup(const char *url, cache_entry_t *copy) {
+    sem_wait(&cache.lock);
+    const cache_entry_t *entry = CacheIndexLookup(&cache.index, url);
+    bool found = entry != NULL && entry->bytes >= 0;
+    if (found) *copy = *entry;
+    sem_post(&cache.lock);
+    return found;
+}
+
+static struct curl_slist *ConditionalHeaders(const validators_t *validators) {
+    char header[CACHE_ETAG_N_BYTES + 32];
+    struct curl_slist *headers = NULL;
+    if (validators->etag[0] != '\0') {
+        snprintf(header, sizeof(header), "If-None-Match: %s", validators->etag);
+        headers = curl_slist_append(headers, header);
+    }
+    if (validators->last_modified[0] != '\0') {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", validators->last_modified);
+        headers = curl_slist_append(headers, header);
+    }
+    return headers;
+}
+
+// Sends the cached body to the sink.  Returns false if it's been evicted.
+static bool ServeCached(const char *url, const cache_entry_t *cached, fetch_sink_t *sink) {
+    char body_path[ARCHIVE_PATH_N_BYTES];
+    snprintf(body_path, sizeof(body_path), "%s/%s", cache.dir, cached->body);
+
+    // opened under the lock, so it can't be evicted between the check and the open.
+    sem_wait(&cache.lock);
+    cache_entry_t *entry = CacheIndexLookup(&cache.index, url);
+    FILE *body = (entry != NULL && entry->bytes >= 0) ? fopen(body_path, "r") : NULL;
+    if (body != NULL) {
+        entry->used = cache.clock++;
+        cache.n_revalidated++;
+    }
+    sem_post(&cache.lock);
+    if (body == NULL) return false;
+
+    char chunk[16384];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), body)) > 0) WriteDecoded(sink, chunk, n);
+    fclose(body);
+    return true;
+}
+
+static int CompareLastUsed(const void *a, const void *b) {
+    long long x = (*(cache_entry_t *const *)a)->used, y = (*(cache_entry_t *const *)b)->used;
+    return (x > y) - (x < y);
+}
+
+// Deletes the least recently used bodies until they take under 90% of the budget.
+// Called with the lock held. 
+static void EvictLocked(void) {
+    int n = 0, count = CacheIndexCount(&cache.index);
+    cache_entry_t **entries = malloc(count * sizeof(cache_entry_t*));
+    for (int i = 0; i < count; i++) {
+        cache_entry_t *entry = CacheIndexAt(&cache.index, i);
+        if (entry->bytes >= 0) entries[n++] = entry;
+    }
+    qsort(entries, n, sizeof(cache_entry_t*), CompareLastUsed);
+    char body_path[ARCHIVE_PATH_N_BYTES];
+    for (int i = 0; i < n && cache.total > cache.budget / 10 * 9; i++) {
+        snprintf(body_path, sizeof(body_path), "%s/%s", cache.dir, entries[i]->body);
+        remove(body_path);
+        cache.total -= entries[i]->bytes;
+        entries[i]->bytes = -1;
+        cache.n_evicted++;
+    }
+    free(entries);
+}
+
+// Moves a finished body into the cache, replacing any body url had.
+static void CacheStore(const char *url, const char *partial_path, const validators_t *validators) {
+    char body[17], body_path[ARCHIVE_PATH_N_BYTES];
+    struct stat info;
+    CurlConnectionArchiveBodyName(url, body);
+    snprintf(body_path, sizeof(body_path), "%s/%s", cache.dir, body);
+    if (stat(partial_path, &info) != 0) return;
+
+    sem_wait(&cache.lock);
+    if (rename(partial_path, body_path) != 0) {
+        perror(body_path);
+        remove(partial_path);
+        sem_post(&cache.lock);
+        return;
+    }
+    cache_entry_t *entry = CacheIndexLookup(&cache.index, url);
+    if (entry == NULL) {
+        cache_entry_t new_entry;
+        new_entry.url = strdup(url);
+        new_entry.bytes = -1;
+        entry = CacheIndexEnter(&cache.index, &new_entry);
+    }
+    if (entry->bytes >= 0) cache.total -= entry->bytes;
+    memcpy(entry->body, body, sizeof(body));
+    entry->bytes = info.st_size;
+    entry->used = cache.clock++;
+    entry->validators = *validators;
+    cache.total += entry->bytes;
+    cache.n_stored++;
+    if (cache.total > cache.budget) EvictLocked();
+    sem_post(&cache.lock);
+}
+
+// Drops url's entry, whose body has gone missing.
+static void CacheForget(const char *url) {
+    sem_wait(&cache.lock);
+    cache_entry_t *entry = CacheIndexLookup(&cache.index, url);
+    if (entry != NULL && entry->bytes >= 0) {
+        cache.total -= entry->bytes;
+        entry->bytes = -1;
+    }
+    sem_post(&cache.lock);
+}
+
+// Splits off the next tab-separated field of a line, or returns NULL if there's
+// none left. 
+static char *NextField(char **line) {
+    char *field = *line;
+    if (field == NULL) return NULL;
+    char *tab = strchr(field, '\t');
+    if (tab != NULL) *tab++ = '\0';
+    *line = tab;
+    return field;
+}
+
+// Reads the index, keeping the entries whose bodies are still there.
+static bool LoadCacheIndex(FILE *infile) {
+    char line[ARCHIVE_LINE_N_BYTES];
+    char body_path[ARCHIVE_PATH_N_BYTES];
+    while (fgets(line, sizeof(line), infile) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *rest = line;
+        char *body = NextField(&rest), *bytes = NextField(&rest), *used = NextField(&rest);
+        char *etag = NextField(&rest), *last_modified = NextField(&rest), *url = NextField(&rest);
+        if (url == NULL || strlen(body) != 16 || strlen(etag) >= CACHE_ETAG_N_BYTES ||
+            strlen(last_modified) >= CACHE_DATE_N_BYTES)
+            return false;
+
+        struct stat info;
+        snprintf(body_path, sizeof(body_path), "%s/%s", cache.dir, body);
+        if (stat(body_path, &info) != 0 || info.st_size != atoll(bytes)) continue;
+        cache_entry_t entry;
+        memcpy(entry.body, body, sizeof(entry.body));
+        entry.bytes = info.st_size;
+        entry.used = atoll(used);
+        strcpy(entry.validators.etag, etag);
+        strcpy(entry.validators.last_modified, last_modified);
+        entry.url = strdup(url);
+
+        cache_entry_t *existing = CacheIndexLookup(&cache.index, entry.url);
+        if (existing != NULL) {
+            if (existing->bytes >= 0) cache.total -= existing->bytes;
+            free(existing->url);
+        }
+        CacheIndexEnter(&cache.index, &entry);
+        cache.total += entry.bytes;
+        if (entry.used >= cache.clock) cache.clock = entry.used + 1;
+    }
+    return true;
+}
+
+bool CurlConnectionOpenCache(const char *cache_dir, long long budget_bytes) {
+    char path[ARCHIVE_PATH_N_BYTES];
+    if (mkdir(cache_dir, 0777) != 0 && errno != EEXIST) {
+        perror(cache_dir);
+        return false;
+    }
+    cache.dir = strdup(cache_dir);
+    cache.budget = budget_bytes;
+    cache.total = cache.clock = 0;
+    cache.n_revalidated = cache.n_stored = cache.n_evicted = 0;
+    CacheIndexNew(&cache.index, 1024);
+    sem_init(&cache.lock, 0, 1);
+
+    snprintf(path, sizeof(path), "%s/%s", cache_dir, kIndexFile);
+    FILE *infile = fopen(path, "r");
+    if (infile == NULL) return errno == ENOENT;
+    bool ok = LoadCacheIndex(infile);
+    fclose(infile);
+    if (!ok) fprintf(stderr, "%s: malformed fetch cache index\n", path);
+    // a smaller budget than last time takes effect right away.
+    else if (cache.total > cache.budget) EvictLocked();
+    return ok;
+}
+
+bool CurlConnectionCloseCache(void) {
+    if (cache.dir == NULL) return true;
+    char path[ARCHIVE_PATH_N_BYTES], temp_path[ARCHIVE_PATH_N_BYTES + 8];
+    snprintf(path, sizeof(path), "%s/%s", cache.dir, kIndexFile);
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    // written in full before it replaces the old index, so a crash leaves one or the other.
+    FILE *outfile = fopen(temp_path, "w");
+    bool ok = outfile != NULL;
+    for (int i = 0; i < CacheIndexCount(&cache.index); i++) {
+        cache_entry_t *entry = CacheIndexAt(&cache.index, i);
+        if (ok && entry->bytes >= 0)
+            fprintf(outfile, "%s\t%lld\t%lld\t%s\t%s\t%s\n", entry->body, entry->bytes, entry->used,
+                    entry->validators.etag, entry->validators.last_modified, entry->url);
+        free(entry->url);
+    }
+    if (outfile != NULL) ok = fclose(outfile) == 0 && ok;
+    if (ok) ok = rename(temp_path, path) == 0;
+    if (!ok) perror(path);
+
+    CacheIndexDispose(&cache.index);
+    sem_destroy(&cache.lock);
+    free(cache.dir);
+    cache.dir = NULL;
+    return ok;
+}
+
+void CurlConnectionCacheReport(void) {
+    if (cache.dir == NULL) return;
+    int n_live = 0;
+    for (int i = 0; i < CacheIndexCount(&cache.index); i++)
+        n_live += CacheIndexAt(&cache.index, i)->bytes >= 0;
+    printf("Fetch cache %s: %d fetches revalidated, %d bodies stored, %d evicted; %d bodies, %.1f MB.\n",
+           cache.dir, cache.n_revalidated, cache.n_stored, cache.n_evicted, n_live, cache.total / 1e6);
+}
+
+// The profile for url's host, falling back to the * profile.  NULL if neither exists.
+static const host_profile_t *HostProfile(const char *url) {
+    char host[256] = "";
+    const char *start = strstr(url, "://");
+    if (start != NULL) {
+        start += 3;
+        size_t length = strcspn(start, ":/?#");
+        if (length < sizeof(host)) {
+            memcpy(host, start, length);
+            host[length] = '\0';
+        }
+    }
+    const host_profile_t *fallback = NULL;
+    for (int i = 0; i < VectorLength(&archive.hosts); i++) {
+        const host_profile_t *profile = VectorNth(&archive.hosts, i);
+        if (strcasecmp(profile->host, host) == 0) return profile;
+        if (strcmp(profile->host, "*") == 0) fallback = profile;
+    }
+    return fallback;
+}
+
+static void SleepNs(long long ns) {
+    if (ns <= 0) return;
+    struct timespec delay = { ns / 1000000000LL, ns % 1000000000LL };
+    while (nanosleep(&delay, &delay) != 0 && errno == EINTR) ;
+}
+
+// Serves url out of the archive, pacing it to the host's latency and bandwidth if
+// hosts.txt gave any.
+static int ReplayFetch(const char *url, FILE *stream, curlconnection_t *cc) {
+    const archive_entry_t *entry = ArchiveIndexLookup(&archive.index, url);
+    if (entry == NULL) {
+        cc->error = CURLE_REMOTE_FILE_NOT_FOUND;
+        cc->error_str = "Not in the replay archive";
+        return cc->error;
+    }
+
+    char body_path[ARCHIVE_PATH_N_BYTES];
+    snprintf(body_path, sizeof(body_path), "%s/%s/%s", archive.dir, kBodiesDir, entry->body);
+    FILE *body = fopen(body_path, "r");
+    if (body == NULL) {
+        cc->error = CURLE_READ_ERROR;
+        cc->error_str = "Replay archive is missing the response body";
+        return cc->error;
+    }
+
+    const host_profile_t *profile = HostProfile(url);
+    if (profile != NULL) SleepNs(profile->latency_ms * 1000000LL);
+
+    char chunk[16384];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), body)) > 0) {
+        if (profile != NULL && profile->bandwidth_kbs > 0)
+            SleepNs((long long)n * 1000000000LL / (profile->bandwidth_kbs * 1024));
+        // as live, a failed fetch's body never reaches the stream.
+        if (entry->code == CURLE_OK) fwrite(chunk, 1, n, stream);
+        cc->wire_bytes += n;
+        cc->decoded_bytes += n;
+    }
+    fclose(body);
+    fflush(stream);
+
+    cc->error = entry->code;
+    cc->error_str = curl_easy_strerror(cc->error);
+    return cc->error;
+}
+
+static void LoadIndex(FILE *infile) {
+    char line[ARCHIVE_LINE_N_BYTES];
+    while (fgets(line, sizeof(line), infile) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *code = strchr(line, '\t');
+        char *url = (code == NULL) ? NULL : strchr(code + 1, '\t');
+        if (url == NULL || code - line != 16) {
+            fprintf(stderr, "Skipping malformed archive index line: %s\n", line);
+            continue;
+        }
+        archive_entry_t entry;
+        memcpy(entry.body, line, 16);
+        entry.body[16] = '\0';
+        entry.code = atoi(code + 1);
+        entry.url = strdup(url + 1);
+
+        // a url recorded twice keeps its latest response.
+        archive_entry_t *existing = ArchiveIndexLookup(&archive.index, entry.url);
+        if (existing != NULL) free(existing->url);
+        ArchiveIndexEnter(&archive.index, &entry);
+    }
+}
+
+static void LoadHosts(FILE *infile) {
+    char line[ARCHIVE_LINE_N_BYTES];
+    while (fgets(line, sizeof(line), infile) != NULL) {
+        host_profile_t profile;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%255s %ld %ld", profile.host, &profile.latency_ms, &profile.bandwidth_kbs) == 3)
+            VectorAppend(&archive.hosts, &profile);
+    }
+}
+
+bool CurlConnectionOpenArchive(fetch_mode_t mode, const char *archive_dir) {
+    char path[ARCHIVE_PATH_N_BYTES];
+    archive.mode = mode;
+    if (mode == FETCH_LIVE) return true;
+
+    assert(archive_dir != NULL);
+    archive.dir = strdup(archive_dir);
+    ArchiveIndexNew(&archive.index, 1024);
+    VectorNew(&archive.hosts, sizeof(host_profile_t), NULL, 4);
+
+    if (mode == FETCH_RECORD) {
+        snprintf(path, sizeof(path), "%s/%s", archive_dir, kBodiesDir);
+        if ((mkdir(archive_dir, 0777) != 0 && errno != EEXIST) || (mkdir(path, 0777) != 0 && errno != EEXIST)) {
+            perror(path);
+            return false;
+        }
+        snprintf(path, sizeof(path), "%s/%s", archive_dir, kIndexFile);
+        archive.index_file = fopen(path, "a");   // recording again adds to the archive
+        if (archive.index_file == NULL) {
+            perror(path);
+            return false;
+        }
+        sem_init(&archive.index_lock, 0, 1);
+        return true;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, kIndexFile);
+    FILE *infile = fopen(path, "r");
+    if (infile == NULL) {
+        perror(path);
+        return false;
+    }
+    LoadIndex(infile);
+    fclose(infile);
+
+    snprintf(path, sizeof(path), "%s/%s", archive_dir, kHostsFile);
+    infile = fopen(path, "r");
+    if (infile != NULL) {
+        LoadHosts(infile);
+        fclose(infile);
+    }
+    return true;
+}
+
+void CurlConnectionCloseArchive(void) {
+    if (archive.mode == FETCH_LIVE) return;
+    for (int i = 0; i < ArchiveIndexCount(&archive.index); i++)
+        free(ArchiveIndexAt(&archive.index, i)->url);
+    ArchiveIndexDispose(&archive.index);
+    VectorDispose(&archive.hosts);
+    if (archive.mode == FETCH_RECORD) {
+        fclose(archive.index_file);
+        sem_destroy(&archive.index_lock);
+    }
+    free(archive.dir);
+    archive.mode = FETCH_LIVE;
 }
@@ -4,28 +4,149 @@
 
 
 #include <curl/curl.h>
+#include "bool.h"
 
 
 typedef struct {
     CURL *curl_handle;  
     CURLcode error;    // enum 
     const char *error_str;
+    bool revalidated;  // the last fetch was answered 304 and served from the fetch cache
+    long http_status;  // of the last fetch's final response, or 0 if there wasn't one
+
+    // Set before a fetch to hedge it: if it's still going after this long, the url is
+    // requested again on a second handle, and whichever answers first is kept.  0
+    // never hedges.  Left as it is by the fetch. 
+    long hedge_after_ms;
+    CURL *hedge_handle;    // NULL until the first hedge
+    CURLM *multi;          // runs the two at once; likewise
+    // For the last fetch: 
+    int retries;           // attempts after the first
+    bool hedged;           // a hedge went out
+    bool hedge_won;        // and its response was the one kept
+    unsigned rng;          // for jittering the delays between attempts
+
+    // Bodies are asked for gzip'd or deflated, and inflated as they arrive, a 
+    // piece at a time, on their way into the stream.  For the last fetch: 
+    long long wire_bytes;      // body bytes as sent, compressed or not
+    long long decoded_bytes;   // body bytes written to the stream
+    long long decode_ns;       // time spent inflating them, 0 if they weren't compressed
 } curlconnection_t;
 
 // Initializes a curl connection handle to be used in fetching resources.
 // this does not call global init function. 
 void CurlConnectionNew( curlconnection_t *cc );
 
+// Makes every connection created from here on share one DNS cache, one TLS
+// session cache and one pool of open connections.  A host that one thread has
+// already looked up, shaken hands with or connected to then costs the others
+// nothing, and a connection left open by a feed fetch can carry another thread's
+// articles.  The pool keeps up to max_connections idle connections, closing the
+// oldest beyond that; a few per thread that fetches is plenty.  Call it after
+// curl_global_init and before the first CurlConnectionNew.  Returns false if
+// libcurl can't share all three. 
+bool CurlConnectionShareCaches(int max_connections);
+
+// Releases the shared caches.  Call once every connection has been disposed of.
+void CurlConnectionUnshareCaches(void);
+
+// Gives up on connecting after connect_ms, and on a whole fetch, redirects and
+// all, after transfer_ms.  0 leaves either unlimited, as it is to begin with.  Call
+// it before CurlConnectionNew. 
+void CurlConnectionSetTimeouts(long connect_ms, long transfer_ms);
+
+// Tries a fetch that times out, can't connect, loses its connection or is answered
+// with a 429 or a 5xx up to max_retries more times.  Each retry waits a random
+// time between one and two times base_delay_ms, doubling with each retry, or as
+// long as a Retry-After header asks, up to a few seconds.  None by default.  Call
+// it before any fetches.  Replayed fetches are never retried. 
+void CurlConnectionSetRetries(int max_retries, long base_delay_ms);
+
+// Cuts every fetch off at deadline_ns, a CLOCK_MONOTONIC reading in nanoseconds,
+// as TimingNow gives.  A fetch started after it fails at once, and retries that
+// would wait past it aren't tried.  Both fail with CURLE_OPERATION_TIMEDOUT.  0, the
+// default, is no deadline. 
+void CurlConnectionSetDeadline(long long deadline_ns);
+
 //void CurlConnectionSetURL(curlconnection_t *cc, const char *url);
 //void CurlConnectionSetStream( curlconnection_t *cc, FILE *stream);
 
 
 // Sets the URL and fetches the resource, storing it in the stream.  
-// The stream is flushed so it is ready to read. 
+// The stream is flushed so it is ready to read.  It must be seekable, since a
+// retry, or a hedge that wins, starts the body over from where the fetch began,
+// and a failed fetch goes back there too.  Seeking back doesn't truncate a 
+// memstream, so read it only up to the length it reports once the fetch returns
+// (see MSTDoneWriting); bytes past that are left over from an abandoned attempt. 
 // Returns 0 for status okay.  Otherwise, returns status. 
 int CurlConnectionFetch(const char *url, FILE *stream, curlconnection_t *cc );
 
 // Performs cleanup functions. 
 void CurlConnectionDispose( curlconnection_t *cc);
 
+
+// Where CurlConnectionFetch gets its bytes.  Live goes to the network.  Record
+// also goes to the network, and saves every response to an archive directory.
+// Replay never touches the network: it serves responses back out of an archive.
+typedef enum {
+    FETCH_LIVE,
+    FETCH_RECORD,
+    FETCH_REPLAY
+} fetch_mode_t;
+
+// Selects the fetch mode for every connection.  Call it once, before any fetches.
+// An archive directory holds:
+//
+//   index.txt   one line per response: <body file> <tab> <CURLcode> <tab> <url>
+//   bodies/     the response bodies, named by a hash of the url
+//   hosts.txt   optional, read in replay mode only.  Lines of
+//               <host> <latency ms> <bandwidth KB/s>, where host * covers any
+//               host not listed and a bandwidth of 0 means unlimited.
+//
+// Replays return the recorded CURLcode, so failed fetches fail again.  A url
+// that was never recorded fails with CURLE_REMOTE_FILE_NOT_FOUND.
+// Returns false if the archive can't be opened (or, for recording, created).
+bool CurlConnectionOpenArchive(fetch_mode_t mode, const char *archive_dir);
+
+// Releases the archive.  Call once all fetches are done. 
+void CurlConnectionCloseArchive(void);
+
+// The name of the file in bodies/ that holds url's response, for tools that
+// write archives of their own.
+void CurlConnectionArchiveBodyName(const char *url, char name[17]);
+
+// For tools that serve an archive opened with FETCH_REPLAY: fills in the path of
+// url's recorded body and the CURLcode it was recorded with.  Returns false if url
+// was never recorded. 
+bool CurlConnectionArchiveLookup(const char *url, char *path, int path_size, CURLcode *code);
+
+// Sends every connection to host_port (as in "127.0.0.1:8108") whatever host the
+// url names, the way a hosts file entry would.  For crawling a local mock server.
+// Call it before CurlConnectionNew.  NULL goes back to normal name resolution. 
+void CurlConnectionRouteAllTo(const char *host_port);
+
+// An on-disk cache of the responses that came with an ETag or a Last-Modified
+// header.  Once a url is cached, fetching it again sends If-None-Match and
+// If-Modified-Since, and a 304 Not Modified is answered with the cached body as
+// though the server had sent it again.  A cache directory holds:
+//
+//   index.txt   one line per body: <body file> <tab> <bytes> <tab> <last used>
+//               <tab> <ETag> <tab> <Last-Modified> <tab> <url>
+//   <body file> the latest body received for the url, named by a hash of the url
+//
+// Whenever the bodies add up to more than budget_bytes, the least recently used
+// are deleted until they take less than 90% of it.  The index is read when the
+// cache is opened and written when it's closed.  Fetches in FETCH_REPLAY mode
+// don't use the cache.  Call it once, before any fetches.  Returns false if the
+// directory can't be created, or holds an index that can't be read. 
+bool CurlConnectionOpenCache(const char *cache_dir, long long budget_bytes);
+
+// Writes the index back and releases the cache.  Call once all fetches are done.
+// Returns false if the index couldn't be written. 
+bool CurlConnectionCloseCache(void);
+
+// Prints how many fetches were revalidated, how many bodies were stored and
+// evicted, and how much the cache holds. 
+void CurlConnectionCacheReport(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <zlib.h>
+#include "docstore.h"
+#include "memtrack.h"
+
+void DocStoreNew(docstore_t *store) {
+  memset(store, 0, sizeof(docstore_t));
+  store->cache_block = -1;
+  int err = sem_init(&store->cache_lock, 0, 1);
+  assert(err == 0);
+  (void)err;
+}
+
+void DocStoreDispose(docstore_t *store) {
+  for (int i = 0; i < store->n_blocks; i++) {
+    bool open = (i == store->n_blocks - 1);
+    MemFree(MEM_SNIPPETS, store->blocks[i].data, open ? store->open_allocated : store->blocks[i].length);
+  }
+  MemFree(MEM_SNIPPETS, store->blocks, store->blocks_allocated * sizeof(docstore_block_t));
+  MemFree(MEM_SNIPPETS, store->docs, store->docs_allocated * sizeof(docstore_doc_t));
+  MemFree(MEM_SNIPPETS, store->cache, store->cache_allocated);
+  sem_destroy(&store->cache_lock);
+}
+
+// Deflates the open block in place of its raw bytes.
+static void SealOpenBlock(docstore_t *store) {
+  docstore_block_t *block = &store->blocks[store->n_blocks - 1];
+  uLongf compressed_length = compressBound(block->raw_length);
+  unsigned char *compressed = MemMalloc(MEM_SNIPPETS, compressed_length);
+  int err = compress2(compressed, &compressed_length, block->data, block->raw_length, Z_DEFAULT_COMPRESSION);
+  assert(err == Z_OK);
+  (void)err;
+
+  MemFree(MEM_SNIPPETS, block->data, store->open_allocated);
+  block->data = MemRealloc(MEM_SNIPPETS, compressed, compressBound(block->raw_length), compressed_length);
+  block->length = compressed_length;
+  store->open_allocated = 0;
+  store->raw_bytes += block->raw_length;
+  store->compressed_bytes += block->length;
+}
+
+// Makes sure the open block has room for length more bytes, sealing it and
+// starting another if it's already full.
+static docstore_block_t *OpenBlockWithRoom(docstore_t *store, int length) {
+  docstore_block_t *block = store->n_blocks > 0 ? &store->blocks[store->n_blocks - 1] : NULL;
+  if (block != NULL && block->raw_length > 0 && block->raw_length + length > DOCSTORE_BLOCK_BYTES) {
+    SealOpenBlock(store);
+    block = NULL;
+  }
+  if (block == NULL) {
+    if (store->n_blocks == store->blocks_allocated) {
+      int allocated = store->blocks_allocated > 0 ? 2 * store->blocks_allocated : 16;
+      store->blocks = MemRealloc(MEM_SNIPPETS, store->blocks, store->blocks_allocated * sizeof(docstore_block_t),
+                                 allocated * sizeof(docstore_block_t));
+      store->blocks_allocated = allocated;
+    }
+    block = &store->blocks[store->n_blocks++];
+    block->data = NULL;
+    block->length = block->raw_length = 0;
+    store->open_allocated = 0;
+  }
+  if (block->raw_length + length > store->open_allocated) {
+    int allocated = DOCSTORE_BLOCK_BYTES;
+    while (allocated < block->raw_length + length) allocated *= 2;
+    block->data = MemRealloc(MEM_SNIPPETS, block->data, store->open_allocated, allocated);
+    store->open_allocated = allocated;
+  }
+  return block;
+}
+
+void DocStoreAdd(docstore_t *store, int id, const char *text, int length) {
+  assert(id >= 0 && length >= 0);
+  if (id >= store->docs_allocated) {
+    int allocated = store->docs_allocated > 0 ? store->docs_allocated : 256;
+    while (allocated <= id) allocated *= 2;
+    store->docs = MemRealloc(MEM_SNIPPETS, store->docs, store->docs_allocated * sizeof(docstore_doc_t),
+                             allocated * sizeof(docstore_doc_t));
+    store->docs_allocated = allocated;
+  }
+  for (; store->n_docs <= id; store->n_docs++) store->docs[store->n_docs].block = -1;
+  assert(store->docs[id].block < 0);
+
+  docstore_block_t *block = OpenBlockWithRoom(store, length);
+  memcpy(block->data + block->raw_length, text, length);
+  store->docs[id].block = store->n_blocks - 1;
+  store->docs[id].offset = block->raw_length;
+  store->docs[id].length = length;
+  block->raw_length += length;
+  block->length = block->raw_length;
+}
+
+char *DocStoreFetch(docstore_t *store, int id, int *length) {
+  if (id < 0 || id >= store->n_docs || store->docs[id].block < 0) return NULL;
+  const docstore_doc_t *doc = &store->docs[id];
+  const docstore_block_t *block = &store->blocks[doc->block];
+  char *text = malloc(doc->length + 1);
+  *length = doc->length;
+  text[doc->length] = '\0';
+
+  if (doc->block == store->n_blocks - 1) {   // the open block is still raw
+    memcpy(text, block->data + doc->offset, doc->length);
+    return text;
+  }
+
+  sem_wait(&store->cache_lock);
+  if (store->cache_block != doc->block) {
+    uLongf raw_length = block->raw_length;
+    if (store->cache_allocated < block->raw_length) {
+      store->cache = MemRealloc(MEM_SNIPPETS, store->cache, store->cache_allocated, block->raw_length);
+      store->cache_allocated = block->raw_length;
+    }
+    int err = uncompress(store->cache, &raw_length, block->data, block->length);
+    assert(err == Z_OK && raw_length == (uLongf)block->raw_length);
+    (void)err;
+    store->cache_block = doc->block;
+  }
+  memcpy(text, store->cache + doc->offset, doc->length);
+  sem_post(&store->cache_lock);
+  return text;
+}
+
+void DocStoreReport(const docstore_t *store) {
+  int n_stored = 0;
+  for (int i = 0; i < store->n_docs; i++) n_stored += store->docs[i].block >= 0;
+  printf("Snippet store: %d documents in %d blocks", n_stored, store->n_blocks);
+  if (store->raw_bytes > 0)
+    printf(", sealed blocks %.1f KB deflated to %.1f KB", store->raw_bytes / 1024.0, store->compressed_bytes / 1024.0);
+  printf(".\n");
+}
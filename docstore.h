@@ -0,0 +1,59 @@
+
+#ifndef __DOCSTORE_
+#define __DOCSTORE_
+
+#include <semaphore.h>
+#include "bool.h"
+
+// A compressed store of text, one document per article id.  Documents are packed
+// end to end into blocks of about DOCSTORE_BLOCK_BYTES, and each block is deflated
+// with zlib once it fills, so a document costs its share of a compressed block
+// rather than a buffer of its own.  Reading a document inflates its whole block;
+// the last block inflated is kept, since readers tend to want neighbours.
+
+#define DOCSTORE_BLOCK_BYTES (64 * 1024)
+
+typedef struct {
+  unsigned char *data;   // deflated, except for the open block
+  int length;            // bytes in data
+  int raw_length;        // bytes once inflated
+} docstore_block_t;
+
+typedef struct {
+  int block;             // -1 if the document was never added
+  int offset, length;    // within the inflated block
+} docstore_doc_t;
+
+typedef struct {
+  docstore_block_t *blocks;
+  int n_blocks, blocks_allocated;
+  docstore_doc_t *docs;  // indexed by id
+  int n_docs, docs_allocated;
+
+  // The block still being filled, which is the last one.  It stays raw.
+  int open_allocated;
+
+  // The most recently inflated block, for DocStoreFetch.
+  unsigned char *cache;
+  int cache_block, cache_allocated;
+  sem_t cache_lock;
+
+  long long raw_bytes, compressed_bytes;   // of the sealed blocks
+} docstore_t;
+
+void DocStoreNew(docstore_t *store);
+void DocStoreDispose(docstore_t *store);
+
+// Stores length bytes of text as document id.  Ids needn't be added in order, but
+// each may only be added once.  Not safe to call from several threads at once.
+void DocStoreAdd(docstore_t *store, int id, const char *text, int length);
+
+// Returns a malloc'd, '\0'-terminated copy of document id and sets *length to its
+// length, or returns NULL if there's no such document.  Safe to call from several
+// threads at once, as long as nobody is adding.
+char *DocStoreFetch(docstore_t *store, int id, int *length);
+
+// Prints how many documents are stored and how well they compressed.
+void DocStoreReport(const docstore_t *store);
+
+#endif // __DOCSTORE_
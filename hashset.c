@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "hashset.h"
+
+// Each bucket is a vector of elements, created with the client's free function,
+// so the vectors take care of freeing replaced and disposed elements.
+
+void HashSetNew(hashset *h, int elemSize, int numBuckets,
+		HashSetHashFunction hashfn, HashSetCompareFunction comparefn, HashSetFreeFunction freefn)
+{
+  assert(elemSize > 0);
+  assert(numBuckets > 0);
+  assert(hashfn != NULL && comparefn != NULL);
+
+  h->elemSize = elemSize;
+  h->numBuckets = numBuckets;
+  h->elemCount = 0;
+  h->hashfn = hashfn;
+  h->comparefn = comparefn;
+  h->buckets = malloc(numBuckets * sizeof(vector));
+  assert(h->buckets != NULL);
+  for (int i = 0; i < numBuckets; i++)
+    VectorNew(&h->buckets[i], elemSize, freefn, 4);
+}
+
+void HashSetDispose(hashset *h)
+{
+  for (int i = 0; i < h->numBuckets; i++)
+    VectorDispose(&h->buckets[i]);
+  free(h->buckets);
+  h->buckets = NULL;
+  h->elemCount = 0;
+}
+
+int HashSetCount(const hashset *h)
+{
+  return h->elemCount;
+}
+
+void HashSetMap(hashset *h, HashSetMapFunction mapfn, void *auxData)
+{
+  assert(mapfn != NULL);
+  for (int i = 0; i < h->numBuckets; i++)
+    VectorMap(&h->buckets[i], mapfn, auxData);
+}
+
+static vector *BucketFor(const hashset *h, const void *elemAddr)
+{
+  assert(elemAddr != NULL);
+  int code = h->hashfn(elemAddr, h->numBuckets);
+  assert(code >= 0 && code < h->numBuckets);
+  return &h->buckets[code];
+}
+
+void HashSetEnter(hashset *h, const void *elemAddr)
+{
+  vector *bucket = BucketFor(h, elemAddr);
+  int position = VectorSearch(bucket, elemAddr, h->comparefn, 0, false);
+  if (position >= 0) {
+    VectorReplace(bucket, elemAddr, position);
+  } else {
+    VectorAppend(bucket, elemAddr);
+    h->elemCount++;
+  }
+}
+
+void *HashSetLookup(hashset *h, const void *elemAddr)
+{
+  vector *bucket = BucketFor(h, elemAddr);
+  int position = VectorSearch(bucket, elemAddr, h->comparefn, 0, false);
+  return (position < 0) ? NULL : VectorNth(bucket, position);
+}
@@ -0,0 +1,131 @@
+#include <ctype.h>
+#include "host-limiter.h"
+#include "timing.h"
+
+static const double kBackoff = 0.5;              // the limit's cut on an overload
+static const double kFastWeight = 0.3;           // of each sample in the fast average
+static const double kBaselineRise = 1.0 / 64;    // how quickly the baseline follows it up
+static const double kLatencyTolerance = 2.0;     // fast average over baseline that's still healthy
+
+void HostLimiterNew(host_limiter_t *limiter, int initial_limit, int max_limit) {
+  HostStateSetNew(&limiter->hosts, 64);
+  pthread_mutex_init(&limiter->lock, NULL);
+  limiter->initial_limit = initial_limit < max_limit ? initial_limit : max_limit;
+  limiter->max_limit = max_limit;
+  limiter->backoffs = MetricsCounter("rss_host_backoffs_total",
+                                     "Times a host's concurrency limit was cut for a 429, 5xx or timeout.",
+                                     NULL, NULL);
+}
+
+void HostLimiterDispose(host_limiter_t *limiter) {
+  for (int i = 0; i < HostStateSetCount(&limiter->hosts); i++)
+    pthread_cond_destroy(&HostStateSetAt(&limiter->hosts, i)->slot_free);
+  HostStateSetDispose(&limiter->hosts);
+  pthread_mutex_destroy(&limiter->lock);
+}
+
+// The lowercased host of url, without its port.
+static void UrlHost(const char *url, char host[HOST_N_BYTES]) {
+  const char *start = strstr(url, "://");
+  start = start != NULL ? start + 3 : url;
+  size_t length = strcspn(start, ":/?#");
+  if (length >= HOST_N_BYTES) length = HOST_N_BYTES - 1;
+  for (size_t i = 0; i < length; i++) host[i] = tolower((unsigned char)start[i]);
+  host[length] = '\0';
+}
+
+// Called with the lock held. 
+static host_state_t *AddHost(host_limiter_t *limiter, const char *host) {
+  host_state_t new_host;
+  memset(&new_host, 0, sizeof(new_host));
+  strcpy(new_host.host, host);
+  new_host.limit = limiter->initial_limit;
+  new_host.lowest_limit = new_host.highest_limit = limiter->initial_limit;
+  new_host.last_backoff_ns = TimingNow();
+  // the condition variable is set up where it'll live, since it can't be copied.
+  host_state_t *state = HostStateSetEnter(&limiter->hosts, &new_host);
+  pthread_cond_init(&state->slot_free, NULL);
+  state->limit_gauge = MetricsGauge("rss_host_concurrency_limit", "Fetches allowed in flight to a host at once.",
+                                    "host", host);
+  MetricsSet(state->limit_gauge, limiter->initial_limit);
+  return state;
+}
+
+// Looks up url's host, adding it if it's new, and takes the lock.
+static host_state_t *LockHost(host_limiter_t *limiter, const char *url) {
+  char host[HOST_N_BYTES];
+  UrlHost(url, host);
+  pthread_mutex_lock(&limiter->lock);
+  host_state_t *state = HostStateSetLookup(&limiter->hosts, host);
+  return state != NULL ? state : AddHost(limiter, host);
+}
+
+host_state_t *HostLimiterAcquire(host_limiter_t *limiter, const char *url) {
+  host_state_t *state = LockHost(limiter, url);
+  while (state->in_flight >= (int)state->limit) pthread_cond_wait(&state->slot_free, &limiter->lock);
+  state->in_flight++;
+  pthread_mutex_unlock(&limiter->lock);
+  return state;
+}
+
+host_state_t *HostLimiterTryAcquire(host_limiter_t *limiter, const char *url) {
+  host_state_t *state = LockHost(limiter, url);
+  if (state->in_flight < (int)state->limit) state->in_flight++;
+  else state = NULL;
+  pthread_mutex_unlock(&limiter->lock);
+  return state;
+}
+
+// Folds a healthy fetch's latency into the averages, and says whether the host is
+// still as quick as it was.
+static bool LatencyHealthy(host_state_t *state, long long latency_ns) {
+  if (state->fast_latency_ns == 0) state->fast_latency_ns = state->baseline_latency_ns = latency_ns;
+  state->fast_latency_ns += kFastWeight * (latency_ns - state->fast_latency_ns);
+  if (state->fast_latency_ns < state->baseline_latency_ns) state->baseline_latency_ns = state->fast_latency_ns;
+  else state->baseline_latency_ns += kBaselineRise * (state->fast_latency_ns - state->baseline_latency_ns);
+  return state->fast_latency_ns <= kLatencyTolerance * state->baseline_latency_ns;
+}
+
+void HostLimiterRelease(host_limiter_t *limiter, host_state_t *state, fetch_outcome_t outcome,
+                        long long started_ns, long long latency_ns) {
+  pthread_mutex_lock(&limiter->lock);
+  // whether the limit was all taken up.  If it wasn't, the fetch says nothing
+  // about whether the host would take more.
+  bool limited = state->in_flight >= (int)state->limit;
+  state->in_flight--;
+  state->n_fetches++;
+  int old_limit = (int)state->limit;
+
+  if (outcome == FETCH_OVERLOADED && started_ns > state->last_backoff_ns) {
+    state->limit *= kBackoff;
+    if (state->limit < 1) state->limit = 1;
+    state->last_backoff_ns = TimingNow();
+    state->n_backoffs++;
+    MetricsAdd(limiter->backoffs, 1);
+  }
+  else if (outcome == FETCH_HEALTHY && LatencyHealthy(state, latency_ns) && limited) {
+    state->limit += state->n_backoffs == 0 ? 1 : 1 / state->limit;
+    if (state->limit > limiter->max_limit) state->limit = limiter->max_limit;
+  }
+
+  int limit = (int)state->limit;
+  if (limit != old_limit) {
+    MetricsSet(state->limit_gauge, limit);
+    if (limit < state->lowest_limit) state->lowest_limit = limit;
+    if (limit > state->highest_limit) state->highest_limit = limit;
+  }
+  // the limit may have grown by one as well as this fetch's room coming free.
+  pthread_cond_broadcast(&state->slot_free);
+  pthread_mutex_unlock(&limiter->lock);
+}
+
+void HostLimiterReport(host_limiter_t *limiter, FILE *out) {
+  pthread_mutex_lock(&limiter->lock);
+  fprintf(out, "%-32s %6s %6s %6s %8s %8s\n", "host", "limit", "lowest", "highest", "fetches", "backoffs");
+  for (int i = 0; i < HostStateSetCount(&limiter->hosts); i++) {
+    const host_state_t *state = HostStateSetAt(&limiter->hosts, i);
+    fprintf(out, "%-32s %6d %6d %6d %8d %8d\n", state->host, (int)state->limit, state->lowest_limit,
+            state->highest_limit, state->n_fetches, state->n_backoffs);
+  }
+  pthread_mutex_unlock(&limiter->lock);
+}
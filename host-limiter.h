@@ -0,0 +1,95 @@
+
+#ifndef __HOST_LIMITER_
+#define __HOST_LIMITER_
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "bool.h"
+#include "metrics.h"
+#include "typed-hashset.h"
+
+// A limit, per host, on how many fetches may be in flight to it at once, adjusted
+// as the fetches finish the way TCP adjusts its congestion window: additive
+// increase, multiplicative decrease (AIMD).
+//
+// Until a host's first backoff, every fetch that succeeds with the limit all taken
+// up raises it by one, so it doubles each round (TCP's slow start).  After that,
+// each one raises it by 1 / limit, so about one more fetch is allowed for each
+// limit's worth that succeed.  Either way it only grows while the host's latency
+// stays healthy.  A fetch turned away with a 429 or a 5xx, or that times out or can't
+// connect, halves the limit.  Only one such failure per round counts, so a burst
+// of fetches that all went out at the old limit doesn't cut it to nothing: a
+// failure halves the limit only if its fetch started after the last cut.
+//
+// Latency is healthy while a fast moving average of it stays within twice the
+// host's baseline, a slow average that follows the fast one straight down but
+// only slowly up.  A host that's slowing down keeps its limit without growing it.
+//
+// Each host's limit is exported as the gauge rss_host_concurrency_limit{host="..."},
+// and every cut counts toward rss_host_backoffs_total.
+
+#define HOST_N_BYTES 256
+
+typedef enum {
+  FETCH_HEALTHY,      // succeeded
+  FETCH_NEUTRAL,      // failed in a way that says nothing about load, like a 404
+  FETCH_OVERLOADED    // a 429 or 5xx, a timeout, or a connection refused or dropped
+} fetch_outcome_t;
+
+typedef struct {
+  char host[HOST_N_BYTES];
+  double limit;
+  int in_flight;
+  double fast_latency_ns, baseline_latency_ns;   // 0 until the first success
+  long long last_backoff_ns;                     // a TimingNow reading
+  int n_fetches, n_backoffs;                     // n_backoffs is 0 during slow start
+  int lowest_limit, highest_limit;
+  pthread_cond_t slot_free;
+  metric_id_t limit_gauge;
+} host_state_t;
+
+#define HOST_STATE_KEY(elem) ((elem)->host)
+static inline unsigned HostHash(const char *host) {
+  unsigned hash = 2166136261u;
+  for (; *host != '\0'; host++) hash = (hash ^ (unsigned char)*host) * 16777619u;
+  return hash;
+}
+static inline bool HostsMatch(const char *a, const char *b) {
+  return strcmp(a, b) == 0;
+}
+
+DECLARE_TYPED_HASHSET(host_state_set_t, HostStateSet, host_state_t, const char *,
+                      HOST_STATE_KEY, HostHash, HostsMatch)
+
+typedef struct {
+  host_state_set_t hosts;
+  pthread_mutex_t lock;     // guards every host's state
+  int initial_limit, max_limit;
+  metric_id_t backoffs;
+} host_limiter_t;
+
+// Every host starts out allowed initial_limit fetches at once, and is never
+// allowed more than max_limit or fewer than one.
+void HostLimiterNew(host_limiter_t *limiter, int initial_limit, int max_limit);
+void HostLimiterDispose(host_limiter_t *limiter);
+
+// Waits until url's host has room for another fetch, and takes it.  Returns the
+// host's state, to be handed back to HostLimiterRelease once the fetch is done.
+host_state_t *HostLimiterAcquire(host_limiter_t *limiter, const char *url);
+
+// Takes room for a fetch of url if its host has some to spare, and returns the
+// host's state as HostLimiterAcquire does.  Returns NULL, without waiting, if not.
+host_state_t *HostLimiterTryAcquire(host_limiter_t *limiter, const char *url);
+
+// Gives back a fetch's room and adjusts its host's limit for how it went.
+// started_ns is the TimingNow reading from just before the fetch, and latency_ns
+// how long it took.
+void HostLimiterRelease(host_limiter_t *limiter, host_state_t *host, fetch_outcome_t outcome,
+                        long long started_ns, long long latency_ns);
+
+// Prints every host's limit now and at its lowest and highest, with its number of
+// fetches and backoffs.
+void HostLimiterReport(host_limiter_t *limiter, FILE *out);
+
+#endif // __HOST_LIMITER_
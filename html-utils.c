@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <assert.h>
+#include "html-utils.h"
+
+// Named escapes we translate.  Each replacement is no longer than the escape
+// it replaces, so RemoveEscapeCharacters can work in place.
+typedef struct {
+  const char *name;
+  const char *replacement;
+} html_escape_t;
+
+static const html_escape_t kEscapes[] = {
+  { "amp", "&" }, { "lt", "<" }, { "gt", ">" }, { "quot", "\"" }, { "apos", "'" },
+  { "nbsp", " " }, { "ndash", "-" }, { "mdash", "-" }, { "lsquo", "'" }, { "rsquo", "'" },
+  { "ldquo", "\"" }, { "rdquo", "\"" }, { "hellip", "..." },
+};
+
+// Writes code point cp as UTF-8 and returns the number of bytes written.  The
+// shortest numeric escape, "&#9;", is already 4 bytes, so this never outgrows it.
+static int EncodeUTF8(unsigned long cp, char *out)
+{
+  if (cp < 0x80) { out[0] = cp; return 1; }
+  if (cp < 0x800) {
+    out[0] = 0xc0 | (cp >> 6);
+    out[1] = 0x80 | (cp & 0x3f);
+    return 2;
+  }
+  if (cp < 0x10000) {
+    out[0] = 0xe0 | (cp >> 12);
+    out[1] = 0x80 | ((cp >> 6) & 0x3f);
+    out[2] = 0x80 | (cp & 0x3f);
+    return 3;
+  }
+  out[0] = 0xf0 | (cp >> 18);
+  out[1] = 0x80 | ((cp >> 12) & 0x3f);
+  out[2] = 0x80 | ((cp >> 6) & 0x3f);
+  out[3] = 0x80 | (cp & 0x3f);
+  return 4;
+}
+
+// Decodes the escape starting at the '&' in text into out, and returns how many
+// characters of text it used up, or 0 if it isn't an escape we know.
+static int DecodeEscape(const char *text, char *out, int *n_out)
+{
+  const char *semicolon = strchr(text, ';');
+  if (semicolon == NULL || semicolon - text > 10) return 0;
+  int length = semicolon - text + 1;
+
+  if (text[1] == '#') {
+    char *end;
+    bool hex = (text[2] == 'x' || text[2] == 'X');
+    unsigned long cp = strtoul(text + (hex ? 3 : 2), &end, hex ? 16 : 10);
+    if (end != semicolon || end == text + (hex ? 3 : 2) || cp == 0 || cp > 0x10ffff) return 0;
+    *n_out = EncodeUTF8(cp, out);
+    return length;
+  }
+
+  for (size_t i = 0; i < sizeof(kEscapes) / sizeof(kEscapes[0]); i++) {
+    size_t name_length = strlen(kEscapes[i].name);
+    if (name_length == (size_t)length - 2 && strncmp(text + 1, kEscapes[i].name, name_length) == 0) {
+      *n_out = strlen(kEscapes[i].replacement);
+      memcpy(out, kEscapes[i].replacement, *n_out);
+      return length;
+    }
+  }
+  return 0;
+}
+
+void RemoveEscapeCharacters(char text[])
+{
+  char *read = text, *write = text;
+  while (*read != '\0') {
+    int consumed = 0, n_out;
+    char decoded[4];
+    if (*read == '&') consumed = DecodeEscape(read, decoded, &n_out);
+    if (consumed > 0) {
+      memcpy(write, decoded, n_out);
+      write += n_out;
+      read += consumed;
+    } else {
+      *write++ = *read++;
+    }
+  }
+  *write = '\0';
+}
+
+bool GetNextTag(streamtokenizer *st, char htmlBuffer[], int htmlBufferLength)
+{
+  assert(htmlBuffer != NULL && htmlBufferLength >= 3);
+  if (STSkipUntil(st, "<") == EOF) return false;
+
+  int c, length = 0;
+  while ((c = getc(st->infile)) != EOF) {
+    if (length < htmlBufferLength - 1) htmlBuffer[length++] = c;
+    if (c == '>') break;
+  }
+  if (c == EOF) return false;
+
+  // An overlong tag is truncated, but it still ends in '>' so that callers can
+  // tell where the tag stopped.
+  htmlBuffer[length - 1] = '>';
+  htmlBuffer[length] = '\0';
+  return true;
+}
+
+// Consumes the stream through the first case-insensitive occurrence of pattern.
+// The last strlen(pattern) characters are kept in a small ring.
+static void SkipPast(FILE *infile, const char *pattern)
+{
+  int length = strlen(pattern), seen = 0, c;
+  char recent[16];
+  assert(length < (int)sizeof(recent));
+  while ((c = getc(infile)) != EOF) {
+    recent[seen++ % length] = tolower(c);
+    if (seen < length) continue;
+    int i = 0;
+    while (i < length && recent[(seen + i) % length] == pattern[i]) i++;
+    if (i == length) return;
+  }
+}
+
+// Consumes the rest of a tag through its '>' and returns true if the tag closed
+// itself, as in <script src="..."/>.
+static bool SkipRestOfTag(FILE *infile, int previous)
+{
+  int c;
+  while ((c = getc(infile)) != EOF && c != '>') previous = c;
+  return previous == '/';
+}
+
+// True if tag starts with name followed by something that can't continue a tag name.
+static bool TagNamed(const char *tag, int length, const char *name)
+{
+  int name_length = strlen(name);
+  return length > name_length && strncasecmp(tag, name, name_length) == 0 &&
+         (isspace((unsigned char)tag[name_length]) || tag[name_length] == '>' || tag[name_length] == '/');
+}
+
+void SkipIrrelevantContent(streamtokenizer *st)
+{
+  char tag[8];
+  int length = 0, c = EOF;
+
+  // Read just enough of the tag to recognize comments, <script> and <style>.
+  while (length < (int)sizeof(tag) && (c = getc(st->infile)) != EOF) {
+    tag[length++] = c;
+    if (c == '>' || isspace(c)) break;
+    if (length == 3 && strncmp(tag, "!--", 3) == 0) break;
+  }
+  if (c == EOF) return;
+
+  if (length == 3 && strncmp(tag, "!--", 3) == 0) {
+    SkipPast(st->infile, "-->");
+    return;
+  }
+
+  bool script = TagNamed(tag, length, "script"), style = TagNamed(tag, length, "style");
+  bool self_closing = false;
+  if (c == '>') self_closing = (length >= 2 && tag[length - 2] == '/');
+  else self_closing = SkipRestOfTag(st->infile, c);
+
+  if (self_closing) return;
+  if (script) SkipPast(st->infile, "</script");
+  else if (style) SkipPast(st->infile, "</style");
+  else return;
+  SkipRestOfTag(st->infile, EOF);
+}
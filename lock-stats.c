@@ -0,0 +1,82 @@
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include "lock-stats.h"
+#include "timing.h"
+#include "trace.h"
+
+static lock_site_t *sites = NULL;   // every site that has taken a lock, newest first
+static pthread_mutex_t sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void LockInit(instrumented_lock_t *lock, const char *name) {
+  int err = sem_init(&lock->sem, 0, 1);
+  assert(err == 0);
+  (void)err;
+  lock->name = name;
+  lock->holder_site = NULL;
+  lock->acquired_ns = 0;
+}
+
+void LockDispose(instrumented_lock_t *lock) {
+  sem_destroy(&lock->sem);
+}
+
+static void RegisterSite(lock_site_t *site, const char *lock_name) {
+  pthread_mutex_lock(&sites_lock);
+  if (!site->registered) {
+    site->lock_name = lock_name;
+    site->next = sites;
+    sites = site;
+    __atomic_store_n(&site->registered, 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&sites_lock);
+}
+
+void SemWait(sem_t *sem) {
+  while (sem_wait(sem) != 0 && errno == EINTR)
+    ;
+}
+
+void LockAcquireAt(instrumented_lock_t *lock, lock_site_t *site) {
+  if (!__atomic_load_n(&site->registered, __ATOMIC_ACQUIRE)) RegisterSite(site, lock->name);
+
+  if (sem_trywait(&lock->sem) != 0) {
+    long long start = TimingNow();
+    TraceBegin("wait for lock");
+    SemWait(&lock->sem);
+    TraceEnd();
+    long long waited = TimingNow() - start;
+    __atomic_fetch_add(&site->n_contended, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&site->wait_ns, waited, __ATOMIC_RELAXED);
+    long long max = __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED);
+    while (waited > max && !__atomic_compare_exchange_n(&site->max_wait_ns, &max, waited, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  __atomic_fetch_add(&site->n_acquisitions, 1, __ATOMIC_RELAXED);
+  lock->holder_site = site;
+  lock->acquired_ns = TimingNow();
+}
+
+void LockRelease(instrumented_lock_t *lock) {
+  __atomic_fetch_add(&lock->holder_site->hold_ns, TimingNow() - lock->acquired_ns, __ATOMIC_RELAXED);
+  sem_post(&lock->sem);
+}
+
+void LockReport(FILE *out) {
+  fprintf(out, "%-34s %-24s %9s %9s %10s %10s %10s %10s\n",
+          "lock site", "lock", "acquired", "contended", "wait", "max wait", "hold", "mean hold");
+  pthread_mutex_lock(&sites_lock);
+  for (const lock_site_t *site = sites; site != NULL; site = site->next) {
+    char where[64];
+    long long n = __atomic_load_n(&site->n_acquisitions, __ATOMIC_RELAXED);
+    long long hold_ns = __atomic_load_n(&site->hold_ns, __ATOMIC_RELAXED);
+    snprintf(where, sizeof(where), "%s:%d", site->function, site->line);
+    fprintf(out, "%-34s %-24s %9lld %9lld %8.3fms %8.3fms %8.3fms %8.3fus\n", where, site->lock_name, n,
+            __atomic_load_n(&site->n_contended, __ATOMIC_RELAXED),
+            __atomic_load_n(&site->wait_ns, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&site->max_wait_ns, __ATOMIC_RELAXED) / 1e6,
+            hold_ns / 1e6, n > 0 ? hold_ns / 1e3 / n : 0.0);
+  }
+  pthread_mutex_unlock(&sites_lock);
+}
@@ -0,0 +1,57 @@
+
+#ifndef __LOCK_STATS_
+#define __LOCK_STATS_
+
+#include <stdio.h>
+#include <semaphore.h>
+
+// A binary semaphore that keeps statistics on how it's used, broken down by the
+// place in the code that takes it.  Each LOCK_ACQUIRE in the source is a site
+// with its own counts of acquisitions and contended acquisitions, and its own
+// totals of time spent waiting for the lock and holding it.  Sites shared by
+// several locks (one per domain, say) add up the lot.
+//
+// The uncontended path is a sem_trywait and one clock read.  A contended
+// acquisition also shows up as a "wait for lock" span in the trace (trace.h).
+
+typedef struct lock_site {
+  const char *function;
+  int line;
+  const char *lock_name;
+  long long n_acquisitions, n_contended;
+  long long wait_ns, max_wait_ns, hold_ns;
+  int registered;
+  struct lock_site *next;
+} lock_site_t;
+
+typedef struct {
+  sem_t sem;
+  const char *name;         // shown in the report.  Must outlive the lock.
+  lock_site_t *holder_site; // these two belong to whoever holds the lock
+  long long acquired_ns;
+} instrumented_lock_t;
+
+void LockInit(instrumented_lock_t *lock, const char *name);
+void LockDispose(instrumented_lock_t *lock);
+
+// Takes the lock, charging the wait to this line of the source.
+#define LOCK_ACQUIRE(lock) do {                                          \
+    static lock_site_t lock_site_ = { __func__, __LINE__ };              \
+    LockAcquireAt((lock), &lock_site_);                                  \
+  } while (0)
+
+void LockAcquireAt(instrumented_lock_t *lock, lock_site_t *site);
+
+// sem_wait, tried again whenever a signal cuts it short.  The query server's stop
+// handler is installed without SA_RESTART, so any thread's wait can come back early
+// with EINTR. 
+void SemWait(sem_t *sem);
+
+// Releases the lock, charging the time it was held to the site that took it.
+void LockRelease(instrumented_lock_t *lock);
+
+// Prints one line per site that has taken a lock: acquisitions, how many were
+// contended, total and worst wait, total and mean hold.
+void LockReport(FILE *out);
+
+#endif // __LOCK_STATS_
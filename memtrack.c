@@ -0,0 +1,42 @@
+#include <unistd.h>
+#include <sys/resource.h>
+#include "memtrack.h"
+
+mem_account_t mem_accounts[N_MEM_TAGS];
+
+static const char *const kTagNames[N_MEM_TAGS] = {
+  "other", "article html", "articles", "terms", "postings", "stop words", "snippets", "seen urls", "signatures",
+  "content store",
+};
+
+// Resident set size now, in bytes, from /proc.  0 where there's no /proc.
+static long long CurrentRSS(void) {
+  long long pages_total, pages_resident = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) return 0;
+  if (fscanf(statm, "%lld %lld", &pages_total, &pages_resident) != 2) pages_resident = 0;
+  fclose(statm);
+  return pages_resident * sysconf(_SC_PAGESIZE);
+}
+
+void MemTrackReport(FILE *out, const char *title) {
+  struct rusage usage;
+  long long live_total = 0;
+
+  fprintf(out, "Memory %s:\n", title);
+  fprintf(out, "%-14s %12s %10s %12s %12s\n", "subsystem", "live KB", "live", "peak KB", "allocations");
+  for (int tag = 0; tag < N_MEM_TAGS; tag++) {
+    const mem_account_t *account = &mem_accounts[tag];
+    long long bytes = __atomic_load_n(&account->bytes, __ATOMIC_RELAXED);
+    long long n_allocations = __atomic_load_n(&account->n_allocations, __ATOMIC_RELAXED);
+    if (n_allocations == 0) continue;
+    live_total += bytes;
+    fprintf(out, "%-14s %12.1f %10lld %12.1f %12lld\n", kTagNames[tag], bytes / 1024.0,
+            __atomic_load_n(&account->n_live, __ATOMIC_RELAXED),
+            __atomic_load_n(&account->peak_bytes, __ATOMIC_RELAXED) / 1024.0, n_allocations);
+  }
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "%-14s %12.1f\n", "tracked total", live_total / 1024.0);
+  // ru_maxrss is in kilobytes on Linux.
+  fprintf(out, "rss %.1f KB, peak rss %ld KB\n", CurrentRSS() / 1024.0, usage.ru_maxrss);
+}
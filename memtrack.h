@@ -0,0 +1,76 @@
+
+#ifndef __MEMTRACK_
+#define __MEMTRACK_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Accounting allocators.  Memory allocated through MemMalloc and MemRealloc is
+// charged to a subsystem tag, and each tag keeps its live bytes, live allocation
+// count, peak bytes and the number of allocations ever made.  The typed containers
+// allocate through these (see DECLARE_TYPED_VECTOR_TAGGED and
+// DECLARE_TYPED_HASHSET_TAGGED), and memory allocated elsewhere, such as the
+// buffers of open_memstream, can be charged with MemTrackAdd.
+//
+// Callers hand the size back when freeing or resizing, as the containers always
+// know it, so no header is stored in front of each block.
+
+typedef enum {
+  MEM_OTHER,          // typed containers that weren't given a tag
+  MEM_ARTICLE_HTML,   // the fetched html of every article, in its memstream
+  MEM_ARTICLES,       // document tables: the domains' during the crawl, then db->docs
+  MEM_TERMS,          // db->words: one entry per distinct word
+  MEM_POSTINGS,       // the occurrance vectors of every word
+  MEM_STOP_WORDS,
+  MEM_SNIPPETS,       // the compressed visible text kept with --snippets
+  MEM_URL_SET,        // fingerprints of every article url scheduled for fetching
+  MEM_SIGNATURES,     // MinHash signatures of the indexed articles, for near-duplicate checks
+  MEM_CONTENT_STORE,  // --content-store: what was made of each url's content last time
+  N_MEM_TAGS
+} mem_tag_t;
+
+typedef struct {
+  long long bytes, peak_bytes;
+  long long n_live, n_allocations;
+} mem_account_t;
+
+extern mem_account_t mem_accounts[N_MEM_TAGS];
+
+// Charges bytes and n_allocations (either may be negative, for a release) to tag.
+// Safe from any thread.
+static inline void MemTrackAdd(mem_tag_t tag, long long bytes, int n_allocations) {
+  mem_account_t *account = &mem_accounts[tag];
+  long long now = __atomic_add_fetch(&account->bytes, bytes, __ATOMIC_RELAXED);
+  long long peak = __atomic_load_n(&account->peak_bytes, __ATOMIC_RELAXED);
+  while (now > peak && !__atomic_compare_exchange_n(&account->peak_bytes, &peak, now, 1,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  if (n_allocations != 0) __atomic_fetch_add(&account->n_live, n_allocations, __ATOMIC_RELAXED);
+  if (n_allocations > 0) __atomic_fetch_add(&account->n_allocations, n_allocations, __ATOMIC_RELAXED);
+}
+
+static inline void *MemMalloc(mem_tag_t tag, size_t size) {
+  void *p = malloc(size);
+  if (p != NULL) MemTrackAdd(tag, size, 1);
+  return p;
+}
+
+// old_size is 0 when p is NULL, as with realloc(NULL, size).
+static inline void *MemRealloc(mem_tag_t tag, void *p, size_t old_size, size_t new_size) {
+  void *q = realloc(p, new_size);
+  if (q != NULL) MemTrackAdd(tag, (long long)new_size - (long long)old_size, p == NULL ? 1 : 0);
+  return q;
+}
+
+static inline void MemFree(mem_tag_t tag, void *p, size_t size) {
+  if (p == NULL) return;
+  free(p);
+  MemTrackAdd(tag, -(long long)size, -1);
+}
+
+// Prints live bytes, live allocations, peak bytes and allocations made for every
+// tag, followed by the process's current and peak resident set size.  title
+// heads the table.
+void MemTrackReport(FILE *out, const char *title);
+
+#endif // __MEMTRACK_
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "metrics.h"
+#include "timing.h"
+
+#define N_SHARDS 64
+
+typedef struct {
+  char name[64];
+  char help[128];
+  char label_name[32];
+  char label_value[64];
+  bool gauge;
+} metric_t;
+
+// Entries are filled in before n_metrics is bumped past them, so a scrape that
+// reads n_metrics can read that many entries without taking the lock.
+static metric_t registry[MAX_METRICS];
+static int n_metrics = 0;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// A thread's counters are one row, so no two threads write the same cache line
+// (unless more than N_SHARDS threads count at once, and then they share rows).
+static long long shards[N_SHARDS][MAX_METRICS] __attribute__((aligned(64)));
+static long long gauges[MAX_METRICS];
+static int n_shards_claimed = 0;
+static __thread int shard = -1;
+
+static metric_id_t Register(const char *name, const char *help, const char *label_name, const char *label_value, bool gauge) {
+  metric_id_t id = -1;
+  if (label_name == NULL) label_name = "";
+  if (label_value == NULL) label_value = "";
+
+  pthread_mutex_lock(&registry_lock);
+  for (int i = 0; i < n_metrics && id < 0; i++) {
+    if (strcmp(registry[i].name, name) == 0 && strcmp(registry[i].label_name, label_name) == 0 &&
+        strcmp(registry[i].label_value, label_value) == 0)
+      id = i;
+  }
+  if (id < 0 && n_metrics < MAX_METRICS) {
+    metric_t *metric = &registry[n_metrics];
+    snprintf(metric->name, sizeof(metric->name), "%s", name);
+    snprintf(metric->help, sizeof(metric->help), "%s", help);
+    snprintf(metric->label_name, sizeof(metric->label_name), "%s", label_name);
+    snprintf(metric->label_value, sizeof(metric->label_value), "%s", label_value);
+    metric->gauge = gauge;
+    id = n_metrics;
+    __atomic_store_n(&n_metrics, n_metrics + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&registry_lock);
+  return id;
+}
+
+metric_id_t MetricsCounter(const char *name, const char *help, const char *label_name, const char *label_value) {
+  return Register(name, help, label_name, label_value, false);
+}
+
+metric_id_t MetricsGauge(const char *name, const char *help, const char *label_name, const char *label_value) {
+  return Register(name, help, label_name, label_value, true);
+}
+
+void MetricsAdd(metric_id_t id, long long delta) {
+  if (id < 0) return;
+  if (shard < 0) shard = __atomic_fetch_add(&n_shards_claimed, 1, __ATOMIC_RELAXED) % N_SHARDS;
+  // Only shared rows ever see contention, but the add has to be atomic for them.
+  __atomic_fetch_add(&shards[shard][id], delta, __ATOMIC_RELAXED);
+}
+
+void MetricsSet(metric_id_t id, long long value) {
+  if (id < 0) return;
+  __atomic_store_n(&gauges[id], value, __ATOMIC_RELAXED);
+}
+
+// Exposition /////////////////
+
+static long long MetricValue(metric_id_t id) {
+  if (registry[id].gauge) return __atomic_load_n(&gauges[id], __ATOMIC_RELAXED);
+  long long sum = 0;
+  for (int i = 0; i < N_SHARDS; i++) sum += __atomic_load_n(&shards[i][id], __ATOMIC_RELAXED);
+  return sum;
+}
+
+// Label values are ours, but escape them anyway as the format asks.
+static void WriteLabelValue(FILE *out, const char *value) {
+  for (; *value != '\0'; value++) {
+    if (*value == '\\' || *value == '"') fputc('\\', out);
+    if (*value == '\n') fputs("\\n", out);
+    else fputc(*value, out);
+  }
+}
+
+static const int kFirstExportedBucket = 10, kLastExportedBucket = 36;
+
+static void WriteStageHistograms(FILE *out) {
+  fprintf(out, "# HELP rss_stage_duration_seconds Time taken by each stage of crawling, indexing and querying.\n");
+  fprintf(out, "# TYPE rss_stage_duration_seconds histogram\n");
+  for (int stage = 0; stage < N_STAGES; stage++) {
+    long long counts[TIMING_N_BUCKETS], total_ns, cumulative = 0;
+    const char *name = TimingStageName(stage);
+    long long n_samples = TimingSnapshot(stage, counts, &total_ns);
+
+    // Bucket b holds samples under 2^b ns, so it's the le="2^b ns" bucket.  The
+    // same fixed range of bounds, about 1us to 69s, goes out on every scrape.
+    for (int b = 0; b < kFirstExportedBucket; b++) cumulative += counts[b];
+    for (int b = kFirstExportedBucket; b <= kLastExportedBucket; b++) {
+      cumulative += counts[b];
+      fprintf(out, "rss_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %lld\n",
+              name, (double)(1ULL << b) / 1e9, cumulative);
+    }
+    fprintf(out, "rss_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lld\n", name, n_samples);
+    fprintf(out, "rss_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", name, total_ns / 1e9);
+    fprintf(out, "rss_stage_duration_seconds_count{stage=\"%s\"} %lld\n", name, n_samples);
+  }
+}
+
+void MetricsWrite(FILE *out) {
+  int n = __atomic_load_n(&n_metrics, __ATOMIC_ACQUIRE);
+  bool written[MAX_METRICS] = { false };
+
+  // Every series of a family goes together under one HELP and TYPE, whatever
+  // order they were registered in.
+  for (int i = 0; i < n; i++) {
+    if (written[i]) continue;
+    fprintf(out, "# HELP %s %s\n", registry[i].name, registry[i].help);
+    fprintf(out, "# TYPE %s %s\n", registry[i].name, registry[i].gauge ? "gauge" : "counter");
+    for (int j = i; j < n; j++) {
+      if (written[j] || strcmp(registry[j].name, registry[i].name) != 0) continue;
+      written[j] = true;
+      fputs(registry[j].name, out);
+      if (registry[j].label_name[0] != '\0') {
+        fprintf(out, "{%s=\"", registry[j].label_name);
+        WriteLabelValue(out, registry[j].label_value);
+        fputs("\"}", out);
+      }
+      fprintf(out, " %lld\n", MetricValue(j));
+    }
+  }
+  WriteStageHistograms(out);
+}
+
+// Serving /////////////////
+
+// Reads (and ignores) the request, since every path gets the same answer.  A
+// client that doesn't finish its request within the receive timeout gets the
+// answer anyway.
+static void AnswerScrape(int fd) {
+  char request[4096];
+  size_t length = 0;
+  while (length < sizeof(request) - 1) {
+    ssize_t n = read(fd, request + length, sizeof(request) - 1 - length);
+    if (n <= 0) break;
+    length += n;
+    request[length] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) break;
+  }
+
+  char *body = NULL;
+  size_t body_length = 0;
+  FILE *out = open_memstream(&body, &body_length);
+  MetricsWrite(out);
+  fclose(out);
+
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+      "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+      body_length);
+  if (send(fd, header, header_length, MSG_NOSIGNAL) == header_length) {
+    size_t sent = 0;
+    while (sent < body_length) {
+      ssize_t n = send(fd, body + sent, body_length - sent, MSG_NOSIGNAL);
+      if (n <= 0) break;
+      sent += n;
+    }
+  }
+  free(body);
+}
+
+static void *MetricsServer(void *arg) {
+  int listener = (int)(long)arg;
+  struct timeval timeout = { 1, 0 };
+
+  while (true) {
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) continue;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    AnswerScrape(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+bool MetricsServe(int port) {
+  struct sockaddr_in addr;
+  int reuse = 1;
+  pthread_t thread;
+
+  if (port <= 0 || port > 65535) {
+    fprintf(stderr, "Bad metrics port: %d\n", port);
+    return false;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // localhost only.
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+    perror("metrics port");
+    if (fd >= 0) close(fd);
+    return false;
+  }
+  if (pthread_create(&thread, NULL, MetricsServer, (void*)(long)fd) != 0) {
+    close(fd);
+    return false;
+  }
+  pthread_detach(thread);
+  return true;
+}
@@ -0,0 +1,44 @@
+
+#ifndef __METRICS_
+#define __METRICS_
+
+#include <stdio.h>
+#include "bool.h"
+
+// A registry of counters and gauges, served in the Prometheus text format along
+// with the stage histograms of timing.h.
+//
+// A metric is a name plus at most one label, as in
+// rss_fetch_errors_total{code="28"}.  Registering is the slow part: it takes a
+// lock and searches the registry, so callers on a hot path register once and keep
+// the id.  Registering the same name and label twice gives back the same id.
+//
+// Counters are split into per-thread shards.  MetricsAdd only ever touches the
+// calling thread's shard, so download threads counting bytes never share a cache
+// line, and a scrape sums the shards.  Gauges are a single value that's set.
+
+typedef int metric_id_t;
+
+#define MAX_METRICS 256
+
+// Registers (or finds) a counter or a gauge.  label_name and label_value may both
+// be NULL for a metric without a label.  Returns -1 once the registry is full;
+// MetricsAdd and MetricsSet ignore that id.
+metric_id_t MetricsCounter(const char *name, const char *help, const char *label_name, const char *label_value);
+metric_id_t MetricsGauge(const char *name, const char *help, const char *label_name, const char *label_value);
+
+// Adds delta to a counter.  Safe from any thread, and doesn't lock.
+void MetricsAdd(metric_id_t id, long long delta);
+
+// Sets a gauge.
+void MetricsSet(metric_id_t id, long long value);
+
+// Writes every metric in the Prometheus text exposition format (version 0.0.4).
+void MetricsWrite(FILE *out);
+
+// Starts a thread answering every HTTP request on localhost:port with
+// MetricsWrite's output.  It runs for the life of the process.  Returns false if
+// the port couldn't be bound.
+bool MetricsServe(int port);
+
+#endif // __METRICS_
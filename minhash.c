@@ -0,0 +1,124 @@
+#include <ctype.h>
+#include <pthread.h>
+#include "minhash.h"
+
+// The splitmix64 finalizer, so that every bit of the result depends on every bit
+// of hash.
+static uint64_t Mix(uint64_t hash) {
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+// Case-insensitive 64-bit FNV-1a.
+static uint64_t WordHash(const char *word) {
+  uint64_t hash = 14695981039346656037ull;
+  for (; *word != '\0'; word++) {
+    hash ^= (unsigned char)tolower((unsigned char)*word);
+    hash *= 1099511628211ull;
+  }
+  return Mix(hash);
+}
+
+// Hash function i takes the top 32 bits of multipliers[i] * shingle + addends[i].
+static uint64_t multipliers[MINHASH_N_HASHES], addends[MINHASH_N_HASHES];
+static pthread_once_t hash_functions_once = PTHREAD_ONCE_INIT;
+
+static void ChooseHashFunctions(void) {
+  for (int i = 0; i < MINHASH_N_HASHES; i++) {
+    multipliers[i] = Mix(2 * i + 1) | 1;
+    addends[i] = Mix(2 * i + 2);
+  }
+}
+
+void MinHashStart(minhash_builder_t *builder) {
+  pthread_once(&hash_functions_once, ChooseHashFunctions);
+  memset(builder->mins, 0xff, sizeof(builder->mins));
+  builder->n_words = 0;
+}
+
+void MinHashAddWord(minhash_builder_t *builder, const char *word) {
+  const int n_recent = MINHASH_SHINGLE_WORDS - 1;
+  uint64_t hash = WordHash(word);
+
+  if (builder->n_words >= n_recent) {
+    // the words' order matters, so each is mixed in before the next is added.
+    uint64_t shingle = 0;
+    for (int i = 0; i < n_recent; i++) shingle = Mix(shingle ^ builder->recent[i]);
+    shingle = Mix(shingle ^ hash);
+    for (int i = 0; i < MINHASH_N_HASHES; i++) {
+      uint32_t h = (multipliers[i] * shingle + addends[i]) >> 32;
+      if (h < builder->mins[i]) builder->mins[i] = h;
+    }
+  }
+  for (int i = 0; i + 1 < n_recent; i++) builder->recent[i] = builder->recent[i + 1];
+  builder->recent[n_recent - 1] = hash;
+  builder->n_words++;
+}
+
+bool MinHashFinish(const minhash_builder_t *builder, minhash_t *signature) {
+  if (builder->n_words - (MINHASH_SHINGLE_WORDS - 1) < MINHASH_MIN_SHINGLES) return false;
+  for (int i = 0; i < MINHASH_N_HASHES; i++) signature->mins[i] = builder->mins[i] & 0xff;
+  return true;
+}
+
+double MinHashSimilarity(const minhash_t *a, const minhash_t *b) {
+  int n_agree = 0;
+  for (int i = 0; i < MINHASH_N_HASHES; i++) n_agree += a->mins[i] == b->mins[i];
+  // positions agree by chance 1 time in 256 even when the minimums differ.
+  double agree = (double)n_agree / MINHASH_N_HASHES;
+  return (agree - 1.0 / 256) / (1 - 1.0 / 256);
+}
+
+void MinHashIndexNew(minhash_index_t *index) {
+  MinHashEntryVectorNew(&index->entries, 256);
+  MinHashBucketSetNew(&index->buckets, MINHASH_N_BANDS * 256);
+}
+
+void MinHashIndexDispose(minhash_index_t *index) {
+  MinHashEntryVectorDispose(&index->entries);
+  MinHashBucketSetDispose(&index->buckets);
+}
+
+static uint64_t BandKey(const minhash_t *signature, int band) {
+  uint64_t key = band;
+  for (int i = band * MINHASH_BAND_ROWS; i < (band + 1) * MINHASH_BAND_ROWS; i++)
+    key = key * 1099511628211ull + signature->mins[i];
+  return Mix(key);
+}
+
+int MinHashIndexFind(const minhash_index_t *index, const minhash_t *signature) {
+  int found = -1;
+  for (int band = 0; band < MINHASH_N_BANDS; band++) {
+    minhash_bucket_t *bucket = MinHashBucketSetLookup(&index->buckets, BandKey(signature, band));
+    for (int i = bucket != NULL ? bucket->head : -1; i >= 0; ) {
+      minhash_entry_t *entry = MinHashEntryVectorNth(&index->entries, i);
+      if ((found < 0 || entry->id < found) &&
+          MinHashSimilarity(&entry->signature, signature) >= MINHASH_MIN_SIMILARITY)
+        found = entry->id;
+      i = entry->next[band];
+    }
+  }
+  return found;
+}
+
+void MinHashIndexAdd(minhash_index_t *index, const minhash_t *signature, int id) {
+  minhash_entry_t entry;
+  int n = MinHashEntryVectorLength(&index->entries);
+  entry.signature = *signature;
+  entry.id = id;
+  for (int band = 0; band < MINHASH_N_BANDS; band++) {
+    uint64_t key = BandKey(signature, band);
+    minhash_bucket_t *bucket = MinHashBucketSetLookup(&index->buckets, key);
+    if (bucket == NULL) {
+      minhash_bucket_t new_bucket = { key, -1 };
+      bucket = MinHashBucketSetEnter(&index->buckets, &new_bucket);
+    }
+    entry.next[band] = bucket->head;
+    bucket->head = n;
+  }
+  MinHashEntryVectorAppend(&index->entries, &entry);
+}
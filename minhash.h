@@ -0,0 +1,90 @@
+
+#ifndef __MINHASH_
+#define __MINHASH_
+
+#include <stdint.h>
+#include "bool.h"
+#include "typed-vector.h"
+#include "typed-hashset.h"
+
+// MinHash signatures of articles, and an index that finds an earlier article whose
+// text is nearly the same as a new one's.
+//
+// An article's features are its runs of three consecutive words (shingles).  Each
+// of MINHASH_N_HASHES hash functions is applied to every shingle, and the signature
+// keeps the low byte of each function's minimum.  Two articles' signatures agree at
+// a position with probability J + (1 - J) / 256, where J is the Jaccard similarity
+// of their sets of shingles, so counting the positions that agree estimates J.
+//
+// The index buckets each signature by each of its MINHASH_N_BANDS bands of
+// consecutive positions.  Articles much alike almost surely agree on every position
+// of some band, while articles that aren't almost never do, so only the articles
+// sharing a bucket with the new one need comparing.  With 16 bands of 4, a pair with
+// J = 0.75 shares a bucket 99.8% of the time, and one with J = 0.1 about 1 time in 500.
+
+#define MINHASH_N_HASHES 64
+#define MINHASH_N_BANDS 16
+#define MINHASH_BAND_ROWS (MINHASH_N_HASHES / MINHASH_N_BANDS)
+#define MINHASH_SHINGLE_WORDS 3
+#define MINHASH_MIN_SHINGLES 16     // fewer than this and the signature is too noisy to use
+#define MINHASH_MIN_SIMILARITY 0.5  // estimated Jaccard similarity of a near duplicate
+
+typedef struct {
+  uint8_t mins[MINHASH_N_HASHES];
+} minhash_t;
+
+typedef struct {
+  uint32_t mins[MINHASH_N_HASHES];
+  uint64_t recent[MINHASH_SHINGLE_WORDS - 1];   // hashes of the last few words, latest last
+  int n_words;
+} minhash_builder_t;
+
+void MinHashStart(minhash_builder_t *builder);
+
+// Adds the next word of the article, compared case-insensitively.
+void MinHashAddWord(minhash_builder_t *builder, const char *word);
+
+// Returns false, without a signature, if there were too few shingles to go on.
+bool MinHashFinish(const minhash_builder_t *builder, minhash_t *signature);
+
+// The Jaccard similarity of two articles' shingles, as estimated from their signatures.
+double MinHashSimilarity(const minhash_t *a, const minhash_t *b);
+
+typedef struct {
+  minhash_t signature;
+  int id;
+  int next[MINHASH_N_BANDS];   // the entry before this one in each band's bucket, or -1
+} minhash_entry_t;
+
+typedef struct {
+  uint64_t key;    // a hash of the band's number and its bytes
+  int head;        // the latest entry in the bucket
+} minhash_bucket_t;
+
+#define MINHASH_BUCKET_KEY(elem) ((elem)->key)
+static inline unsigned MinHashBucketHash(uint64_t key) {
+  return (unsigned)(key ^ (key >> 32));
+}
+static inline bool MinHashBucketsMatch(uint64_t a, uint64_t b) {
+  return a == b;
+}
+
+DECLARE_TYPED_VECTOR_TAGGED(minhash_entry_vector_t, MinHashEntryVector, minhash_entry_t, MEM_SIGNATURES)
+DECLARE_TYPED_HASHSET_TAGGED(minhash_bucket_set_t, MinHashBucketSet, minhash_bucket_t, uint64_t,
+                             MINHASH_BUCKET_KEY, MinHashBucketHash, MinHashBucketsMatch, MEM_SIGNATURES)
+
+typedef struct {
+  minhash_entry_vector_t entries;
+  minhash_bucket_set_t buckets;
+} minhash_index_t;
+
+void MinHashIndexNew(minhash_index_t *index);
+void MinHashIndexDispose(minhash_index_t *index);
+
+// Returns the id of the earliest signature added that's at least
+// MINHASH_MIN_SIMILARITY similar to signature, or -1 if there's none.
+int MinHashIndexFind(const minhash_index_t *index, const minhash_t *signature);
+
+void MinHashIndexAdd(minhash_index_t *index, const minhash_t *signature, int id);
+
+#endif // __MINHASH_
@@ -6,6 +6,9 @@ void MSTNew( mstreamtokenizer_t *mst, const char *delimiters, bool discard_delim
 
     // first we must open a new memstream. 
     mst->stream = open_memstream(&mst->buffer, &mst->length);
+    mst->reader = NULL;
+    mst->delimiters = delimiters;
+    mst->discard_delim = discard_delim;
 
     // now that we have a pointer to an open stream, we can pass that to a new streamtokenizer
     STNew( &mst->st, mst->stream, delimiters, discard_delim );
@@ -16,7 +19,16 @@ void MSTDispose( mstreamtokenizer_t *mst) {
     //  frees the strdup'd delimeters string. Nothing happens to the file.  It's still open. 
     STDispose(&mst->st);    
 
+    if (mst->reader != NULL) fclose(mst->reader);
     fclose(mst->stream); // does not free the file.  Does reset buffer to the first element. 
 
     free(mst->buffer);  // fclosing (above) resets the buffer to first elem, so now we can free it. 
-}
\ No newline at end of file
+}
+
+void MSTDoneWriting( mstreamtokenizer_t *mst) {
+    fflush(mst->stream);
+    // the buffer stays put from here on, since nothing more is written to it.
+    mst->reader = fmemopen(mst->buffer, mst->length, "r");
+    STDispose(&mst->st);
+    STNew(&mst->st, mst->reader, mst->delimiters, mst->discard_delim);
+}
@@ -14,11 +14,20 @@ typedef struct {
   char *buffer;
   size_t length;
   streamtokenizer st;
+  FILE *reader;           // what st reads once writing is done, or NULL before
+  const char *delimiters; // as given to MSTNew, so it must outlive mst
+  bool discard_delim;
 } mstreamtokenizer_t;
 
 void MSTNew( mstreamtokenizer_t *mst, const char *delimiters, bool discard_delim );
 void MSTDispose( mstreamtokenizer_t *mst);
 
+// Ends writing: flushes the stream and points the tokenizer at exactly the length
+// bytes written.  A memstream that was sought back and written over (as a retried
+// fetch is) still reads back the old bytes past its new length; these never are. 
+// Nothing may be written to the stream afterwards. 
+void MSTDoneWriting( mstreamtokenizer_t *mst);
+
 inline bool MSTNextToken(mstreamtokenizer_t *mst, char buffer[], int bufferLength) {
   return STNextToken( &mst->st,  buffer,  bufferLength);
 }
@@ -6,9 +6,12 @@
 #include <assert.h>
 #include "mstreamtokenizer.h"
 #include "searchdb.h"
+#include "lock-stats.h"
 
 #define URL_LENGTH 2048
 #define MAX_FEEDS_PER_DOMAIN 30
+#define MAX_DOMAINS 10
+#define MAX_DOWNLOAD_THREADS 50
 
 
 // A single domain_t structure is shared between several Downloader threads.
@@ -16,56 +19,60 @@
 // No domains have access to the database.  All database entry is executed
 // after all articles are downloaded. 
 
+// The generated code writes "const type *", which only reads right for a named type.
+typedef mstreamtokenizer_t *html_p;
+DECLARE_TYPED_VECTOR_TAGGED(html_vector_t, HtmlVector, html_p, MEM_ARTICLE_HTML)
+DECLARE_TYPED_VECTOR_TAGGED(article_index_vector_t, ArticleIndexVector, int, MEM_ARTICLES)
+DECLARE_TYPED_VECTOR_TAGGED(fetch_status_vector_t, FetchStatusVector, int, MEM_ARTICLES)
+
 typedef struct {
     int n_threads; 
     sem_t n_threads_lock; 
     
     int n_unclaimed_feeds;
-    sem_t n_unclaimed_feeds_lock;
+    instrumented_lock_t n_unclaimed_feeds_lock;
     char rss_url[MAX_FEEDS_PER_DOMAIN][URL_LENGTH];
 
-    hashset titles_hashset;   // used for skipping repeat articles upon entry
-    sem_t titles_input_lock;
-
-    vector articles_vector;
-    int articles_tail, n_articles; // used for pulling articles off the list. 
-    sem_t articles_retreival_lock; 
+    // One entry per title, so repeat articles are skipped.  html[i] is the fetched
+    // page of docs' article i, or NULL until a thread claims it.  Each memstream is
+    // allocated on its own because the stream keeps pointers into it, and html's
+    // array moves as it grows. 
+    doc_table_t docs;
+    html_vector_t html;
+    fetch_status_vector_t fetch_status;  // what fetching html[i] returned, or -1 until it's done
+    int articles_tail;    // used for pulling articles off the list. 
+    article_index_vector_t deferred;     // passed over while their hosts were full
+    instrumented_lock_t articles_lock;   // guards all five
 
 } domain_t;
 
 
 const int kthread_sharing = 0;
 void InitDomain(domain_t *d) {
-    
     //d->n_threads = 0;
     //assert( sem_init(&d->n_threads_lock, kthread_sharing, 1) == 0);
 
     d->n_unclaimed_feeds = 0;
-    assert( sem_init(&d->n_unclaimed_feeds_lock, kthread_sharing, 1) == 0);
+    LockInit(&d->n_unclaimed_feeds_lock, "n_unclaimed_feeds_lock");
 
     d->articles_tail = 0;
-    d->n_articles = 0;
-
-    // titles_hashset elements are only char[TITLE_N_BYTES].  No pointers to heap memory.
-    // in the hashset element, so there is no need for a free function. 
-    HashSetNew(&d->titles_hashset, TITLE_N_BYTES, 1007, StringHash, StringCompare, NULL);
-    assert( sem_init(&d->titles_input_lock, kthread_sharing, 1) == 0);
 
-    // articles_vector elements are article_t's.  These contain pointers to heap memstreams. 
-    // however, all the elements will get copied to the db->articles hashset before destroying. 
-    VectorNew(&d->articles_vector, sizeof(article_t), NULL, 250 );
-    assert( sem_init(&d->articles_retreival_lock, kthread_sharing, 1) == 0);
+    // the articles' strings all get copied to db->docs before the domain is destroyed. 
+    DocTableNew(&d->docs);
+    HtmlVectorNew(&d->html, 256);
+    FetchStatusVectorNew(&d->fetch_status, 256);
+    ArticleIndexVectorNew(&d->deferred, 16);
+    LockInit(&d->articles_lock, "articles_lock");
 }
 
 void DomainDispose(domain_t *d) {
-    // torch the vector of articles in each domain.  
-    // This does not free the mstreams with the full article text. 
-    // we keep that because db.articles still points to those streams. 
-    // and we want to be able to print out the full articles
-    VectorDispose(&d->articles_vector);
-    HashSetDispose(&d->titles_hashset);
-    assert( sem_destroy(&d->articles_retreival_lock) == 0 );
-    assert( sem_destroy(&d->titles_input_lock) == 0 );
-    assert( sem_destroy(&d->n_unclaimed_feeds_lock) == 0 );
-    assert( sem_destroy(&d->n_threads_lock) == 0 );
+    // torch the table of articles in each domain.  Their html was already freed
+    // by ProcessArticle, as each one was indexed. 
+    DocTableDispose(&d->docs);
+    HtmlVectorDispose(&d->html);
+    FetchStatusVectorDispose(&d->fetch_status);
+    ArticleIndexVectorDispose(&d->deferred);
+    // n_threads_lock is never initialized (see InitDomain), so it isn't destroyed either.
+    LockDispose(&d->articles_lock);
+    LockDispose(&d->n_unclaimed_feeds_lock);
 }
@@ -0,0 +1,512 @@
+#define _GNU_SOURCE   // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "query-server.h"
+#include "timing.h"
+#include "metrics.h"
+#include "lock-stats.h"
+
+#define REQUEST_N_BYTES 1024
+#define MAX_RESULTS 10
+#define MAX_EVENTS 256
+
+FILE* open_memstream(char **ptr, size_t *sizeloc);
+
+// A single request line on its way from the event loop to a worker, and then
+// back again carrying the response text.  fd + generation say which connection
+// it belongs to; if that connection went away in the meantime the response is dropped.
+typedef struct job {
+  int fd;
+  unsigned generation;
+  char request[REQUEST_N_BYTES];
+  char *response;
+  size_t response_length;
+  struct job *next;
+} job_t;
+
+typedef struct {
+  job_t *head, *tail;
+  sem_t lock;
+} job_queue_t;
+
+// Per-client state.  Only the event loop thread ever touches these.
+typedef struct {
+  bool open;
+  bool busy;          // one of this client's requests is with a worker.
+  bool peer_closed;   // client shut down its end; finish what's buffered, then close.
+  bool quitting;      // client sent QUIT; close as soon as the output is flushed.
+  unsigned generation;
+  char in[REQUEST_N_BYTES];
+  int in_length;
+  char *out;
+  size_t out_length, out_sent;
+} connection_t;
+
+typedef struct {
+  search_db_t *db;
+  int epoll_fd, listen_fd, wake_fd;
+  connection_t *connections;   // indexed by file descriptor
+  int n_connections;
+  job_queue_t pending, finished;
+  sem_t n_pending;             // counts the jobs in pending, so idle workers can block on it.
+  pthread_t *workers;
+  int n_workers;
+  metric_id_t queries_metric;
+} query_server_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void RequestStop(int signal_number) {
+  stop_requested = 1;
+}
+
+// Job queues /////////////////
+
+static void JobQueueNew(job_queue_t *q) {
+  q->head = q->tail = NULL;
+  sem_init(&q->lock, 0, 1);
+}
+
+static void JobQueuePush(job_queue_t *q, job_t *job) {
+  job->next = NULL;
+  SemWait(&q->lock);
+  if (q->tail == NULL) q->head = job;
+  else q->tail->next = job;
+  q->tail = job;
+  sem_post(&q->lock);
+}
+
+// Returns NULL if the queue is empty.
+static job_t *JobQueuePop(job_queue_t *q) {
+  SemWait(&q->lock);
+  job_t *job = q->head;
+  if (job != NULL) {
+    q->head = job->next;
+    if (q->head == NULL) q->tail = NULL;
+  }
+  sem_post(&q->lock);
+  return job;
+}
+
+static void JobFree(job_t *job) {
+  free(job->response);
+  free(job);
+}
+
+static void JobQueueDispose(job_queue_t *q) {
+  job_t *job;
+  while ((job = JobQueuePop(q)) != NULL) JobFree(job);
+  sem_destroy(&q->lock);
+}
+
+// Workers /////////////////
+
+// Titles and urls come straight out of the feeds, so they may hold the very
+// characters the protocol uses as separators.
+static void WriteField(FILE *out, const char *text) {
+  for (; *text != '\0'; text++)
+    fputc((*text == '\t' || *text == '\n' || *text == '\r') ? ' ' : *text, out);
+}
+
+static void RunQuery(job_t *job, search_db_t *db) {
+  char *term = job->request;
+  occurrance_t results[MAX_RESULTS];
+  search_cursor_t after, next;
+  char next_text[SEARCH_CURSOR_N_BYTES];
+  bool paging = false;
+  FILE *out = open_memstream(&job->response, &job->response_length);
+
+  if (strcasecmp(term, "STATS") == 0) {
+    fprintf(out, "OK STATS\n");
+    TimingReport(out);
+    fputc('\n', out);
+    fclose(out);
+    return;
+  }
+
+  // an optional cursor follows the term, separated by a space. 
+  char *space = strchr(term, ' ');
+  if (space != NULL) {
+    *space = '\0';
+    if (!SearchCursorParse(space + 1, &after)) {
+      fprintf(out, "ERR bad cursor\n\n");
+      fclose(out);
+      return;
+    }
+    paging = true;
+  }
+
+  if (!WordIsWellFormed(term)) {
+    fprintf(out, "ERR malformed term\n\n");
+  }
+  else if (IsStopWord(term, db)) {
+    fprintf(out, "ERR stop word\n\n");
+  }
+  else {
+    occurrance_list_t *word_p = LookupWord(term, db);
+    int n_matches = 0, n_returned = 0;
+    if (word_p != NULL) {
+      n_matches = OccurranceVectorLength(&word_p->occurrances);
+      n_returned = TopOccurrances(word_p, paging ? &after : NULL, MAX_RESULTS, results, &next, db);
+    }
+    if (n_returned > 0 && next.count >= 0) SearchCursorFormat(&next, next_text);
+    else strcpy(next_text, "-");
+
+    fprintf(out, "OK %d %d %s\n", n_matches, n_returned, next_text);
+    for (int i = 0; i < n_returned; i++) {
+      fprintf(out, "%d\t", results[i].count);
+      WriteField(out, DocTitle(&db->docs, results[i].doc_id));
+      fputc('\t', out);
+      WriteField(out, DocUrl(&db->docs, results[i].doc_id));
+      fputc('\n', out);
+    }
+    fputc('\n', out);
+  }
+  fclose(out);
+}
+
+static void *QueryWorker(void *arg) {
+  query_server_t *server = (query_server_t*)arg;
+  uint64_t one = 1;
+
+  while (true) {
+    SemWait(&server->n_pending);
+    job_t *job = JobQueuePop(&server->pending);
+    if (job == NULL) break;   // we're only woken to an empty queue at shutdown.
+
+    long long start = TimingNow();
+    RunQuery(job, server->db);
+    TimingRecordSince(STAGE_QUERY, start);
+    MetricsAdd(server->queries_metric, 1);
+    JobQueuePush(&server->finished, job);
+    // pokes the event loop so it picks up the response.
+    if (write(server->wake_fd, &one, sizeof(one)) < 0) perror("eventfd write");
+  }
+  return NULL;
+}
+
+// Connections /////////////////
+
+static void UpdateInterest(query_server_t *server, int fd) {
+  connection_t *conn = &server->connections[fd];
+  struct epoll_event event;
+  event.data.fd = fd;
+  // We stop reading while a request is out with a worker.  That keeps responses
+  // in order and stops a client from flooding us faster than we can answer.
+  event.events = 0;
+  if (!conn->busy && !conn->peer_closed && !conn->quitting) event.events |= EPOLLIN;
+  if (conn->out_sent < conn->out_length) event.events |= EPOLLOUT;
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, fd, &event);
+}
+
+static void CloseConnection(query_server_t *server, int fd) {
+  connection_t *conn = &server->connections[fd];
+  epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+  close(fd);
+  free(conn->out);
+  conn->out = NULL;
+  conn->out_length = conn->out_sent = 0;
+  conn->open = false;
+  conn->generation++;   // any job still with a worker is now stale.
+}
+
+static void AppendOutput(connection_t *conn, const char *text, size_t length) {
+  if (conn->out_sent == conn->out_length) conn->out_length = conn->out_sent = 0;
+  conn->out = realloc(conn->out, conn->out_length + length);
+  memcpy(conn->out + conn->out_length, text, length);
+  conn->out_length += length;
+}
+
+// Writes as much pending output as the socket takes.  Returns false if the
+// connection had to be closed.
+static bool FlushOutput(query_server_t *server, int fd) {
+  connection_t *conn = &server->connections[fd];
+  while (conn->out_sent < conn->out_length) {
+    ssize_t n = send(fd, conn->out + conn->out_sent, conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+    if (n >= 0) conn->out_sent += n;
+    else if (errno == EINTR) continue;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    else {
+      CloseConnection(server, fd);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Pulls the next complete line out of the input buffer into line.  Returns false
+// if there isn't a whole line buffered yet.
+static bool NextRequestLine(connection_t *conn, char line[]) {
+  char *newline = memchr(conn->in, '\n', conn->in_length);
+  if (newline == NULL) return false;
+
+  int line_length = newline - conn->in;
+  memcpy(line, conn->in, line_length);
+  line[line_length] = '\0';
+  if (line_length > 0 && line[line_length - 1] == '\r') line[line_length - 1] = '\0';
+
+  conn->in_length -= line_length + 1;
+  memmove(conn->in, newline + 1, conn->in_length);
+  return true;
+}
+
+// Hands the next buffered request to the workers if the connection doesn't
+// already have one out, then settles what the connection should wait on next.
+static void DispatchRequests(query_server_t *server, int fd) {
+  connection_t *conn = &server->connections[fd];
+  char line[REQUEST_N_BYTES];
+
+  while (!conn->busy && !conn->quitting && NextRequestLine(conn, line)) {
+    if (line[0] == '\0') continue;
+    if (strcasecmp(line, "QUIT") == 0) {
+      conn->quitting = true;
+      break;
+    }
+    job_t *job = malloc(sizeof(job_t));
+    job->fd = fd;
+    job->generation = conn->generation;
+    strcpy(job->request, line);
+    job->response = NULL;
+    job->response_length = 0;
+    conn->busy = true;
+    JobQueuePush(&server->pending, job);
+    sem_post(&server->n_pending);
+  }
+
+  // a full buffer with no newline in it can never become a valid request.
+  if (!conn->busy && conn->in_length == sizeof(conn->in)) {
+    const char *kTooLong = "ERR request too long\n\n";
+    AppendOutput(conn, kTooLong, strlen(kTooLong));
+    conn->quitting = true;
+  }
+
+  if (!FlushOutput(server, fd)) return;
+  bool drained = conn->out_sent == conn->out_length;
+  if (drained && !conn->busy && (conn->quitting || conn->peer_closed)) {
+    CloseConnection(server, fd);
+    return;
+  }
+  UpdateInterest(server, fd);
+}
+
+static void ReadRequests(query_server_t *server, int fd) {
+  connection_t *conn = &server->connections[fd];
+
+  while (conn->in_length < sizeof(conn->in)) {
+    ssize_t n = read(fd, conn->in + conn->in_length, sizeof(conn->in) - conn->in_length);
+    if (n > 0) conn->in_length += n;
+    else if (n == 0) {
+      conn->peer_closed = true;
+      break;
+    }
+    else if (errno == EINTR) continue;
+    else if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+    else {
+      CloseConnection(server, fd);
+      return;
+    }
+  }
+  DispatchRequests(server, fd);
+}
+
+static void AcceptClients(query_server_t *server) {
+  while (true) {
+    int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+      return;
+    }
+
+    // the table is indexed by fd, so it grows to cover the largest one we've seen.
+    if (fd >= server->n_connections) {
+      int n_new = (fd + 1 > 2 * server->n_connections) ? fd + 1 : 2 * server->n_connections;
+      server->connections = realloc(server->connections, n_new * sizeof(connection_t));
+      memset(server->connections + server->n_connections, 0,
+             (n_new - server->n_connections) * sizeof(connection_t));
+      server->n_connections = n_new;
+    }
+
+    connection_t *conn = &server->connections[fd];
+    unsigned generation = conn->generation;
+    memset(conn, 0, sizeof(connection_t));
+    conn->generation = generation;
+    conn->open = true;
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+static void DeliverResponses(query_server_t *server) {
+  uint64_t count;
+  job_t *job;
+
+  if (read(server->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("eventfd read");
+
+  while ((job = JobQueuePop(&server->finished)) != NULL) {
+    connection_t *conn = &server->connections[job->fd];
+    if (conn->open && conn->generation == job->generation) {
+      AppendOutput(conn, job->response, job->response_length);
+      conn->busy = false;
+      DispatchRequests(server, job->fd);
+    }
+    JobFree(job);
+  }
+}
+
+// Setup /////////////////
+
+static int OpenListener(const char *address) {
+  int fd;
+
+  if (strncmp(address, "unix:", 5) == 0) {
+    struct sockaddr_un addr;
+    const char *path = address + 5;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: %s\n", path);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);  // clears out a socket file left behind by an earlier run.
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      perror(path);
+      if (fd >= 0) close(fd);
+      return -1;
+    }
+  }
+  else {
+    struct sockaddr_in addr;
+    int reuse = 1;
+    int port = atoi(strncmp(address, "tcp:", 4) == 0 ? address + 4 : address);
+    if (port <= 0 || port > 65535) {
+      fprintf(stderr, "Can't make sense of server address: %s\n", address);
+      return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);  // localhost only.
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+      perror(address);
+      if (fd >= 0) close(fd);
+      return -1;
+    }
+  }
+
+  if (listen(fd, SOMAXCONN) < 0) {
+    perror("listen");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void WatchFd(int epoll_fd, int fd) {
+  struct epoll_event event;
+  event.events = EPOLLIN;
+  event.data.fd = fd;
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+int QueryServerRun(const query_server_config_t *config, search_db_t *db) {
+  query_server_t server;
+  struct epoll_event events[MAX_EVENTS];
+  struct sigaction action;
+  int i;
+
+  memset(&server, 0, sizeof(server));
+  server.db = db;
+  server.queries_metric = MetricsCounter("rss_queries_total", "Queries answered.", "interface", "server");
+  server.listen_fd = OpenListener(config->address);
+  if (server.listen_fd < 0) return -1;
+
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  server.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  WatchFd(server.epoll_fd, server.listen_fd);
+  WatchFd(server.epoll_fd, server.wake_fd);
+
+  JobQueueNew(&server.pending);
+  JobQueueNew(&server.finished);
+  sem_init(&server.n_pending, 0, 0);
+
+  // No SA_RESTART: we want epoll_wait to return EINTR so the loop sees the stop request.
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = RequestStop;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  server.n_workers = (config->n_workers > 0) ? config->n_workers : sysconf(_SC_NPROCESSORS_ONLN);
+  if (server.n_workers < 1) server.n_workers = 1;
+  server.workers = malloc(server.n_workers * sizeof(pthread_t));
+  for (i = 0; i < server.n_workers; i++)
+    pthread_create(&server.workers[i], NULL, QueryWorker, &server);
+
+  printf("Serving queries on %s with %d worker threads.\n", config->address, server.n_workers);
+  fflush(stdout);
+
+  while (!stop_requested) {
+    int n_events = epoll_wait(server.epoll_fd, events, MAX_EVENTS, -1);
+    if (n_events < 0) {
+      if (errno == EINTR) continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (i = 0; i < n_events; i++) {
+      int fd = events[i].data.fd;
+      if (fd == server.listen_fd) AcceptClients(&server);
+      else if (fd == server.wake_fd) DeliverResponses(&server);
+      else if (fd < server.n_connections && server.connections[fd].open) {
+        // a hung-up client can't take a response anymore, so there's nothing left to do for it.
+        if (events[i].events & (EPOLLHUP | EPOLLERR)) CloseConnection(&server, fd);
+        else if (events[i].events & EPOLLIN) ReadRequests(&server, fd);
+        else if (events[i].events & EPOLLOUT) DispatchRequests(&server, fd);
+      }
+    }
+  }
+
+  // Drop whatever hasn't started, then wake every worker to an empty queue so it exits.
+  printf("Shutting down query server.\n");
+  job_t *job;
+  while ((job = JobQueuePop(&server.pending)) != NULL) JobFree(job);
+  for (i = 0; i < server.n_workers; i++) sem_post(&server.n_pending);
+  for (i = 0; i < server.n_workers; i++) pthread_join(server.workers[i], NULL);
+
+  for (i = 0; i < server.n_connections; i++)
+    if (server.connections[i].open) CloseConnection(&server, i);
+
+  JobQueueDispose(&server.pending);
+  JobQueueDispose(&server.finished);
+  sem_destroy(&server.n_pending);
+  free(server.connections);
+  free(server.workers);
+  close(server.wake_fd);
+  close(server.epoll_fd);
+  close(server.listen_fd);
+  if (strncmp(config->address, "unix:", 5) == 0) unlink(config->address + 5);
+  return 0;
+}
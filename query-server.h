@@ -0,0 +1,39 @@
+
+#ifndef __QUERY_SERVER_
+#define __QUERY_SERVER_
+
+#include "searchdb.h"
+
+// The query server lets other processes search a built index without
+// spawning their own rss-news-search.  Clients connect to a UNIX domain socket
+// or a localhost TCP port and speak a line protocol:
+//
+//   request:   <term>[ <cursor>]\n
+//   response:  OK <n_matches> <n_returned> <next_cursor>\n
+//              <count>\t<title>\t<url>\n      (n_returned of these, best first)
+//              \n
+//   or:        ERR <reason>\n\n
+//
+// Each response carries at most 10 results.  next_cursor is an opaque token; sending
+// it back after the same term fetches the next page.  It's "-" when there are no more.
+// A client may pipeline several requests; responses come back in request order.
+// Sending QUIT closes the connection.  Sending STATS gets "OK STATS", the timing
+// table of TimingReport (see timing.h) and a blank line.
+
+typedef struct {
+  const char *address;   // "unix:/path/to.sock", "tcp:<port>" or just "<port>"
+  int n_workers;         // threads running queries.  <= 0 picks one per cpu.
+} query_server_config_t;
+
+/**
+ * Function: QueryServerRun
+ * ------------------------
+ * Binds the configured address and serves queries against db until the process
+ * gets SIGINT or SIGTERM.  A single thread multiplexes every client connection
+ * with epoll, and complete request lines are handed to a pool of worker threads.
+ * The db must be fully built; it's only ever read from here on.
+ * Returns 0 on a clean shutdown, -1 if the address couldn't be set up.
+ */
+int QueryServerRun(const query_server_config_t *config, search_db_t *db);
+
+#endif // __QUERY_SERVER_
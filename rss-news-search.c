@@ -12,26 +12,379 @@
 #include "html-utils.h"
 #include "searchdb.h"
 #include "news-thread.h"
+#include "query-server.h"
+#include "timing.h"
+#include "metrics.h"
+#include "trace.h"
+#include "lock-stats.h"
+#include "memtrack.h"
+#include "url-set.h"
+#include "content-store.h"
+#include "host-limiter.h"
 
 
 static void Welcome(const char *welcomeTextFileName);
-static void LoadStopList(hashset *stop_list);
-static void BuildIndices(const char *feedsFileName, search_db_t *db);
+static void LoadStopList(search_db_t *db);
+
+// One <item> of a feed, as ParseItem reads it.  Only lives until ParseFeed has 
+// copied its strings into the domain's document table. 
+typedef struct {
+  char title[TITLE_N_BYTES];
+  char desc[DESC_N_BYTES];
+  char url[URL_N_BYTES];
+} feed_item_t;
+
+// ProcessArticle's list of the words it's about to record. 
+typedef struct {
+  char word[WORD_N_BYTES];
+} indexed_word_t;
+
+DECLARE_TYPED_VECTOR(word_list_t, WordList, indexed_word_t)
 
 void* DownloaderThread( void *arg );
-static void ParseFeed(streamtokenizer *st, domain_t *domain);
-static void DownloadArticle( int article_index, domain_t *domain, curlconnection_t *connection );
+static void ParseFeed(streamtokenizer *st, domain_t *domain, FILE *items);
+static void ScheduleStoredItems(const char *items, int length, domain_t *domain);
+static int ClaimArticle(domain_t *domain, host_state_t **host);
+static bool PastDeadline(void);
+static int DownloadArticle(const char *url, const char *title, mstreamtokenizer_t *mst, host_state_t *host,
+                           curlconnection_t *connection);
 
 static bool GetNextItemTag(streamtokenizer *st);
-static bool ParseItem(streamtokenizer *st, article_t *article );
+static bool ParseItem(streamtokenizer *st, feed_item_t *item );
 static void ExtractElement(streamtokenizer *st, const char *htmlTag, char dataBuffer[], int bufferLength);
-static void ProcessArticle(article_t *article, search_db_t *db);
+static void ProcessArticle(domain_t *domain, int index, word_list_t *words, search_db_t *db);
+static void ReleaseArticleHtml(domain_t *domain, int index);
 static void QueryIndices();
 static void ProcessResponse(const char *word, search_db_t *db);
-static bool WordIsWellFormed(const char *word);
-static void AddPair(char *word, search_db_t *db, article_t *article_addr );
 
 
+static const char *const kWelcomeTextFile = "./data/welcome.txt";
+static const char *const kDefaultFeedsFile = "./data/rss-feeds-large.txt";
+
+typedef struct {
+  const char *feeds_file;
+  query_server_config_t server;   // server.address stays NULL unless --serve was given. 
+  bool eager_sort;
+  fetch_mode_t fetch_mode;
+  const char *archive_dir;        // for --record and --replay
+  const char *connect_to;         // for --connect-to
+  const char *fetch_cache;        // for --fetch-cache
+  long long fetch_cache_bytes;    // for --fetch-cache-mb
+  int metrics_port;               // 0 unless --metrics-port was given
+  const char *trace_file;         // for --trace
+  bool snippets;
+  const char *content_store;      // for --content-store
+  bool share_caches;              // false with --private-caches
+  bool limit_hosts;               // false with --fixed-concurrency
+  double fetch_timeout_s;         // for --timeout
+  int fetch_retries;              // for --retries
+  double crawl_deadline_s;        // for --deadline; 0 is none
+  bool hedge_fetches;             // false with --no-hedging
+} options_t;
+
+static void BuildIndices(const options_t *opts, search_db_t *db);
+
+// Ids of the metrics counted on the crawl's hot paths, registered once up front.
+typedef struct {
+  metric_id_t feeds_fetched, articles_fetched;
+  metric_id_t feed_bytes, article_bytes;
+  metric_id_t feed_wire_bytes, article_wire_bytes;
+  metric_id_t feeds_revalidated, articles_revalidated;
+  metric_id_t articles_indexed, words_indexed;
+  metric_id_t fetch_retries, hedges_sent, hedges_won;
+  metric_id_t urls_skipped, near_duplicates;
+  metric_id_t unique_terms, postings_bytes;
+  metric_id_t queries;
+} crawl_metrics_t;
+
+static crawl_metrics_t metrics;
+
+// Totals over every fetch of the crawl, for the summary once downloads are done. 
+static struct {
+  long long wire_bytes, decoded_bytes, decode_ns;
+  long long fetches, retries, hedges_sent, hedges_won;
+} transfer_totals;
+
+// Every article url scheduled for fetching, across all domains, so a story that 
+// several feeds carry is only fetched once. 
+static url_set_t seen_urls;
+static const int kItemsPerFeed = 256;   // for sizing seen_urls; most feeds carry far fewer
+
+// With --content-store, what each feed and article url served last run, and what 
+// was made of it.  NULL otherwise. 
+static content_store_t *content_store = NULL;
+
+// How many fetches each host gets at once, adjusted as they go (see host-limiter.h).
+// NULL with --fixed-concurrency, and then each domain gets a thread per feed and 
+// every thread fetches whenever it's ready, as before. 
+static host_limiter_t *host_limiter = NULL;
+static const int kInitialHostLimit = 4;
+
+// Every fetch gives up after --timeout, and is tried again up to --retries times if
+// it failed in a way that might pass (see curlconnection.h).  With --deadline, 
+// fetching stops that far into the crawl, and whatever was fetched by then is 
+// indexed; crawl_deadline_ns is the TimingNow reading it passes at, or 0. 
+static long long crawl_deadline_ns = 0;
+static const long kConnectTimeoutMs = 10000;
+static const long kRetryBaseDelayMs = 100;
+
+// A fetch that's taken longer than 95% of its kind so far is hedged with a second
+// request, unless --no-hedging, as long as the hedges come to no more than 
+// kHedgeBudget of the fetches.  Not until there are kHedgeMinSamples of its kind
+// to go on, though. 
+static const double kHedgePercentile = 0.95;
+static const double kHedgeBudget = 0.05;
+static const int kHedgeMinSamples = 20;
+
+// Names the argument that wasn't understood, prints the usage and exits.
+static void Usage(const char *bad_argument)
+{
+  fprintf(stderr, "rss-news-search: unknown option, or one missing its value: %s\n", bad_argument);
+  fprintf(stderr, "Usage: rss-news-search [feeds-file] [--serve <address>] [--workers <n>] [--eager-sort]\n"
+                  "                       [--record <dir> | --replay <dir>] [--connect-to <host:port>]\n"
+                  "                       [--metrics-port <port>] [--trace <file>] [--snippets]\n"
+                  "                       [--content-store <file>] [--fetch-cache <dir> [--fetch-cache-mb <n>]]\n"
+                  "                       [--private-caches] [--fixed-concurrency]\n"
+                  "                       [--timeout <seconds>] [--retries <n>] [--deadline <seconds>] [--no-hedging]\n");
+  exit(1);
+}
+
+/**
+ * Function: ParseArguments
+ * ------------------------
+ * Usage: rss-news-search [feeds-file] [--serve <address>] [--workers <n>] [--eager-sort]
+ *                        [--record <dir> | --replay <dir>] [--connect-to <host:port>]
+ *                        [--metrics-port <port>] [--trace <file>] [--snippets]
+ *                        [--content-store <file>] [--fetch-cache <dir> [--fetch-cache-mb <n>]]
+ *                        [--private-caches] [--fixed-concurrency]
+ *                        [--timeout <seconds>] [--retries <n>] [--deadline <seconds>] [--no-hedging]
+ * 
+ * With --serve, the index is served over a socket (see query-server.h) 
+ * instead of through the interactive prompt.  address is either "unix:<path>"
+ * or a localhost TCP port, as in "tcp:8107".
+ * 
+ * --eager-sort ranks the articles of every word before the first query rather
+ * than as each word is first searched for.  Handy for comparing startup times. 
+ *
+ * --record saves every feed and article fetched into an archive directory, and
+ * --replay serves a later run from that archive without touching the network,
+ * so indexing can be timed the same way twice (see curlconnection.h).
+ *
+ * --connect-to sends every fetch to one server whatever the url's host, as in
+ * "127.0.0.1:8108" for bench/mock-feed-server.
+ *
+ * --metrics-port serves counters, gauges and the stage histograms in the
+ * Prometheus text format on localhost, from startup until exit (see metrics.h).
+ *
+ * --trace records a timeline of every thread's fetches, feed parsing and
+ * indexing, and writes it to file as Chrome trace-event JSON once the index is
+ * built (see trace.h).
+ *
+ * --snippets keeps the visible text of every article, compressed (see docstore.h),
+ * so search results can quote the text around the word.  Otherwise only titles
+ * and urls outlive indexing.
+ *
+ * --content-store keeps a hash of every feed and article fetched in file, with the
+ * feed's items and the article's words (see content-store.h).  On the next run, a
+ * feed or article that hasn't changed is taken from the file rather than parsed
+ * again.  Articles are always scanned in full with --snippets, since the file
+ * doesn't keep their text.
+ *
+ * --fetch-cache keeps the responses that came with an ETag or Last-Modified in
+ * dir, and asks the server for them again only if they've changed, serving a
+ * 304 Not Modified out of dir (see curlconnection.h).  --fetch-cache-mb caps what
+ * dir holds, 256 MB unless it's given.
+ *
+ * The download threads share one DNS cache, TLS session cache and pool of open
+ * connections (see curlconnection.h).  --private-caches gives each thread its own
+ * instead, for comparison. 
+ *
+ * Fetches to each host are held to a limit that grows while the host keeps up and
+ * halves when it pushes back (see host-limiter.h), and the download threads are 
+ * split evenly between the domains.  --fixed-concurrency goes back to a thread per
+ * feed and no limit, for comparison. 
+ *
+ * Each fetch gives up after --timeout seconds, 30 unless it's given, and one that
+ * times out, loses its connection or is answered 429 or 5xx is tried up to 
+ * --retries more times, 2 unless it's given, after a jittered backoff.  A fetch 
+ * still going after the 95th percentile of its kind is hedged with a second 
+ * request, and the first answer is kept; --no-hedging turns that off.  With 
+ * --deadline, fetching stops that many seconds into the crawl, and the articles
+ * fetched by then are indexed and the rest left out. 
+ */
+static void ParseArguments(int argc, char **argv, options_t *opts)
+{
+  opts->feeds_file = kDefaultFeedsFile;
+  opts->server.address = NULL;
+  opts->server.n_workers = 0;
+  opts->eager_sort = false;
+  opts->fetch_mode = FETCH_LIVE;
+  opts->archive_dir = NULL;
+  opts->connect_to = NULL;
+  opts->fetch_cache = NULL;
+  opts->fetch_cache_bytes = 256LL << 20;
+  opts->metrics_port = 0;
+  opts->trace_file = NULL;
+  opts->snippets = false;
+  opts->content_store = NULL;
+  opts->share_caches = true;
+  opts->limit_hosts = true;
+  opts->fetch_timeout_s = 30;
+  opts->fetch_retries = 2;
+  opts->crawl_deadline_s = 0;
+  opts->hedge_fetches = true;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) 
+      opts->server.address = argv[++i];
+    else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) 
+      opts->server.n_workers = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--eager-sort") == 0) 
+      opts->eager_sort = true;
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+      opts->fetch_mode = FETCH_RECORD;
+      opts->archive_dir = argv[++i];
+    }
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+      opts->fetch_mode = FETCH_REPLAY;
+      opts->archive_dir = argv[++i];
+    }
+    else if (strcmp(argv[i], "--connect-to") == 0 && i + 1 < argc) 
+      opts->connect_to = argv[++i];
+    else if (strcmp(argv[i], "--fetch-cache") == 0 && i + 1 < argc) 
+      opts->fetch_cache = argv[++i];
+    else if (strcmp(argv[i], "--fetch-cache-mb") == 0 && i + 1 < argc) 
+      opts->fetch_cache_bytes = atoll(argv[++i]) << 20;
+    else if (strcmp(argv[i], "--private-caches") == 0) 
+      opts->share_caches = false;
+    else if (strcmp(argv[i], "--fixed-concurrency") == 0) 
+      opts->limit_hosts = false;
+    else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) 
+      opts->fetch_timeout_s = atof(argv[++i]);
+    else if (strcmp(argv[i], "--retries") == 0 && i + 1 < argc) 
+      opts->fetch_retries = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) 
+      opts->crawl_deadline_s = atof(argv[++i]);
+    else if (strcmp(argv[i], "--no-hedging") == 0) 
+      opts->hedge_fetches = false;
+    else if (strcmp(argv[i], "--metrics-port") == 0 && i + 1 < argc) 
+      opts->metrics_port = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) 
+      opts->trace_file = argv[++i];
+    else if (strcmp(argv[i], "--snippets") == 0) 
+      opts->snippets = true;
+    else if (strcmp(argv[i], "--content-store") == 0 && i + 1 < argc) 
+      opts->content_store = argv[++i];
+    // a mistyped flag would otherwise be taken for the feeds file.
+    else if (strncmp(argv[i], "--", 2) == 0)
+      Usage(argv[i]);
+    else 
+      opts->feeds_file = argv[i];
+  }
+}
+
+static void RegisterMetrics(void)
+{
+  metrics.feeds_fetched = MetricsCounter("rss_fetches_total", "Fetches completed, successful or not.", "kind", "feed");
+  metrics.articles_fetched = MetricsCounter("rss_fetches_total", "Fetches completed, successful or not.", "kind", "article");
+  metrics.feed_bytes = MetricsCounter("rss_fetch_bytes_total", "Bytes of content fetched.", "kind", "feed");
+  metrics.article_bytes = MetricsCounter("rss_fetch_bytes_total", "Bytes of content fetched.", "kind", "article");
+  metrics.feed_wire_bytes = MetricsCounter("rss_fetch_wire_bytes_total", "Bytes of content as sent, before decompression.", "kind", "feed");
+  metrics.article_wire_bytes = MetricsCounter("rss_fetch_wire_bytes_total", "Bytes of content as sent, before decompression.", "kind", "article");
+  metrics.feeds_revalidated = MetricsCounter("rss_fetches_revalidated_total", "Fetches answered 304 Not Modified and served from the fetch cache.", "kind", "feed");
+  metrics.articles_revalidated = MetricsCounter("rss_fetches_revalidated_total", "Fetches answered 304 Not Modified and served from the fetch cache.", "kind", "article");
+  metrics.articles_indexed = MetricsCounter("rss_articles_indexed_total", "Articles added to the index.", NULL, NULL);
+  metrics.words_indexed = MetricsCounter("rss_words_indexed_total", "Word occurrances recorded in the index.", NULL, NULL);
+  metrics.near_duplicates = MetricsCounter("rss_near_duplicates_total", "Articles not indexed because their text nearly matches an article indexed earlier.", NULL, NULL);
+  metrics.fetch_retries = MetricsCounter("rss_fetch_retries_total", "Fetch attempts repeated after a timeout, a connection error, a 429 or a 5xx.", NULL, NULL);
+  metrics.hedges_sent = MetricsCounter("rss_fetch_hedges_total", "Second requests sent for fetches slower than the 95th percentile.", "outcome", "sent");
+  metrics.hedges_won = MetricsCounter("rss_fetch_hedges_total", "Second requests sent for fetches slower than the 95th percentile.", "outcome", "won");
+  metrics.urls_skipped = MetricsCounter("rss_duplicate_urls_total", "Article urls not fetched because another feed already listed them.", NULL, NULL);
+  metrics.unique_terms = MetricsGauge("rss_unique_terms", "Distinct words in the index.", NULL, NULL);
+  metrics.postings_bytes = MetricsGauge("rss_postings_bytes", "Bytes allocated to the postings of every word.", NULL, NULL);
+  metrics.queries = MetricsCounter("rss_queries_total", "Queries answered.", "interface", "prompt");
+}
+
+// Counts the bytes a fetch took on the wire, the time spent inflating them, and
+// its retries and hedge. 
+static void CountTransfer(const curlconnection_t *connection, metric_id_t wire_bytes)
+{
+  MetricsAdd(wire_bytes, connection->wire_bytes);
+  MetricsAdd(metrics.fetch_retries, connection->retries);
+  MetricsAdd(metrics.hedges_sent, connection->hedged);
+  MetricsAdd(metrics.hedges_won, connection->hedge_won);
+  if (connection->decode_ns > 0) TimingRecord(STAGE_DECODE, connection->decode_ns);
+  __atomic_add_fetch(&transfer_totals.wire_bytes, connection->wire_bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.decoded_bytes, connection->decoded_bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.decode_ns, connection->decode_ns, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.fetches, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.retries, connection->retries, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.hedges_sent, connection->hedged, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&transfer_totals.hedges_won, connection->hedge_won, __ATOMIC_RELAXED);
+}
+
+// How long a fetch timed as stage may go before it's hedged, or 0 if it isn't to be.
+static long HedgeAfterMs(timing_stage_t stage, const options_t *opts)
+{
+  if (!opts->hedge_fetches) return 0;
+  long long fetches = __atomic_load_n(&transfer_totals.fetches, __ATOMIC_RELAXED);
+  long long hedges = __atomic_load_n(&transfer_totals.hedges_sent, __ATOMIC_RELAXED);
+  if (hedges >= kHedgeBudget * fetches) return 0;
+  long long counts[TIMING_N_BUCKETS], total_ns;
+  if (TimingSnapshot(stage, counts, &total_ns) < kHedgeMinSamples) return 0;
+  return TimingPercentile(stage, kHedgePercentile) / 1000000 + 1;
+}
+
+// How a fetch went, as far as the load on its host goes.  A fetch that needed 
+// retrying was turned away or timed out at least once, whatever came of it. 
+static fetch_outcome_t FetchOutcome(int status, const curlconnection_t *connection)
+{
+  long http_status = connection->http_status;
+  if (http_status == 429 || http_status >= 500 || connection->retries > 0) return FETCH_OVERLOADED;
+  switch (status) {
+    case CURLE_OK:
+      return FETCH_HEALTHY;
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+      return FETCH_OVERLOADED;
+    default:
+      return FETCH_NEUTRAL;
+  }
+}
+
+// Fetches url once its host has room for another fetch, and tells the limiter how 
+// it went.  The wait counts as part of the fetch's time.  host is the room already
+// taken for it with HostLimiterTryAcquire, if any. 
+static int LimitedFetch(const char *url, FILE *stream, host_state_t *host, curlconnection_t *connection)
+{
+  if (host_limiter == NULL) return CurlConnectionFetch(url, stream, connection);
+  if (host == NULL) host = HostLimiterAcquire(host_limiter, url);
+  long long start = TimingNow();
+  int status = CurlConnectionFetch(url, stream, connection);
+  HostLimiterRelease(host_limiter, host, FetchOutcome(status, connection), start, TimingNow() - start);
+  return status;
+}
+
+// Errors are rare, so their counters are registered as each code first turns up.
+static void CountFetchError(int status)
+{
+  char code[16];
+  snprintf(code, sizeof(code), "%d", status);
+  MetricsAdd(MetricsCounter("rss_fetch_errors_total", "Failed fetches, by curl error code.", "code", code), 1);
+}
+
+static void UpdateIndexGauges(search_db_t *db)
+{
+  long long postings_bytes = 0;
+  for (int i = 0; i < TermSetCount(&db->words); i++)
+    postings_bytes += TermSetAt(&db->words, i)->occurrances.allocated * (long long)sizeof(occurrance_t);
+  MetricsSet(metrics.unique_terms, TermSetCount(&db->words));
+  MetricsSet(metrics.postings_bytes, postings_bytes);
+}
+
 /**
  * Function: main
  * --------------
@@ -49,24 +402,71 @@ static void AddPair(char *word, search_db_t *db, article_t *article_addr );
  * word appears.
  */
 
-static const char *const kWelcomeTextFile = "./data/welcome.txt";
-static const char *const kDefaultFeedsFile = "./data/rss-feeds-large.txt";
-
-
 int main(int argc, char **argv)
 {
   search_db_t db;   // the database. This will be passed down the function hierarchy.
+  options_t opts;
+  ParseArguments(argc, argv, &opts);
+  RegisterMetrics();
+  if (opts.metrics_port != 0 && !MetricsServe(opts.metrics_port)) return 1;
+  if (opts.trace_file != NULL) {
+    TraceOpen(opts.trace_file);
+    TraceNameThread("main");
+  }
+  if (!CurlConnectionOpenArchive(opts.fetch_mode, opts.archive_dir)) {
+    fprintf(stderr, "Couldn't open the fetch archive in %s\n", opts.archive_dir);
+    return 1;
+  }
+  CurlConnectionRouteAllTo(opts.connect_to);
+  if (opts.fetch_cache != NULL && !CurlConnectionOpenCache(opts.fetch_cache, opts.fetch_cache_bytes)) {
+    fprintf(stderr, "Couldn't open the fetch cache in %s\n", opts.fetch_cache);
+    return 1;
+  }
   InitDatabase(&db);
+  if (opts.snippets) KeepSnippets(&db);
+  content_store_t store;
+  if (opts.content_store != NULL) {
+    if (!ContentStoreOpen(&store, opts.content_store)) {
+      fprintf(stderr, "Couldn't read the content store %s\n", opts.content_store);
+      ContentStoreDispose(&store);
+      return 1;
+    }
+    content_store = &store;
+  }
   
   Welcome(kWelcomeTextFile);
 
-  LoadStopList(&db.stop_words);
+  LoadStopList(&db);
 
-  BuildIndices((argc == 1) ? kDefaultFeedsFile : argv[1], &db);  // runs only once. 
+  BuildIndices(&opts, &db);  // runs only once. 
+  if (content_store != NULL) {
+    ContentStoreReport(content_store);
+    if (!ContentStoreSave(content_store)) fprintf(stderr, "Couldn't write the content store %s\n", opts.content_store);
+    ContentStoreDispose(content_store);
+    content_store = NULL;
+  }
+  UpdateIndexGauges(&db);
+  if (db.snippets != NULL) DocStoreReport(db.snippets);
+  MemTrackReport(stdout, "after BuildIndices");
+  printf("\n");
+  if (opts.trace_file != NULL && TraceClose()) printf("Wrote a trace of the crawl to %s\n", opts.trace_file);
+  CurlConnectionCloseArchive();
+  CurlConnectionCacheReport();
+  CurlConnectionCloseCache();
+  CurlConnectionRouteAllTo(NULL);
+  if (opts.eager_sort) {
+    SortOccurrances(&db);
+    ReportRankingStats(&db);
+  }
 
-  QueryIndices(&db);  
+  if (opts.server.address != NULL)
+    QueryServerRun(&opts.server, &db);
+  else
+    QueryIndices(&db);  
+  ReportRankingStats(&db);
 
   DisposeDatabase(&db); 
+  MemTrackReport(stdout, "after DisposeDatabase");
   
   return 0;
 }
@@ -103,9 +503,9 @@ static void Welcome(const char *welcomeTextFileName)
   fclose(infile);
 }
 
-static void LoadStopList(hashset *stop_list) {
-  //First, we initialize the list.  Because we set this up to store char arrays 
-  // of fixed width, we don't need to worry about the HashSetFree function. 
+static void LoadStopList(search_db_t *db) {
+  // The stop list stores char arrays of fixed width, so there's nothing in it 
+  // that needs freeing beyond the set itself. 
   
   int i = 0;
   FILE* infile;
@@ -117,7 +517,7 @@ static void LoadStopList(hashset *stop_list) {
 
   while (STNextToken(&st, buffer, sizeof(buffer))) {
     //printf("%s ", buffer);
-    HashSetEnter(stop_list, buffer);
+    AddStopWord(buffer, db);
     i++;
   }
   
@@ -130,8 +530,8 @@ static void LoadStopList(hashset *stop_list) {
 static void BuildDomains(const char *feedsFileName, domain_t domains[], int *n_domains) {
 
   int path_index;
-  domain_t *active_domain; 
-  char full_url[1024], domain_name[512], previous_domain_name[512], rss_label[400];
+  domain_t *active_domain = NULL;   // NULL while the domain is one we're skipping
+  char full_url[1024], domain_name[512], previous_domain_name[512] = "", rss_label[400];
   FILE *infile;
   streamtokenizer st;
   
@@ -154,15 +554,26 @@ static void BuildDomains(const char *feedsFileName, domain_t domains[], int *n_d
 
     // if this domain is not the same as the previous domain, advance to the next domain.
     if( strcmp(domain_name, previous_domain_name) ) { 
-      active_domain = &domains[*n_domains];
-      (*n_domains)++;
-      //printf("domains %d", *n_domains);
-
-      InitDomain(active_domain);
       // advance previous domain name
       strcpy( previous_domain_name, domain_name);
+      if (*n_domains == MAX_DOMAINS) active_domain = NULL;
+      else {
+        active_domain = &domains[*n_domains];
+        (*n_domains)++;
+        //printf("domains %d", *n_domains);
+
+        InitDomain(active_domain);
+      }
+    }
+    if (active_domain == NULL) {
+      printf("Skipping %s: only %d domains are supported.\n", full_url, MAX_DOMAINS);
+      continue;
     }
     // copy the feed url to the active domain. 
+    if (active_domain->n_unclaimed_feeds == MAX_FEEDS_PER_DOMAIN) {
+      printf("Skipping %s: only %d feeds per domain are supported.\n", full_url, MAX_FEEDS_PER_DOMAIN);
+      continue;
+    }
     strcpy( active_domain->rss_url[active_domain->n_unclaimed_feeds], full_url);
     active_domain->n_unclaimed_feeds++;
   }
@@ -170,17 +581,35 @@ static void BuildDomains(const char *feedsFileName, domain_t domains[], int *n_d
   fclose(infile);
 }
 
-static void DownloadWithThreads(domain_t domains[], int n_domains) {
-  pthread_t threads[50];
+// What each download thread is handed: the domain it works on, and the options.
+typedef struct {
+  domain_t *domain;
+  const options_t *opts;
+} downloader_args_t;
+
+static void DownloadWithThreads(domain_t domains[], int n_domains, const options_t *opts) {
+  pthread_t threads[MAX_DOWNLOAD_THREADS];
+  downloader_args_t args[MAX_DOMAINS];
   int i, j, n_threads = 0;
 
   for(i = 0; i < n_domains; i++ )
   {
+    args[i].domain = &domains[i];
+    args[i].opts = opts;
+    // With host limits, the threads are split evenly, and the limiter decides how many
+    // are fetching.  Otherwise it's a thread per feed, as long as that leaves at 
+    // least one for each domain still to come.
+    int n_domain_threads;
+    if (host_limiter != NULL) n_domain_threads = (MAX_DOWNLOAD_THREADS - n_threads) / (n_domains - i);
+    else {
+      n_domain_threads = MAX_DOWNLOAD_THREADS - n_threads - (n_domains - i - 1);
+      if (n_domain_threads > domains[i].n_unclaimed_feeds) n_domain_threads = domains[i].n_unclaimed_feeds;
+    }
     //printf("\nDomain %d:\n", i );
-    for(j = 0; j < domains[i].n_unclaimed_feeds; j++) 
+    for(j = 0; j < n_domain_threads; j++) 
     {
       //printf("%s\n", domains[i].rss_url[j]);
-      pthread_create(&threads[n_threads], NULL, DownloaderThread, &domains[i] );
+      pthread_create(&threads[n_threads], NULL, DownloaderThread, &args[i] );
       n_threads++;
     }
   }
@@ -191,27 +620,37 @@ static void DownloadWithThreads(domain_t domains[], int n_domains) {
   }
 }
 
-static void MergeDomainData(domain_t domains[], int n_domains, search_db_t *db) {
+// Indexes every article that was fetched in full.  Sets *n_unfetched to the number
+// left out because they weren't fetched before the deadline, and *n_failed to the 
+// number whose fetch failed or was cut off. 
+static void MergeDomainData(domain_t domains[], int n_domains, search_db_t *db, int *n_unfetched, int *n_failed) {
   int n_articles;
-  article_t *article_j; 
+  *n_unfetched = *n_failed = 0;
+  word_list_t words;    // scratch for ProcessArticle, reused by every article
+  WordListNew(&words, 1024);
 
    for( int i = 0; i < n_domains; i++ )
   {
-    n_articles = domains[i].n_articles;
+    n_articles = DocTableCount(&domains[i].docs);
     for( int j = 0; j < n_articles; j++) 
     {
-      article_j = VectorNth( &domains[i].articles_vector, j);
-      ProcessArticle(article_j, db);
+      if (*HtmlVectorNth(&domains[i].html, j) == NULL) (*n_unfetched)++;
+      else if (*FetchStatusVectorNth(&domains[i].fetch_status, j) != CURLE_OK) {
+        (*n_failed)++;
+        ReleaseArticleHtml(&domains[i], j);
+      }
+      else ProcessArticle(&domains[i], j, &words, db);
     }
     // now that all the articles are copied, to the db, we can toss the domain. 
     DomainDispose( &domains[i] );    
   }
+  WordListDispose(&words);
 }
 /**
  * Function: BuildIndices
  * ----------------------
  * As far as the user is concerned, BuildIndices needs to read each and every
- * one of the feeds listed in the specied feedsFileName, and for each feed parse
+ * one of the feeds listed in the feeds file opts names, and for each feed parse
  * content of all referenced articles and store the content in the hashset of indices.
  * Each line of the specified feeds file looks like this:
  *
@@ -223,33 +662,78 @@ static void MergeDomainData(domain_t domains[], int n_domains, search_db_t *db)
  * document and index its content.
  */
 
-static void BuildIndices(const char *feedsFileName, search_db_t *db )
+static void BuildIndices(const options_t *opts, search_db_t *db )
 {
   curl_global_init(CURL_GLOBAL_SSL);  // Run once.  BuildIndices runs once for life of program. 
-  domain_t domains[10]; 
+  if (opts->share_caches && !CurlConnectionShareCaches(4 * MAX_DOWNLOAD_THREADS))
+    printf("libcurl can't share its caches, so each thread will keep its own.\n");
+  long timeout_ms = opts->fetch_timeout_s * 1000;
+  CurlConnectionSetTimeouts(timeout_ms > 0 && timeout_ms < kConnectTimeoutMs ? timeout_ms : kConnectTimeoutMs, timeout_ms);
+  CurlConnectionSetRetries(opts->fetch_retries, kRetryBaseDelayMs);
+  domain_t domains[MAX_DOMAINS]; 
   int n_domains;
-  time_t t1;
+  long long start;
 
   // Reads the feeds file and groups feeds by the domain, 
   // initializing a domain structure for each unique domain. 
-  BuildDomains(feedsFileName, domains, &n_domains); // this builds the domains. 
+  BuildDomains(opts->feeds_file, domains, &n_domains); // this builds the domains. 
+  int n_feeds = 0;
+  for (int i = 0; i < n_domains; i++) n_feeds += domains[i].n_unclaimed_feeds;
+  UrlSetNew(&seen_urls, n_feeds * kItemsPerFeed);
+  // any domain's articles can be on any host, so a host can have every thread. 
+  host_limiter_t limiter;
+  if (opts->limit_hosts) {
+    HostLimiterNew(&limiter, kInitialHostLimit, MAX_DOWNLOAD_THREADS);
+    host_limiter = &limiter;
+  }
 
   // this is blocking. It spaws threads, but rejoins with all before returning. 
-  t1 = time(NULL);
-  DownloadWithThreads(domains, n_domains);
-  printf("Downloads took %f seconds.\n\n", difftime(time(NULL), t1));
+  start = TimingNow();
+  if (opts->crawl_deadline_s > 0) {
+    crawl_deadline_ns = start + (long long)(opts->crawl_deadline_s * 1e9);
+    CurlConnectionSetDeadline(crawl_deadline_ns);
+  }
+  TraceBegin("download");
+  DownloadWithThreads(domains, n_domains, opts);
+  TraceEnd();
+  printf("Downloads took %.3f seconds.\n", (TimingNow() - start) / 1e9);
+  if (transfer_totals.wire_bytes > 0)
+    printf("%.1f MB of content came over as %.1f MB (%.1fx), and took %.3f seconds to inflate.\n",
+           transfer_totals.decoded_bytes / 1e6, transfer_totals.wire_bytes / 1e6,
+           (double)transfer_totals.decoded_bytes / transfer_totals.wire_bytes, transfer_totals.decode_ns / 1e9);
+  printf("%lld fetches took %lld retries, and %lld were hedged, %lld of them won by the hedge.\n",
+         transfer_totals.fetches, transfer_totals.retries, transfer_totals.hedges_sent, transfer_totals.hedges_won);
+  printf("\n");
+  if (host_limiter != NULL) {
+    HostLimiterReport(host_limiter, stdout);
+    printf("\n");
+    HostLimiterDispose(host_limiter);
+    host_limiter = NULL;
+  }
 
   // Iterates through all the domain data and populates db. 
-  t1 = time(NULL);
-  MergeDomainData(domains, n_domains, db);
-  printf("Processing took %f seconds.\n", difftime(time(NULL), t1));
-  printf("Processed %d unique articles. \n\n", HashSetCount(&db->articles));
+  start = TimingNow();
+  TraceBegin("merge");
+  int n_unfetched, n_failed;
+  MergeDomainData(domains, n_domains, db, &n_unfetched, &n_failed);
+  TraceEnd();
+  printf("Processing took %.3f seconds.\n", (TimingNow() - start) / 1e9);
+  if (n_unfetched > 0) printf("%d articles weren't fetched before the deadline, so they weren't indexed.\n", n_unfetched);
+  if (n_failed > 0) printf("%d articles couldn't be fetched in full, so they weren't indexed.\n", n_failed);
+  UrlSetReport(&seen_urls);
+  UrlSetDispose(&seen_urls);
+  printf("Processed %d unique articles, of which %d were near duplicates and weren't indexed. \n\n",
+         DocTableCount(&db->docs), db->n_near_duplicates);
+  TimingReport(stdout);
+  printf("\n");
+  LockReport(stdout);
+  printf("\n");
 
-  // now we sort all vectors that store the occurrance of a word in an article.  
-  // When we search for a term, the articles we get back will be in sorted order from those
-  // articles that mention the term the most, to those the the fewest mentions. 
-  SortOccurrances(db);
+  // Note we don't sort the occurrances of every word here.  Most words are never
+  // searched for, and most that are only need their first page, which TopOccurrances
+  // picks out without sorting.  A word's articles are ranked once someone pages past it. 
 
+  CurlConnectionUnshareCaches();   // every thread's connection is gone by now. 
   curl_global_cleanup();  // once for life of program. 
 }
 
@@ -286,36 +770,78 @@ static void BuildIndices(const char *feedsFileName, search_db_t *db )
 static const char *const kTextDelimiters = " \t\n\r\b!@$%^*()_+={[}]|\\'\":;/?.>,<~`";
 
 void* DownloaderThread( void *arg ) {
-  domain_t *domain = (domain_t*)arg; 
+  domain_t *domain = ((downloader_args_t*)arg)->domain; 
+  const options_t *opts = ((downloader_args_t*)arg)->opts;
 
   curlconnection_t connection;    // Each thread has a single connection.
   CurlConnectionNew(&connection);
-  int l_rss_index, article_index;
-  mstreamtokenizer_t mst;
+  int l_rss_index;
+  const char *url, *title;
+  mstreamtokenizer_t mst, *html;
 
+  TraceNameThread("downloader");
   //printf("Thread Started \n");
 
 
   // Download all feeds.  Loop until all feeds are claimed by a thread. 
   while(true) {
     //critital regtion where we read the feed counter and claim one. 
-    sem_wait(&domain->n_unclaimed_feeds_lock);
-    if( domain->n_unclaimed_feeds <= 0 ) {    // Have all feeds been claimed? 
-      sem_post(&domain->n_unclaimed_feeds_lock);
+    LOCK_ACQUIRE(&domain->n_unclaimed_feeds_lock);
+    if( domain->n_unclaimed_feeds <= 0 || PastDeadline() ) {    // Have all feeds been claimed? 
+      LockRelease(&domain->n_unclaimed_feeds_lock);
       break;
     }
     l_rss_index = --(domain->n_unclaimed_feeds);  // decrement and copy locally.
-    sem_post(&domain->n_unclaimed_feeds_lock);     // end of critical region. 
+    LockRelease(&domain->n_unclaimed_feeds_lock);     // end of critical region. 
 
     // Download and store in local mstream. 
     MSTNew(&mst, kTextDelimiters, false);
-    if ( CurlConnectionFetch(domain->rss_url[l_rss_index], mst.stream, &connection ) != CURLE_OK ) {
+    long long start = TimingNow();
+    TraceBegin("fetch feed");
+    connection.hedge_after_ms = HedgeAfterMs(STAGE_FEED_FETCH, opts);
+    int status = LimitedFetch(domain->rss_url[l_rss_index], mst.stream, NULL, &connection );
+    MSTDoneWriting(&mst);
+    TraceEndWith("bytes", mst.length);
+    start = TimingRecordSince(STAGE_FEED_FETCH, start);
+    MetricsAdd(metrics.feeds_fetched, 1);
+    MetricsAdd(metrics.feed_bytes, mst.length);   // brought up to date by the fetch's fflush
+    if (connection.revalidated) MetricsAdd(metrics.feeds_revalidated, 1);
+    CountTransfer(&connection, metrics.feed_wire_bytes);
+    if ( status != CURLE_OK ) {
+      CountFetchError(status);
       printf("Problem connecting to: \n%s\nError: %s\n", domain->rss_url[l_rss_index], connection.error_str);
     }
     else {
+      const char *url = domain->rss_url[l_rss_index];
+      char *stored_items = NULL;
+      uint64_t content = 0;
+      int length;
+      if (content_store != NULL) {
+        content = ContentHash(mst.buffer, mst.length);
+        stored_items = ContentStoreMatch(content_store, url, content, &length);
+      }
       // critical in section where it checks for duplicate articles and writes
       // writes articles stored in memstream to the articles vector and titles hashset
-      ParseFeed(&mst.st, domain);
+      if (stored_items != NULL) {
+        // the feed hasn't changed since last time, so neither have its items. 
+        TraceBegin("reuse feed");
+        ScheduleStoredItems(stored_items, length, domain);
+        free(stored_items);
+      }
+      else {
+        char *items = NULL;
+        size_t items_length = 0;
+        FILE *items_out = content_store != NULL ? open_memstream(&items, &items_length) : NULL;
+        TraceBegin("parse feed");
+        ParseFeed(&mst.st, domain, items_out);
+        if (items_out != NULL) {
+          fclose(items_out);
+          ContentStorePut(content_store, url, content, items, items_length);
+          free(items);
+        }
+      }
+      TraceEnd();
+      TimingRecordSince(STAGE_FEED_PARSE, start);
     }
     MSTDispose(&mst);
   }
@@ -325,18 +851,31 @@ void* DownloaderThread( void *arg ) {
 
   while(true) {
 
-    // Here we claim an article by its index. 
-    sem_wait(&domain->articles_retreival_lock);
-    if( domain->articles_tail >= domain->n_articles ) {
-      sem_post(&domain->articles_retreival_lock);
+    // Here we claim an article by its index.  This takes the same lock as ParseFeed,
+    // since other threads may still be adding articles. 
+    // The strings themselves never move, but the table's index of them does as 
+    // ParseFeed adds to it, so they're looked up under the lock too. 
+    LOCK_ACQUIRE(&domain->articles_lock);
+    host_state_t *host = NULL;
+    int index = ClaimArticle(domain, &host);
+    if (index < 0) {
+      LockRelease(&domain->articles_lock);
       break;
     }
-    article_index = domain->articles_tail;
-    domain->articles_tail++;
-    sem_post(&domain->articles_retreival_lock);
+    url = DocUrl(&domain->docs, index);
+    title = DocTitle(&domain->docs, index);
+    html = malloc(sizeof(mstreamtokenizer_t));
+    *HtmlVectorNth(&domain->html, index) = html;
+    LockRelease(&domain->articles_lock);
+
 
+    connection.hedge_after_ms = HedgeAfterMs(STAGE_ARTICLE_FETCH, opts);
+    int status = DownloadArticle(url, title, html, host, &connection );  //TODO: separate download from process article. 
 
-    DownloadArticle(article_index, domain, &connection );  //TODO: separate download from process article. 
+    // the vector may move as ParseFeed adds to it, so this is under the lock too. 
+    LOCK_ACQUIRE(&domain->articles_lock);
+    *FetchStatusVectorNth(&domain->fetch_status, index) = status;
+    LockRelease(&domain->articles_lock);
 
   }
   CurlConnectionDispose(&connection);
@@ -345,37 +884,108 @@ void* DownloaderThread( void *arg ) {
 }
 
 
-static void ParseFeed(streamtokenizer *st, domain_t *domain)
+// Whether the crawl has run past --deadline, so no more fetches are started.
+static bool PastDeadline(void)
 {
-  article_t article;  
+  return crawl_deadline_ns != 0 && TimingNow() >= crawl_deadline_ns;
+}
+
+// Returns the index of the next article for a thread to fetch, or -1 once they've all
+// been claimed, or the deadline has passed.  Called with the articles_lock held. 
+// 
+// The articles of a domain's feeds are on any number of hosts, so with host limits
+// the next article's host may be full while others have room.  Rather than wait on
+// it, the thread passes it over to domain->deferred and goes on to the first one, 
+// deferred or not, whose host has room, which *host is set to.  Only when every
+// article left is on a full host does it take the first one anyway, leaving *host
+// NULL for LimitedFetch to wait on. 
+static int ClaimArticle(domain_t *domain, host_state_t **host)
+{
+  if (PastDeadline()) return -1;
+  if (host_limiter == NULL) 
+    return domain->articles_tail < DocTableCount(&domain->docs) ? domain->articles_tail++ : -1;
+
+  article_index_vector_t *deferred = &domain->deferred;
+  for (int i = 0; i < ArticleIndexVectorLength(deferred); i++) {
+    int index = *ArticleIndexVectorNth(deferred, i);
+    *host = HostLimiterTryAcquire(host_limiter, DocUrl(&domain->docs, index));
+    if (*host != NULL) {
+      *ArticleIndexVectorNth(deferred, i) = *ArticleIndexVectorLast(deferred);
+      ArticleIndexVectorRemoveLast(deferred);
+      return index;
+    }
+  }
+  while (domain->articles_tail < DocTableCount(&domain->docs)) {
+    int index = domain->articles_tail++;
+    *host = HostLimiterTryAcquire(host_limiter, DocUrl(&domain->docs, index));
+    if (*host != NULL) return index;
+    ArticleIndexVectorAppend(deferred, &index);
+  }
+  if (ArticleIndexVectorLength(deferred) == 0) return -1;
+  int index = *ArticleIndexVectorNth(deferred, 0);
+  *ArticleIndexVectorNth(deferred, 0) = *ArticleIndexVectorLast(deferred);
+  ArticleIndexVectorRemoveLast(deferred);
+  return index;
+}
+
+// Puts the article into the domain's lists, unless it's a repeat. 
+static void ScheduleItem(const char *title, const char *desc, const char *url, domain_t *domain)
+{
+  //This is a critical section. 
+  LOCK_ACQUIRE(&domain->articles_lock);
+  // only add articles with titles we haven't seen before. 
+  if(DocTableFind(&domain->docs, title) < 0) {
+    // and only at urls that no feed of any domain has listed already. 
+    if(!UrlSetAdd(&seen_urls, url)) {
+      MetricsAdd(metrics.urls_skipped, 1);
+    }
+    else {
+      // the table is what will be used later to download the full articles' html. 
+      html_p no_html = NULL;
+      int not_fetched = -1;
+      DocTableAdd(&domain->docs, title, desc, url);
+      HtmlVectorAppend(&domain->html, &no_html);
+      FetchStatusVectorAppend(&domain->fetch_status, &not_fetched);
+    }
+    //printf("    %s\n", title);
+  }
+  //else printf("duplicate ignored\n");
+  LockRelease(&domain->articles_lock);
+}
+
+// items, if not NULL, gets the title, description and url of every item, each 
+// '\0'-terminated, for ScheduleStoredItems to take back next run. 
+static void ParseFeed(streamtokenizer *st, domain_t *domain, FILE *items)
+{
+  feed_item_t item;  
 
   while (GetNextItemTag(st)) { // if true, <item ...> was just read and pulled from the data stream
-    // parse each <item> section into an article structure. 
-    if( !ParseItem(st, &article ) )
+    // parse each <item> section into an item structure. 
+    if( !ParseItem(st, &item ) )
       printf("Failed to read either title or url fields from RSS.\n");
     else {
-
-      //put the article into the domain lists. 
-      //This is a critical section. 
-      sem_wait(&domain->titles_input_lock);
-      // only add articles with titles we haven't seen before. 
-      if(HashSetLookup(&domain->titles_hashset, article.title) == NULL) {
-        // we enter article into hashset of titles so we can quickly identify duplicate titles.
-        HashSetEnter( &domain->titles_hashset, article.title );
-        // the vector is what will be used later to download the full articles' html. 
-        VectorAppend(&domain->articles_vector, &article);
-        domain->n_articles++;
-
-        //printf("    %s\n", article.title);
+      ScheduleItem(item.title, item.desc, item.url, domain);
+      if (items != NULL) {
+        fwrite(item.title, 1, strlen(item.title) + 1, items);
+        fwrite(item.desc, 1, strlen(item.desc) + 1, items);
+        fwrite(item.url, 1, strlen(item.url) + 1, items);
       }
-      //else printf("duplicate ignored\n");
-      sem_post(&domain->titles_input_lock);
-
-      
     }
   }
 }
 
+static void ScheduleStoredItems(const char *items, int length, domain_t *domain)
+{
+  const char *end = items + length;
+  while (items < end) {
+    const char *title = items;
+    const char *desc = title + strlen(title) + 1;
+    const char *url = desc + strlen(desc) + 1;
+    ScheduleItem(title, desc, url, domain);
+    items = url + strlen(url) + 1;
+  }
+}
+
 /**
  * Function: GetNextItemTag
  * ------------------------
@@ -436,26 +1046,26 @@ static const char *const kItemEndTag = "</item>";
 static const char *const kTitleTagPrefix = "<title";
 static const char *const kDescriptionTagPrefix = "<description";
 static const char *const kLinkTagPrefix = "<link";
-static bool ParseItem(streamtokenizer *st, article_t *article)
+static bool ParseItem(streamtokenizer *st, feed_item_t *item)
 {
   char htmlTag[1024];
-  article->title[0] = article->desc[0] = article->url[0] = '\0';
+  item->title[0] = item->desc[0] = item->url[0] = '\0';
   
   // step through the tags inside an <item> section.  Pull out the Titles, Descriptions and Links. 
   while (GetNextTag(st, htmlTag, sizeof(htmlTag)) && (strcasecmp(htmlTag, kItemEndTag) != 0)) {
     
     if (strncasecmp(htmlTag, kTitleTagPrefix, strlen(kTitleTagPrefix)) == 0) 
-      ExtractElement(st, htmlTag, article->title, sizeof(article->title));
+      ExtractElement(st, htmlTag, item->title, sizeof(item->title));
     
     if (strncasecmp(htmlTag, kDescriptionTagPrefix, strlen(kDescriptionTagPrefix)) == 0) 
-      ExtractElement(st, htmlTag, article->desc, sizeof(article->desc));
+      ExtractElement(st, htmlTag, item->desc, sizeof(item->desc));
 
     if (strncasecmp(htmlTag, kLinkTagPrefix, strlen(kLinkTagPrefix)) == 0) 
-      ExtractElement(st, htmlTag, article->url, sizeof(article->url));
+      ExtractElement(st, htmlTag, item->url, sizeof(item->url));
   }
   // if URL or title are empty, return false. 
-  if( article->url[0] == '\0' || article->title[0] == '\0' ) {
-    printf("something is wrong with article's title: \"%s\"", article->title);
+  if( item->url[0] == '\0' || item->title[0] == '\0' ) {
+    printf("something is wrong with article's title: \"%s\"", item->title);
     return false; 
   }
   return true; 
@@ -503,68 +1113,177 @@ static void ExtractElement(streamtokenizer *st, const char *htmlTag, char dataBu
   STSkipOver(st, ">");
 }
 
-static void DownloadArticle( int article_index, domain_t *domain, curlconnection_t *connection ) {
+// Returns what CurlConnectionFetch did. 
+static int DownloadArticle(const char *url, const char *title, mstreamtokenizer_t *mst, host_state_t *host,
+                           curlconnection_t *connection) {
   // we have already validated that this article is not a repeat. 
-  article_t *article = (article_t*)VectorNth(&domain->articles_vector, article_index);
-  mstreamtokenizer_t *mst = &article->mst;
-
-  // we still need to initialize the memstream tokenizer. The article struct contains an mst object. 
+  // we still need to initialize the memstream tokenizer the html goes into. 
   MSTNew(mst, kTextDelimiters, false); 
   //streamtokenizer *st = &mst->st;
 
   // pull the article from the interwebs. 
-  if(CurlConnectionFetch(article->url, mst->stream, connection) != CURLE_OK) {
-    printf("Could not get article url:%s\n", article->url);
-    return;
+  long long start = TimingNow();
+  TraceBegin("fetch article");
+  int status = LimitedFetch(url, mst->stream, host, connection);
+  MSTDoneWriting(mst);
+  TraceEndWith("bytes", mst->length);
+  TimingRecordSince(STAGE_ARTICLE_FETCH, start);
+  MetricsAdd(metrics.articles_fetched, 1);
+  MetricsAdd(metrics.article_bytes, mst->length);
+  if (connection->revalidated) MetricsAdd(metrics.articles_revalidated, 1);
+  CountTransfer(connection, metrics.article_wire_bytes);
+  // open_memstream's buffer is at least this big; libc doesn't say how much bigger.
+  MemTrackAdd(MEM_ARTICLE_HTML, mst->length, 1);
+  if(status != CURLE_OK) {
+    CountFetchError(status);
+    printf("Could not get article url:%s\n", url);
+    return status;
   }
-  printf("  downloaded: %s\n", article->title);
+  printf("  downloaded: %s\n", title);
+  return status;
+
+}
 
+// Frees the html of the domain's article.  Nothing reads it again once it's indexed.
+static void ReleaseArticleHtml(domain_t *domain, int index) {
+  mstreamtokenizer_t *html = *HtmlVectorNth(&domain->html, index);
+  MemTrackAdd(MEM_ARTICLE_HTML, -(long long)html->length, -1);
+  MSTDispose(html);
+  free(html);
+  *HtmlVectorNth(&domain->html, index) = NULL;
 }
 
 /**
  * Function: ProcessArticle
  * ---------------------
- * Parses the specified article, skipping over all HTML tags, and counts the numbers
- * of well-formed words that could potentially serve as keys in the set of indices.
- * Once the full article has been scanned, the number of well-formed words is
- * printed, and the longest well-formed word we encountered along the way
- * is printed as well.
- *
- * This is really a placeholder implementation for what will ultimately be
- * code that indexes the specified content.
+ * Indexes the domain's article index into db, unless an article with the same
+ * title was indexed already.  Its well-formed words are taken from the content
+ * store if the article hasn't changed since the last run and snippets aren't
+ * kept, and are otherwise parsed out of its html, skipping the tags, and stored
+ * for next time.  The article's MinHash signature is built from the same words.
+ * If it nearly matches an article indexed before, it's counted as a copy of that
+ * one and its words aren't recorded; otherwise every word is recorded as an
+ * occurrance.  With snippets on, its visible text is kept as well.  The article's
+ * html is freed either way. 
  */
-
-static void ProcessArticle( article_t *article, search_db_t *db )
+static void ProcessArticle( domain_t *domain, int index, word_list_t *words, search_db_t *db )
 {
-  streamtokenizer *st = &article->mst.st;
-
-  HashSetEnter(&db->articles, article); // makes its own copy. 
+  mstreamtokenizer_t *html = *HtmlVectorNth(&domain->html, index);
+  streamtokenizer *st = &html->st;
+  const char *title = DocTitle(&domain->docs, index);
+
+  // Another domain may have carried the same title.  Like a repeat within a 
+  // domain, it's only indexed the first time. 
+  if (DocTableFind(&db->docs, title) >= 0) {
+    ReleaseArticleHtml(domain, index);
+    return;
+  }
+  // gives it an id in the db and copies its strings there. 
+  int doc_id = AddArticle(title, DocDesc(&domain->docs, index), DocUrl(&domain->docs, index), db);
 
-  int numWords = 0;
   char word[1024];
-  char longestWord[1024] = {'\0'};
+  long long start = TimingNow();
+  TraceBegin("tokenize and index");
+
+  // With snippets on, everything outside the markup is kept as the visible text, 
+  // with each run of whitespace squeezed down to a single space. 
+  char *visible_text = NULL;
+  size_t visible_length = 0;
+  FILE *visible = db->snippets != NULL ? open_memstream(&visible_text, &visible_length) : NULL;
+  bool after_space = true;
+
+  // The words are collected first and recorded afterwards, since whether they're 
+  // recorded at all depends on the signature of the whole article. 
+  minhash_builder_t signature_builder;
+  MinHashStart(&signature_builder);
+  words->length = 0;
+
+  // An article that hasn't changed since the last run has its words taken from the 
+  // content store.  They're only good for the words, though, not the snippets. 
+  const char *url = DocUrl(&domain->docs, index);
+  char *stored_words = NULL;
+  uint64_t content = 0;
+  int length;
+  if (content_store != NULL) {
+    content = ContentHash(html->buffer, html->length);
+    if (visible == NULL) stored_words = ContentStoreMatch(content_store, url, content, &length);
+  }
+  for (const char *stored = stored_words; stored != NULL && stored < stored_words + length; ) {
+    indexed_word_t indexed;
+    strcpy(indexed.word, stored);   // stored as they were listed, so already truncated
+    WordListAppend(words, &indexed);
+    MinHashAddWord(&signature_builder, indexed.word);
+    stored += strlen(stored) + 1;
+  }
 
-  while (STNextToken(st, word, sizeof(word))) {
+  while (stored_words == NULL && STNextToken(st, word, sizeof(word))) {
     if (strcasecmp(word, "<") == 0) {
       SkipIrrelevantContent(st); // in html-utls.h
+      if (visible != NULL && !after_space) fputc(' ', visible);
+      after_space = true;
     } 
     else {
+      if (visible != NULL) {
+        bool space = isspace((unsigned char)word[0]) || word[0] == '\b';
+        if (!space) fputs(word, visible);
+        else if (!after_space) fputc(' ', visible);
+        after_space = space;
+      }
       RemoveEscapeCharacters(word);
       if ( WordIsWellFormed(word)) {
-
-        RecordOccurrance(word, article, db);  // This is where we put it into the database. 
-        numWords++;
-        if (strlen(word) > strlen(longestWord))
-	        strcpy(longestWord, word);
+        // stop words would only pull every signature toward the same value. 
+        if (!IsStopWord(word, db)) {
+          indexed_word_t indexed;
+          strncpy(indexed.word, word, WORD_N_BYTES - 1);   // as RecordOccurrance would truncate it
+          indexed.word[WORD_N_BYTES - 1] = '\0';
+          WordListAppend(words, &indexed);
+          MinHashAddWord(&signature_builder, indexed.word);
+        }
       }
     }
   }
+  if (content_store != NULL && stored_words == NULL) {
+    char *list = NULL;
+    size_t list_length = 0;
+    FILE *out = open_memstream(&list, &list_length);
+    for (int i = 0; i < WordListLength(words); i++) {
+      const char *listed = WordListNth(words, i)->word;
+      fwrite(listed, 1, strlen(listed) + 1, out);
+    }
+    fclose(out);
+    ContentStorePut(content_store, url, content, list, list_length);
+    free(list);
+  }
+  free(stored_words);
+  start = TimingRecordSince(STAGE_TOKENIZE, start);
+
+  minhash_t signature;
+  int original = -1;
+  if (MinHashFinish(&signature_builder, &signature))
+    original = CollapseNearDuplicate(doc_id, &signature, db);
+
+  if (original < 0) {
+    for (int i = 0; i < WordListLength(words); i++)
+      RecordOccurrance(WordListNth(words, i)->word, doc_id, db);  // This is where we put it into the database. 
+    MetricsAdd(metrics.articles_indexed, 1);
+    MetricsAdd(metrics.words_indexed, WordListLength(words));
+  }
+  else MetricsAdd(metrics.near_duplicates, 1);
+  long long index_ns = TimingNow() - start;
+  TimingRecord(STAGE_INDEX, index_ns);
+  // Spans around every word would swamp the trace, so the indexing time rides along.
+  TraceEndWith("index_us", index_ns / 1000);
+
+  // a near duplicate's text is never shown, since it never turns up in results. 
+  if (visible != NULL) {
+    fclose(visible);
+    // escapes like "&amp;" are split across tokens, so they're decoded all at once here. 
+    RemoveEscapeCharacters(visible_text);
+    if (original < 0) AddSnippetText(doc_id, visible_text, strlen(visible_text), db);
+    free(visible_text);
+  }
 
-  char title_substring[81];
-  strncpy(title_substring, article->title, 80);
-  title_substring[80] = '\0';
-
-  //printf("    %s  Words: %d \n", title_substring, numWords);
+  ReleaseArticleHtml(domain, index);
 }
 
 /** 
@@ -572,7 +1291,8 @@ static void ProcessArticle( article_t *article, search_db_t *db )
  * ----------------------
  * Standard query loop that allows the user to specify a single search term, and
  * then proceeds (via ProcessResponse) to list up to 10 articles (sorted by relevance)
- * that contain that word.
+ * that contain that word.  The loop ends on an empty line or at the end of input, so
+ * a file of queries can be piped in.  ":stats" prints the timing histograms.
  */
 
 static void QueryIndices(search_db_t *db)
@@ -580,10 +1300,17 @@ static void QueryIndices(search_db_t *db)
   char response[1024];
   while (true) {
     printf("Please enter a single query term [enter to quit]: ");
-    fgets(response, sizeof(response), stdin);
-    response[strlen(response) - 1] = '\0';
+    if (fgets(response, sizeof(response), stdin) == NULL) break;   // EOF, e.g. queries piped in from a file
+    response[strcspn(response, "\r\n")] = '\0';
     if (strcasecmp(response, "") == 0) break;
+    if (strcasecmp(response, ":stats") == 0) {
+      TimingReport(stdout);
+      continue;
+    }
+    long long start = TimingNow();
     ProcessResponse(response, db);
+    TimingRecordSince(STAGE_QUERY, start);
+    MetricsAdd(metrics.queries, 1);
   }
 }
 
@@ -605,36 +1332,3 @@ static void ProcessResponse(const char *word, search_db_t *db)
     printf("\tWe won't be allowing words like \"%s\" into our set of indices.\n", word);
   }
 }
-
-/**
- * Predicate Function: WordIsWellFormed
- * ------------------------------------
- * Before we allow a word to be inserted into our map
- * of indices, we'd like to confirm that it's a good search term.
- * One could generalize this function to allow different criteria, but
- * this version hard codes the requirement that a word begin with 
- * a letter of the alphabet and that all letters are either letters, numbers,
- * or the '-' character.  
- */
-
-static bool WordIsWellFormed(const char *word)
-{
-  int i, k;
-  
-  if (strlen(word) == 0) return false;  // this was true.  Not sure why an empty string in considered well-formed. 
-
-  if (!isalpha((int) word[0])) return false;  // First character must be a letter.
-
-  
-  k = 0;
-  for (i = 1; i < strlen(word); i++)
-  {
-    // there must not be more than one hyphen. 
-    if (( word[i] == '-') && ++k > 1 ) return false;
-    // letters after the first must all be either letters, numbers, or hyphens. 
-    if (!isalnum((int) word[i]) && (word[i] != '-')) return false; 
-  }
-
-
-  return true;
-}
@@ -1,5 +1,11 @@
 
+#define _GNU_SOURCE   // for strcasestr
 #include "searchdb.h"
+#include "timing.h"
+#include "lock-stats.h"
+
+static void RankOccurrances(occurrance_list_t *word_p, search_db_t *db);
+static sem_t *RankLock(const occurrance_list_t *word_p, search_db_t *db);
 
 /** 
  * StringHash                     
@@ -26,84 +32,181 @@ int StringHash(const void *string, int numBuckets)
   return hashcode % numBuckets;                                
 }
 
-static int ArticleHash(const void *article_p, int numBuckets) {
-    char *key = ((article_t*)article_p)->title;   // keys on the article title (c string)
-    return StringHash(key, numBuckets);
+// Compare functions /////////////////
+
+int StringCompare(const void *a, const void*b) {
+  return strcasecmp( (const char*)a, (const char*)b );
 }
 
-static int WordHash( const void *article_list_p, int numBuckets) {
-  char *key = ((occurrance_list_t*)article_list_p)->word;    // keys on the word (c string)
-  return StringHash(key, numBuckets);
+// Document table /////////////////
+
+static void StringArenaNew(string_arena_t *arena) {
+  arena->chunks = NULL;
+  arena->n_chunks = arena->chunks_allocated = 0;
+  arena->chunk_used = STRING_ARENA_CHUNK_BYTES;   // so the first add opens a chunk
 }
 
-// Compare functions /////////////////
+static void StringArenaDispose(string_arena_t *arena) {
+  for (int i = 0; i < arena->n_chunks; i++)
+    MemFree(MEM_ARTICLES, arena->chunks[i], STRING_ARENA_CHUNK_BYTES);
+  MemFree(MEM_ARTICLES, arena->chunks, arena->chunks_allocated * sizeof(char*));
+  StringArenaNew(arena);
+}
 
-int StringCompare(const void *a, const void*b) {
-  return strcasecmp( (const char*)a, (const char*)b );
+static unsigned StringArenaAdd(string_arena_t *arena, const char *s) {
+  int length = strlen(s);
+  if (length > STRING_ARENA_CHUNK_BYTES - 1) length = STRING_ARENA_CHUNK_BYTES - 1;
+
+  if (arena->chunk_used + length + 1 > STRING_ARENA_CHUNK_BYTES) {
+    if (arena->n_chunks == arena->chunks_allocated) {
+      int allocated = arena->chunks_allocated > 0 ? 2 * arena->chunks_allocated : 4;
+      arena->chunks = MemRealloc(MEM_ARTICLES, arena->chunks, arena->chunks_allocated * sizeof(char*),
+                                 allocated * sizeof(char*));
+      arena->chunks_allocated = allocated;
+    }
+    assert(arena->n_chunks < 0x10000);
+    arena->chunks[arena->n_chunks++] = MemMalloc(MEM_ARTICLES, STRING_ARENA_CHUNK_BYTES);
+    arena->chunk_used = 0;
+  }
+  char *copy = arena->chunks[arena->n_chunks - 1] + arena->chunk_used;
+  memcpy(copy, s, length);
+  copy[length] = '\0';
+  unsigned offset = (unsigned)(arena->n_chunks - 1) << 16 | arena->chunk_used;
+  arena->chunk_used += length + 1;
+  return offset;
 }
 
-static int ArticleCompare(const void *article_a, const void *article_b ) {
-  // WE know the parameters are pointers to article_t structures.  re-cast them as such, and get the title field
-    char* a_key = ((article_t*)article_a)->title;
-    char* b_key = ((article_t*)article_b)->title;
-    return strcasecmp(a_key, b_key);
+void DocTableNew(doc_table_t *table) {
+  StringArenaNew(&table->strings);
+  DocVectorNew(&table->docs, 256);
+  DocTitleSetNew(&table->titles, 256);
 }
 
-static int WordCompare(const void *article_list_a, const void *article_list_b) {
-  // WE know the parameters are pointers to occurrance_list_t structures.  re-cast them as such, and get the word field.
-  char *a_key = ((occurrance_list_t*)article_list_a)->word;
-  char *b_key = ((occurrance_list_t*)article_list_b)->word;
-  return strcasecmp(a_key, b_key);
+void DocTableDispose(doc_table_t *table) {
+  DocTitleSetDispose(&table->titles);
+  DocVectorDispose(&table->docs);
+  StringArenaDispose(&table->strings);
 }
 
-// A pointer to this function will be stored in hashset internal variables.  It must be able to be called 
-// via it's function pointer, so it can not be inline. 
-static void ArticleListFreeFn( void * elem ) {
-  //First we re-hydrate the type
-  occurrance_list_t *article_list_p = (occurrance_list_t*)elem;
+int DocTableFind(const doc_table_t *table, const char *title) {
+  doc_title_t *found = DocTitleSetLookup(&table->titles, title);
+  return found != NULL ? found->doc : -1;
+}
 
-  // Note: the vector itself *could* have its own freefn defined, if we had passed it one in each call to VectorNEw. 
-  //  In this program, we did not because the occurrances aren't responsible for freeing the articles. 
-  VectorDispose(&article_list_p->occurrances);
+int DocTableAdd(doc_table_t *table, const char *title, const char *desc, const char *url) {
+  int id = DocTableFind(table, title);
+  if (id >= 0) return id;
+
+  doc_t doc;
+  doc.title = StringArenaAdd(&table->strings, title);
+  doc.desc = StringArenaAdd(&table->strings, desc);
+  doc.url = StringArenaAdd(&table->strings, url);
+  id = DocTableCount(table);
+  DocVectorAppend(&table->docs, &doc);
+
+  // the title set keys on the arena's copy, which stays put. 
+  doc_title_t entry = { StringArenaGet(&table->strings, doc.title), id };
+  DocTitleSetEnter(&table->titles, &entry);
+  return id;
 }
 
+// Database /////////////////
 
 void InitDatabase(search_db_t *db) {
-  HashSetNew(&db->stop_words, sizeof(char)*kkey_size, kstopword_buckets, StringHash, StringCompare, NULL);
-  HashSetNew(&db->articles, sizeof(article_t), karticle_buckets, ArticleHash, ArticleCompare, NULL );
-  HashSetNew( &db->words, sizeof(occurrance_list_t), kword_buckets, WordHash, WordCompare, ArticleListFreeFn);
+  StopWordSetNew(&db->stop_words, kstopword_buckets);
+  DocTableNew(&db->docs);
+  TermSetNew(&db->words, kword_buckets);
+  MinHashIndexNew(&db->signatures);
+  CopyCountVectorNew(&db->n_copies, 256);
+  db->n_near_duplicates = 0;
+
+  for (int i = 0; i < N_RANK_LOCKS; i++)
+    sem_init(&db->rank_locks[i], 0, 1);
+  db->n_terms_ranked = 0;
+  db->rank_ns = 0;
+  db->snippets = NULL;
 }
 
 void DisposeDatabase(search_db_t *db) {
-  HashSetDispose(&db->stop_words);
-  HashSetDispose(&db->articles);
-  HashSetDispose(&db->words);
+  // the occurrance vectors are the only memory the set's elements own.  The 
+  // occurrances only hold article ids; the document table owns the articles. 
+  for (int i = 0; i < TermSetCount(&db->words); i++)
+    OccurranceVectorDispose(&TermSetAt(&db->words, i)->occurrances);
+
+  StopWordSetDispose(&db->stop_words);
+  DocTableDispose(&db->docs);
+  TermSetDispose(&db->words);
+  MinHashIndexDispose(&db->signatures);
+  CopyCountVectorDispose(&db->n_copies);
+  for (int i = 0; i < N_RANK_LOCKS; i++)
+    sem_destroy(&db->rank_locks[i]);
+  if (db->snippets != NULL) {
+    DocStoreDispose(db->snippets);
+    free(db->snippets);
+    db->snippets = NULL;
+  }
 }
 
-void AddNewOccurrance( article_t *article_p, occurrance_list_t *word_p) {
-  occurrance_t new_occurrance;
-  new_occurrance.article_p = article_p; // set the address of the article
-  new_occurrance.count = 1;
-  VectorAppend(&word_p->occurrances, &new_occurrance );
+void AddStopWord(const char *word, search_db_t *db) {
+  stop_word_t stop_word;
+  strncpy(stop_word.word, word, kkey_size - 1);
+  stop_word.word[kkey_size - 1] = '\0';
+  StopWordSetEnter(&db->stop_words, &stop_word);
 }
 
+int AddArticle(const char *title, const char *desc, const char *url, search_db_t *db) {
+  assert(title[0] != '\0');
+  int id = DocTableAdd(&db->docs, title, desc, url);
+  if (id == CopyCountVectorLength(&db->n_copies)) {
+    int none = 0;
+    CopyCountVectorAppend(&db->n_copies, &none);
+  }
+  return id;
+}
 
+int CollapseNearDuplicate(int doc_id, const minhash_t *signature, search_db_t *db) {
+  int original = MinHashIndexFind(&db->signatures, signature);
+  if (original < 0) {
+    MinHashIndexAdd(&db->signatures, signature, doc_id);
+    return -1;
+  }
+  (*CopyCountVectorNth(&db->n_copies, original))++;
+  db->n_near_duplicates++;
+  return original;
+}
 
-// Returns either the index of an occurrance in the article_list whose pointer to 
-// an article address matches the pointer passed in. 
-// or returns NULL if there is no matching occurrance
-occurrance_t* MatchingOccurrance( article_t *article_p, occurrance_list_t *word_p)
-{
-  int n_occurrances = VectorLength(&word_p->occurrances);
-  if (n_occurrances == 0) return NULL;
+int NearDuplicateCount(int doc_id, search_db_t *db) {
+  return *CopyCountVectorNth(&db->n_copies, doc_id);
+}
 
-  occurrance_t *last_occurrance = VectorNth(&word_p->occurrances, n_occurrances-1);
+void KeepSnippets(search_db_t *db) {
+  db->snippets = malloc(sizeof(docstore_t));
+  DocStoreNew(db->snippets);
+}
+
+void AddSnippetText(int doc_id, const char *text, int length, search_db_t *db) {
+  if (db->snippets != NULL) DocStoreAdd(db->snippets, doc_id, text, length);
+}
+
+static inline void AddNewOccurrance(int doc_id, occurrance_list_t *word_p) {
+  occurrance_t new_occurrance;
+  new_occurrance.doc_id = doc_id;
+  new_occurrance.count = 1;
+  OccurranceVectorAppend(&word_p->occurrances, &new_occurrance );
+}
 
-  if (last_occurrance->article_p == article_p) return last_occurrance;
+// Returns the last occurrance in the word's list if it's for the same 
+// article, or NULL if there is no matching occurrance.  Articles are indexed
+// one at a time, so the last occurrance is the only one that can match. 
+static inline occurrance_t* MatchingOccurrance(int doc_id, occurrance_list_t *word_p)
+{
+  occurrance_t *last_occurrance = OccurranceVectorLast(&word_p->occurrances);
+
+  if (last_occurrance != NULL && last_occurrance->doc_id == doc_id) return last_occurrance;
   else return NULL; 
 }
 
-bool RecordOccurrance(char *word, article_t *article_in, search_db_t *db){
+bool RecordOccurrance(char *word, int doc_id, search_db_t *db){
 
   int word_length = strlen(word);
   assert(word_length > 0);
@@ -115,47 +218,36 @@ bool RecordOccurrance(char *word, article_t *article_in, search_db_t *db){
   if( (word_length + 1) > kkey_size )
     word[kkey_size-1] = '\0';
 
-  int title_length = strlen(article_in->title);
-  assert(title_length > 0);
-  assert(title_length < TITLE_N_BYTES);
+  assert(doc_id >= 0 && doc_id < DocTableCount(&db->docs));
 
   // Is Word in stop list? 
-  if (HashSetLookup(&db->stop_words, word) != NULL) return false;
-
-  // Find the address of the article *in the hashset* that matches article.
-  // We don't assume we're given a pointer to an article in the articles hashset, 
-  // But we do assume we're given a pointer to a valid article_t somewhere. 
-  article_t *article_p = HashSetLookup(&db->articles, article_in);
-  // Make sure the article was already in articles hashset.
-  assert(article_p != NULL);
+  if (StopWordSetLookup(&db->stop_words, word) != NULL) return false;
 
-    
-  occurrance_list_t *word_p = (occurrance_list_t*)HashSetLookup(&db->words, word);
+  occurrance_list_t *word_p = TermSetLookup(&db->words, word);
   occurrance_list_t new_word; 
  
   // if the word isn't present already, build and insert a new article_list. 
   if (word_p == NULL) {
     // build a new occurrance_list_t 
-    // the occurrances vector doesn't need a free function because it is not responsible
-    // for freeing the articles.  The articles hashset does that. 
-    VectorNew(&new_word.occurrances, sizeof(occurrance_t), NULL, 100);
+    OccurranceVectorNew(&new_word.occurrances, 4);
     strcpy(new_word.word, word); //everything is null-terminated, so we can use strcpy.
-    HashSetEnter(&db->words, &new_word); // this memcpy's the new_word.
-    // Now we need the location of the newly-minted word in the hashset. 
-    word_p = (occurrance_list_t*)HashSetLookup(&db->words, word);
+    new_word.ranked = false;
+    // this copies new_word, and hands back where the copy lives.  Elements of the
+    // term set never move, so that address stays good. 
+    word_p = TermSetEnter(&db->words, &new_word); 
 
     // we just added this word, so we know we don't have a matching article occurrance. 
-    AddNewOccurrance(article_p, word_p);
+    AddNewOccurrance(doc_id, word_p);
     return true;
   }
 
   // Let's search for a matching occurrance of this article-word.  
   // MatchingOccurrance returns either the pointer of an occurrance that maches or NULL. 
-  occurrance_t *match = MatchingOccurrance(article_p, word_p );
+  occurrance_t *match = MatchingOccurrance(doc_id, word_p);
 
   // If the last occurrance points to a different article, or if there are no occurrances, we append. 
   if ( match == NULL )
-    AddNewOccurrance(article_p, word_p);
+    AddNewOccurrance(doc_id, word_p);
   // If the last occurrance does match the article (we've seen this word in this article before)
   else 
     match->count++;
@@ -163,69 +255,277 @@ bool RecordOccurrance(char *word, article_t *article_in, search_db_t *db){
   return true;
 }
 
-static void PrintArticle( void *elem_addr, void *auxData) {
-  occurrance_t *occurrance = (occurrance_t*)elem_addr;
-  article_t *article = occurrance->article_p;
-  int *article_count = (int*)auxData;
-  
-  // article_count indicates how many we have already printed. 
-  // we can use this to stop printing after 10 articles. 
-  if (*article_count >= 10 ) return; 
+bool IsStopWord(const char *word, search_db_t *db) {
+  return StopWordSetLookup(&db->stop_words, word) != NULL;
+}
+
+occurrance_list_t *LookupWord(const char *word, search_db_t *db) {
+  return TermSetLookup(&db->words, word);
+}
+
+// True if text[position] starts a whole word rather than the middle of one.
+static bool StartsWord(const char *text, const char *position, int word_length) {
+  return (position == text || !isalnum((unsigned char)position[-1])) && !isalnum((unsigned char)position[word_length]);
+}
 
-  printf("\t%d.) \"%s\"\n", ++*article_count, article->title);
-  printf("\t    %s\n", article->url);
-  printf("\t    [search term occurred %d times]\n\n", occurrance->count);
+static const int kSnippetContext = 70;   // characters either side of the word
+
+// Prints the text around the first mention of word in the article.
+static void PrintSnippet(const char *word, int doc_id, search_db_t *db) {
+  int length, word_length = strlen(word);
+  char *text = DocStoreFetch(db->snippets, doc_id, &length);
+  if (text == NULL) return;
+
+  const char *found = text;
+  while ((found = strcasestr(found, word)) != NULL && !StartsWord(text, found, word_length)) found++;
+  if (found != NULL) {
+    const char *start = found - kSnippetContext > text ? found - kSnippetContext : text;
+    const char *end = found + word_length + kSnippetContext < text + length ? found + word_length + kSnippetContext : text + length;
+    // don't start or end partway through a word.
+    if (start > text) while (start < found && !isspace((unsigned char)*start)) start++;
+    if (end < text + length) while (end > found + word_length && !isspace((unsigned char)end[-1])) end--;
+    printf("\t    \"%s%.*s%s\"\n", start > text ? "..." : "", (int)(end - start), start, end < text + length ? "..." : "");
+  }
+  free(text);
 }
+
 /**
- * Searches the database for the word.  If it's found it lists all the articles containing that word
+ * Searches the database for the word.  If it's found it lists the top 10 articles containing that word
  */ 
 void PrintArticles( const char *word, search_db_t *db) {
+  occurrance_t top[10];
+  search_cursor_t next;
 
   // is it a stop-word? 
-  if (HashSetLookup(&db->stop_words, word) != NULL) {
+  if (IsStopWord(word, db)) {
     printf("That word is too common to produce a meaningful search.\n\n");
     return;
   }
   // find the word
   occurrance_list_t *word_p; 
-  word_p = HashSetLookup(&db->words, word);
+  word_p = LookupWord(word, db);
   
   if(word_p == NULL) {
     printf("None of today's articles mention that word.  Sorry.\n\n");
     return;
   }
 
-  int n_articles = VectorLength(&word_p->occurrances);
+  int n_articles = OccurranceVectorLength(&word_p->occurrances);
   printf("We found %d articles containing the word \"%s\".", n_articles, word);
   if (n_articles>10)
     printf("  Here are the top 10.\n\n");
   else 
     printf("\n\n");
   
-  // this is a counter passed as aux_data to PrintArticle to let PrintArticle keep track of how many it has printed. 
-  int articles_printed = 0;   
-  VectorMap(&word_p->occurrances, PrintArticle, &articles_printed);
+  int n_top = TopOccurrances(word_p, NULL, 10, top, &next, db);
+  for (int i = 0; i < n_top; i++) {
+    printf("\t%d.) \"%s\"\n", i + 1, DocTitle(&db->docs, top[i].doc_id));
+    printf("\t    %s\n", DocUrl(&db->docs, top[i].doc_id));
+    if (db->snippets != NULL) PrintSnippet(word, top[i].doc_id, db);
+    int n_copies = NearDuplicateCount(top[i].doc_id, db);
+    if (n_copies > 0) printf("\t    [%d near-duplicate cop%s not shown]\n", n_copies, n_copies == 1 ? "y" : "ies");
+    printf("\t    [search term occurred %d times]\n\n", top[i].count);
+  }
+}
 
+// Top-k selection /////////////////
+
+// True if occurrance a belongs ahead of b in search results: more mentions first, 
+// and the older article first among equals.  This is the order cursors are defined in. 
+static inline bool RanksAhead(int count_a, int id_a, int count_b, int id_b) {
+  return count_a > count_b || (count_a == count_b && id_a < id_b);
+}
+
+static inline bool OccurranceRanksAhead(const occurrance_t *a, const occurrance_t *b) {
+  return RanksAhead(a->count, a->doc_id, b->count, b->doc_id);
 }
 
-static int CompareOccurrances( const void *a, const void *b) {
-  occurrance_t *occurrance_a = (occurrance_t*)a;
-  occurrance_t *occurrance_b = (occurrance_t*)b;
-  return occurrance_b->count - occurrance_a->count;
+// heap[0] is the worst ranked of the entries kept so far, so a newcomer only 
+// has to beat the root to get in. 
+static void SiftDown(occurrance_t heap[], int n, int i) {
+  while (true) {
+    int worst = i, left = 2*i + 1, right = 2*i + 2;
+    if (left < n && OccurranceRanksAhead(&heap[worst], &heap[left])) worst = left;
+    if (right < n && OccurranceRanksAhead(&heap[worst], &heap[right])) worst = right;
+    if (worst == i) return;
+    occurrance_t tmp = heap[i];
+    heap[i] = heap[worst];
+    heap[worst] = tmp;
+    i = worst;
+  }
 }
 
-static void MappedSorter( void *elem_addr, void *aux_data) {
-  occurrance_list_t *article_list = (occurrance_list_t*)elem_addr;
-  VectorSort(&article_list->occurrances, CompareOccurrances );
+static void SiftUp(occurrance_t heap[], int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!OccurranceRanksAhead(&heap[parent], &heap[i])) return;
+    occurrance_t tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
 }
+
+int TopOccurrances(occurrance_list_t *word_p, const search_cursor_t *after, int k,
+                   occurrance_t results[], search_cursor_t *next, search_db_t *db) {
+  int n_postings = OccurranceVectorLength(&word_p->occurrances);
+  int n_kept = 0, n_eligible = 0;
+
+  // The first page comes straight off the heap.  Only a client that pages past it
+  // is likely to keep paging, so that's when the postings are worth sorting. 
+  if (after != NULL) RankOccurrances(word_p, db);
+  bool ranked = __atomic_load_n(&word_p->ranked, __ATOMIC_ACQUIRE);
+
+  // Postings that aren't ranked yet can be sorted in place by another thread's 
+  // paging query at any moment, so they're only scanned under the word's rank lock. 
+  sem_t *lock = NULL;
+  if (!ranked) {
+    lock = RankLock(word_p, db);
+    SemWait(lock);
+    ranked = word_p->ranked;
+  }
+
+  if (ranked) {
+    // Already in rank order: binary search for the first posting after the cursor
+    // and hand out the k that follow it. 
+    int start = 0, end = n_postings;
+    while (after != NULL && start < end) {
+      int mid = start + (end - start) / 2;
+      occurrance_t *occurrance = OccurranceVectorNth(&word_p->occurrances, mid);
+      if (RanksAhead(after->count, after->article_id, occurrance->count, occurrance->doc_id)) end = mid;
+      else start = mid + 1;
+    }
+    for (; n_kept < k && start + n_kept < n_postings; n_kept++)
+      results[n_kept] = *(occurrance_t*)OccurranceVectorNth(&word_p->occurrances, start + n_kept);
+    n_eligible = n_postings - start;
+  }
+
+  // results[] doubles as the heap while we scan. 
+  else for (int i = 0; i < n_postings && k > 0; i++) {
+    occurrance_t *occurrance = OccurranceVectorNth(&word_p->occurrances, i);
+
+    // skip everything that was already handed out on earlier pages. 
+    if (after != NULL && !RanksAhead(after->count, after->article_id, occurrance->count, occurrance->doc_id))
+      continue;
+    n_eligible++;
+
+    if (n_kept < k) {
+      results[n_kept] = *occurrance;
+      SiftUp(results, n_kept++);
+    }
+    // cheap reject on count alone before the full comparison with the tie breaker. 
+    else if (occurrance->count >= results[0].count && OccurranceRanksAhead(occurrance, &results[0])) {
+      results[0] = *occurrance;
+      SiftDown(results, n_kept, 0);
+    }
+  }
+  if (lock != NULL) sem_post(lock);
+
+  // Pop the heap from the back, which leaves results[] best first.  A slice of 
+  // ranked postings is already in order, and popping it would scramble it. 
+  for (int n = n_kept - 1; n > 0 && !ranked; n--) {
+    occurrance_t tmp = results[0];
+    results[0] = results[n];
+    results[n] = tmp;
+    SiftDown(results, n, 0);
+  }
+
+  if (n_eligible > n_kept) {
+    next->count = results[n_kept - 1].count;
+    next->article_id = results[n_kept - 1].doc_id;
+  } 
+  else {
+    next->count = -1;
+    next->article_id = 0;
+  }
+  return n_kept;
+}
+
+void SearchCursorFormat(const search_cursor_t *cursor, char buffer[SEARCH_CURSOR_N_BYTES]) {
+  unsigned long long packed = ((unsigned long long)(unsigned)cursor->count << 32) | (unsigned)cursor->article_id;
+  sprintf(buffer, "%016llx", packed);
+}
+
+bool SearchCursorParse(const char *text, search_cursor_t *cursor) {
+  char *end;
+  if (strlen(text) != SEARCH_CURSOR_N_BYTES - 1) return false;
+  unsigned long long packed = strtoull(text, &end, 16);
+  if (*end != '\0') return false;
+  cursor->count = (int)(packed >> 32);
+  cursor->article_id = (int)(packed & 0xffffffffu);
+  return true;
+}
+
+// Ranking /////////////////
+
+DECLARE_TYPED_VECTOR_SORT(occurrance_vector_t, OccurranceVector, occurrance_t, OccurranceRanksAhead)
+
+static sem_t *RankLock(const occurrance_list_t *word_p, search_db_t *db) {
+  return &db->rank_locks[StringHash(word_p->word, N_RANK_LOCKS)];
+}
+
+// Sorts the word's postings the first time anyone pages through them.  The unlocked check
+// is the fast path; the flag is only set (with release semantics) after the sort 
+// finishes, so a reader that sees it set also sees the sorted vector.  A reader that 
+// doesn't see it set takes the same lock before looking at the postings. 
+static void RankOccurrances(occurrance_list_t *word_p, search_db_t *db) {
+  if (__atomic_load_n(&word_p->ranked, __ATOMIC_ACQUIRE)) return;
+
+  sem_t *lock = RankLock(word_p, db);
+  SemWait(lock);
+  if (!word_p->ranked) {     // somebody else may have beaten us to it. 
+    long long start = TimingNow();
+    OccurranceVectorSort(&word_p->occurrances);
+    long long ns = TimingNow() - start;
+    TimingRecord(STAGE_SORT, ns);
+    __atomic_fetch_add(&db->rank_ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&db->n_terms_ranked, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&word_p->ranked, true, __ATOMIC_RELEASE);
+  }
+  sem_post(lock);
+}
+
 void SortOccurrances(search_db_t *db) {
-  HashSetMap(&db->words, MappedSorter, NULL);
+  for (int i = 0; i < TermSetCount(&db->words); i++)
+    RankOccurrances(TermSetAt(&db->words, i), db);
 }
 
-/*I don't think we need this. 
-int AddressCompare(void *elemAddr1, void *elemAddr2 ) {
-  occurrance_t *occurrance_p1 = (occurrance_t*)elemAddr1;
-  occurrance_t *occurrance_p2 = (occurrance_t*)elemAddr2;
-  // we're subtracting to see if the pointers are the same (point to the same location)
-  return occurrance_p1->article_p - occurrance_p2->article_p;
-} */
\ No newline at end of file
+void ReportRankingStats(search_db_t *db) {
+  int n_ranked = __atomic_load_n(&db->n_terms_ranked, __ATOMIC_RELAXED);
+  long long ns = __atomic_load_n(&db->rank_ns, __ATOMIC_RELAXED);
+  printf("Ranked the postings of %d of %d words in %.3f ms.\n", 
+         n_ranked, TermSetCount(&db->words), ns / 1e6);
+}
+
+/**
+ * Predicate Function: WordIsWellFormed
+ * ------------------------------------
+ * Before we allow a word to be inserted into our map
+ * of indices, we'd like to confirm that it's a good search term.
+ * One could generalize this function to allow different criteria, but
+ * this version hard codes the requirement that a word begin with 
+ * a letter of the alphabet and that all letters are either letters, numbers,
+ * or the '-' character.  
+ */
+
+bool WordIsWellFormed(const char *word)
+{
+  int i, k;
+  
+  if (strlen(word) == 0) return false;  // this was true.  Not sure why an empty string in considered well-formed. 
+
+  if (!isalpha((int) word[0])) return false;  // First character must be a letter.
+
+  
+  k = 0;
+  for (i = 1; i < strlen(word); i++)
+  {
+    // there must not be more than one hyphen. 
+    if (( word[i] == '-') && ++k > 1 ) return false;
+    // letters after the first must all be either letters, numbers, or hyphens. 
+    if (!isalnum((int) word[i]) && (word[i] != '-')) return false; 
+  }
+
+
+  return true;
+}
@@ -8,9 +8,14 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <assert.h>
+#include <semaphore.h>
 #include "hashset.h"
 #include "vector.h"
+#include "typed-vector.h"
+#include "typed-hashset.h"
 #include "mstreamtokenizer.h"
+#include "docstore.h"
+#include "minhash.h"
 
 
 //#include <ctype.h>
@@ -18,33 +23,159 @@
 #define WORD_N_BYTES 32
 #define TITLE_N_BYTES 512
 
+#define DESC_N_BYTES 1024
+#define URL_N_BYTES 2048
+
 typedef struct {
-  char title[TITLE_N_BYTES];
-  char desc[1024];
-  char url[2048];
-  mstreamtokenizer_t mst;
-} article_t;
+  int count; 
+  int doc_id;   // the article's index in db->docs.  Breaks ties between equally ranked articles. 
+} occurrance_t; 
+
+DECLARE_TYPED_VECTOR_TAGGED(occurrance_vector_t, OccurranceVector, occurrance_t, MEM_POSTINGS)
 
 typedef struct {
   char word[WORD_N_BYTES];
-  vector occurrances; 
+  occurrance_vector_t occurrances; 
+  int ranked;   // set once occurrances is sorted best first.  Read and written atomically. 
 } occurrance_list_t;
 
 typedef struct {
-  int count; 
-  article_t *article_p; 
-} occurrance_t; 
+  char word[WORD_N_BYTES];
+} stop_word_t;
+
+/**
+ * StringHashCode
+ * --------------
+ * The same case-insensitive linear congruence as StringHash, but returning the 
+ * whole code (the typed hashsets pick their own slot) after a final avalanche 
+ * step, since the low bits of a plain linear congruence are poorly mixed and 
+ * those are exactly the bits a power-of-two table looks at. 
+ */
+static inline unsigned StringHashCode(const char *s) {
+  unsigned hashcode = 0;
+  for (; *s != '\0'; s++)
+    hashcode = hashcode * 2630849305u + tolower((unsigned char)*s);
+  hashcode ^= hashcode >> 16;
+  hashcode *= 0x85ebca6bu;
+  hashcode ^= hashcode >> 13;
+  return hashcode;
+}
+
+static inline bool StringsMatch(const char *a, const char *b) {
+  return strcasecmp(a, b) == 0;
+}
+
+#define WORD_KEY(elem) ((elem)->word)
+#define TITLE_KEY(elem) ((elem)->title)
+
+DECLARE_TYPED_HASHSET_TAGGED(term_set_t, TermSet, occurrance_list_t, const char *, WORD_KEY, StringHashCode, StringsMatch, MEM_TERMS)
+DECLARE_TYPED_HASHSET_TAGGED(stop_word_set_t, StopWordSet, stop_word_t, const char *, WORD_KEY, StringHashCode, StringsMatch, MEM_STOP_WORDS)
+
+// Document table /////////////////
+
+// Strings packed end to end into chunks of STRING_ARENA_CHUNK_BYTES.  A string never
+// spans two chunks and chunks never move, so a string's address is good for the
+// life of the arena.  Strings are named by a 32-bit offset: the chunk in the high
+// half, the position within it in the low half. 
+#define STRING_ARENA_CHUNK_BYTES (64 * 1024)
+
+typedef struct {
+  char **chunks;
+  int n_chunks, chunks_allocated;
+  int chunk_used;   // bytes taken in the last chunk
+} string_arena_t;
+
+static inline const char *StringArenaGet(const string_arena_t *arena, unsigned offset) {
+  return arena->chunks[offset >> 16] + (offset & 0xffff);
+}
 
+// What the table keeps per article: where its strings are in the arena. 
 typedef struct {
-  hashset stop_words; 
-  hashset articles;
-  hashset words;
+  unsigned title, desc, url;
+} doc_t;
+
+typedef struct {
+  const char *title;   // points into the arena
+  int doc;
+} doc_title_t;
+
+DECLARE_TYPED_VECTOR_TAGGED(doc_vector_t, DocVector, doc_t, MEM_ARTICLES)
+DECLARE_TYPED_HASHSET_TAGGED(doc_title_set_t, DocTitleSet, doc_title_t, const char *, TITLE_KEY, StringHashCode, StringsMatch, MEM_ARTICLES)
+
+// Articles, numbered from 0 in the order they were added, with at most one per 
+// title (compared case-insensitively, like words). 
+typedef struct {
+  string_arena_t strings;
+  doc_vector_t docs;
+  doc_title_set_t titles;
+} doc_table_t;
+
+void DocTableNew(doc_table_t *table);
+void DocTableDispose(doc_table_t *table);
+
+// Returns the id of the article titled title, or -1 if there isn't one. 
+int DocTableFind(const doc_table_t *table, const char *title);
+
+/**
+ * Copies the three strings into the table and returns the new article's id.  If
+ * an article with the same title is already there, it's left alone and its id is
+ * returned instead.  Strings longer than STRING_ARENA_CHUNK_BYTES - 1 are cut short. 
+ */
+int DocTableAdd(doc_table_t *table, const char *title, const char *desc, const char *url);
+
+static inline int DocTableCount(const doc_table_t *table) {
+  return DocVectorLength(&table->docs);
+}
+
+static inline const char *DocTitle(const doc_table_t *table, int id) {
+  return StringArenaGet(&table->strings, DocVectorNth(&table->docs, id)->title);
+}
+
+static inline const char *DocDesc(const doc_table_t *table, int id) {
+  return StringArenaGet(&table->strings, DocVectorNth(&table->docs, id)->desc);
+}
+
+static inline const char *DocUrl(const doc_table_t *table, int id) {
+  return StringArenaGet(&table->strings, DocVectorNth(&table->docs, id)->url);
+}
+
+DECLARE_TYPED_VECTOR_TAGGED(copy_count_vector_t, CopyCountVector, int, MEM_ARTICLES)
+
+#define N_RANK_LOCKS 16
+
+typedef struct {
+  stop_word_set_t stop_words; 
+  doc_table_t docs;       // every article indexed; occurrances refer to them by id
+  term_set_t words;
+
+  // An article that nearly matches one indexed before it isn't indexed itself;
+  // it's counted as a copy of the earlier one instead. 
+  minhash_index_t signatures;   // of the articles that were indexed
+  copy_count_vector_t n_copies; // by doc id
+  int n_near_duplicates;
+
+  // Postings are ranked the first time someone pages past their top results.  Words are spread
+  // over a few locks so concurrent lookups of different words don't queue up. 
+  sem_t rank_locks[N_RANK_LOCKS];
+  int n_terms_ranked;
+  long long rank_ns;      // total time spent sorting postings
+
+  docstore_t *snippets;   // each article's visible text, or NULL if it isn't kept
 } search_db_t; 
 
+// Marks where a page of search results left off.  Results are ranked by count
+// (highest first) and then by article id, so (count, id) of the last result 
+// handed out pins down exactly where the next page starts. 
+typedef struct {
+  int count;
+  int article_id;
+} search_cursor_t;
+
+#define SEARCH_CURSOR_N_BYTES 17   // 16 hex digits + '\0' 
+
 char *strcpy(char *dest, const char *src);  // in string.h
 
 static const int kstopword_buckets = 4001;
-static const int karticle_buckets = 997;
 static const int kword_buckets = 10007;  //100_003
 static const int kkey_size = 32;
 
@@ -53,14 +184,29 @@ int StringHash(const void *string, int numBuckets);
 int StringCompare(const void *a, const void*b);
 
 /**
- * Initializes all three hashsets in the db, hooking them up with the 
- * correct HashFunctions, CompareFunctions and FreeFunctions.  
+ * Initializes the stop list, the document table and the word set in the db.  
 */
 void InitDatabase(search_db_t *db);
 
 // Torches all of it. 
 void DisposeDatabase(search_db_t *db);
 
+// Adds a word to the stop list.  Words longer than kkey_size - 1 characters are truncated. 
+void AddStopWord(const char *word, search_db_t *db);
+
+/**
+ * Adds the article to db->docs (see DocTableAdd) and returns its id.  Its words
+ * can be recorded with RecordOccurrance from then on. 
+ */
+int AddArticle(const char *title, const char *desc, const char *url, search_db_t *db);
+
+// Keeps each article's visible text from here on, so search results can quote it.
+void KeepSnippets(search_db_t *db);
+
+// Stores the visible text of an article already added with AddArticle.  Does
+// nothing unless KeepSnippets was called.
+void AddSnippetText(int doc_id, const char *text, int length, search_db_t *db);
+
 /**
  * Checks if the word is present in the words hashset.  
  * If word is already present, it does nothing and returns the address of the 
@@ -71,11 +217,22 @@ void DisposeDatabase(search_db_t *db);
  */
 occurrance_list_t* AddWordIfAbsent(char *word);
 
+/**
+ * Looks for an article indexed before doc_id whose text nearly matches doc_id's,
+ * going by their MinHash signatures.  If there is one, doc_id is counted as a copy
+ * of it and its id is returned, and doc_id's words shouldn't be recorded.  If not,
+ * doc_id's signature is kept for later articles to be compared with, and -1 is
+ * returned. 
+ */
+int CollapseNearDuplicate(int doc_id, const minhash_t *signature, search_db_t *db);
+
+// The number of near duplicates of doc_id that were collapsed into it. 
+int NearDuplicateCount(int doc_id, search_db_t *db);
+
 /**
  * RecordOccurrance
  * Records the occurrance of a meaningful word in a word-index database.
- * Aassumes an article is present in articles hashset that matches the 
- * article parameter.
+ * doc_id is the id AddArticle handed back for the article. 
  * 
  * Checks if the word matchs a stopword.  If it does, RecordOccurrance
  * will return false without making any changes to the database.
@@ -85,24 +242,77 @@ occurrance_list_t* AddWordIfAbsent(char *word);
  * Looks at the last element of the occurrances vector for this word. 
  * (Each unique word has an occurrances vector associated with it)
  * 
- * If the last occurrance in occurrances vector points to an article_t that 
- * matches the article parameter, then RecordOccurrance increments 
- * the occurrance count. 
+ * If the last occurrance in occurrances vector is for the same doc_id, then
+ * RecordOccurrance increments the occurrance count. 
  * 
- * If the last occurrance ponts to a different article, RecordOccurrances
+ * If the last occurrance is for a different article, RecordOccurrances
  * will build a new occurrance_t which will have its occurrance count = 1
  * and append the new occurrance to the occurrances vector.
  * 
  * Returns false if word is a stopword. Otherwise, returns true. 
  * 
  * Asserts: 
- * - the article is already present in the articles database.
+ * - doc_id is an article in db->docs.
  * - the word is at least 1 character long. 
  */
-bool RecordOccurrance(char *word, article_t *article_in, search_db_t *db);
+bool RecordOccurrance(char *word, int doc_id, search_db_t *db);
 
+/**
+ * Eagerly ranks the postings of every word in the database.  This isn't needed
+ * for correctness -- TopOccurrances ranks a word's postings the first time a 
+ * cursor pages past its first page -- but it moves all of that work up front.
+ */
 void SortOccurrances(search_db_t *db);
 
+// Prints how many words have had their postings ranked so far, and how long it took. 
+void ReportRankingStats(search_db_t *db);
+
+/**
+ * Predicate Function: WordIsWellFormed
+ * Returns true if word is something we'd index or search for: it starts with a
+ * letter and holds only letters, digits and at most one hyphen. 
+ */
+bool WordIsWellFormed(const char *word);
+
+// True if word is in the stop list. 
+bool IsStopWord(const char *word, search_db_t *db);
+
+/**
+ * Returns the address of the occurrance_list_t for word inside db->words, or NULL 
+ * if no article mentions it.  The postings come back in whatever order they were
+ * recorded; use TopOccurrances to read them best first. 
+ */
+occurrance_list_t *LookupWord(const char *word, search_db_t *db);
+
+// Prints the top 10 articles for word, each with a snippet of its text around the
+// word if snippets are kept.
 void PrintArticles( const char *word, search_db_t *db);
 
+/**
+ * Function: TopOccurrances
+ * ------------------------
+ * Copies the (at most) k best ranked occurrances of a word into results[], best first. 
+ * If after is non-NULL, only occurrances ranked strictly below the cursor are 
+ * considered, so passing back the cursor from one call fetches the following page.
+ * 
+ * The first page (after == NULL) of a word whose postings haven't been ranked is
+ * found with one scan and a bounded min-heap of k entries, so it costs O(n log k). 
+ * Asking for any later page sorts the word's postings best first, once per word
+ * and under a lock, and from then on every page is just a slice found by binary
+ * search.  Until then the scan holds the same lock, so it never sees the postings
+ * mid-sort.  Once BuildIndices has returned any number of threads may call this 
+ * concurrently. 
+ * 
+ * Returns the number of results.  *next is set to the cursor for the following page;
+ * if there's nothing left after this page, next->count is -1. 
+ */
+int TopOccurrances(occurrance_list_t *word_p, const search_cursor_t *after, int k,
+                   occurrance_t results[], search_cursor_t *next, search_db_t *db);
+
+// Cursors travel to clients as an opaque string of SEARCH_CURSOR_N_BYTES - 1 hex digits. 
+void SearchCursorFormat(const search_cursor_t *cursor, char buffer[SEARCH_CURSOR_N_BYTES]);
+
+// Returns false (leaving *cursor alone) if text isn't something SearchCursorFormat produced. 
+bool SearchCursorParse(const char *text, search_cursor_t *cursor);
+
 #endif  // __SEARCHDB_
\ No newline at end of file
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "streamtokenizer.h"
+
+// strchr would happily find the terminating '\0' of the set, so a NUL byte in
+// the stream has to be ruled out explicitly.
+static inline bool IsMember(int c, const char *set)
+{
+  return c != '\0' && strchr(set, c) != NULL;
+}
+
+void STNew(streamtokenizer *st, FILE *infile, const char *delimiters, bool discardDelimiters)
+{
+  assert(infile != NULL);
+  assert(delimiters != NULL && delimiters[0] != '\0');
+  st->infile = infile;
+  st->delimiters = strdup(delimiters);
+  assert(st->delimiters != NULL);
+  st->discardDelimiters = discardDelimiters;
+}
+
+void STDispose(streamtokenizer *st)
+{
+  free((char*)st->delimiters);
+  st->delimiters = NULL;
+}
+
+bool STNextTokenUsingDifferentDelimiters(streamtokenizer *st, char buffer[], int bufferLength,
+                                         const char *delimiters)
+{
+  assert(buffer != NULL);
+  assert(bufferLength >= 2);
+  assert(delimiters != NULL);
+
+  int c;
+  while ((c = getc(st->infile)) != EOF && IsMember(c, delimiters)) {
+    if (!st->discardDelimiters) {
+      buffer[0] = c;
+      buffer[1] = '\0';
+      return true;
+    }
+  }
+  if (c == EOF) return false;
+
+  // c starts the token.  Anything that doesn't fit is left for the next call.
+  int length = 0;
+  buffer[length++] = c;
+  while (length < bufferLength - 1 && (c = getc(st->infile)) != EOF) {
+    if (IsMember(c, delimiters)) {
+      ungetc(c, st->infile);
+      break;
+    }
+    buffer[length++] = c;
+  }
+  buffer[length] = '\0';
+  return true;
+}
+
+bool STNextToken(streamtokenizer *st, char buffer[], int bufferLength)
+{
+  return STNextTokenUsingDifferentDelimiters(st, buffer, bufferLength, st->delimiters);
+}
+
+int STSkipOver(streamtokenizer *st, const char *skipSet)
+{
+  assert(skipSet != NULL);
+  int c;
+  while ((c = getc(st->infile)) != EOF && IsMember(c, skipSet)) ;
+  if (c != EOF) ungetc(c, st->infile);
+  return c;
+}
+
+int STSkipUntil(streamtokenizer *st, const char *skipUntilSet)
+{
+  assert(skipUntilSet != NULL);
+  int c;
+  while ((c = getc(st->infile)) != EOF && !IsMember(c, skipUntilSet)) ;
+  if (c != EOF) ungetc(c, st->infile);
+  return c;
+}
@@ -0,0 +1,115 @@
+#include <time.h>
+#include "timing.h"
+
+#define N_BUCKETS TIMING_N_BUCKETS
+
+typedef struct {
+  long long counts[N_BUCKETS];
+  long long total_ns;
+  long long max_ns;
+} histogram_t;
+
+static histogram_t histograms[N_STAGES];
+
+static const char *const kStageNames[N_STAGES] = {
+  "feed_fetch", "feed_parse", "article_fetch", "decode", "tokenize", "index", "sort", "query",
+};
+
+long long TimingNow(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static int BucketOf(long long ns) {
+  return ns <= 0 ? 0 : 64 - __builtin_clzll((unsigned long long)ns);
+}
+
+void TimingRecord(timing_stage_t stage, long long ns) {
+  histogram_t *h = &histograms[stage];
+  if (ns < 0) ns = 0;
+  __atomic_fetch_add(&h->counts[BucketOf(ns)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->total_ns, ns, __ATOMIC_RELAXED);
+
+  long long max = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&h->max_ns, &max, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+long long TimingRecordSince(timing_stage_t stage, long long start) {
+  long long now = TimingNow();
+  TimingRecord(stage, now - start);
+  return now;
+}
+
+long long TimingSnapshot(timing_stage_t stage, long long counts[TIMING_N_BUCKETS], long long *total_ns) {
+  const histogram_t *h = &histograms[stage];
+  long long n_samples = 0;
+  for (int b = 0; b < N_BUCKETS; b++) {
+    counts[b] = __atomic_load_n(&h->counts[b], __ATOMIC_RELAXED);
+    n_samples += counts[b];
+  }
+  *total_ns = __atomic_load_n(&h->total_ns, __ATOMIC_RELAXED);
+  return n_samples;
+}
+
+const char *TimingStageName(timing_stage_t stage) {
+  return kStageNames[stage];
+}
+
+// The value below which fraction of the samples fall, assuming samples are spread
+// evenly through their bucket.  Never more than the largest sample seen.
+static double Percentile(const histogram_t *h, const long long counts[], long long n_samples, double fraction) {
+  double rank = fraction * n_samples, seen = 0;
+  // read atomically, since download threads may be recording as the crawl asks. 
+  long long max_ns = __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED);
+  for (int b = 0; b < N_BUCKETS; b++) {
+    if (counts[b] == 0) continue;
+    if (seen + counts[b] >= rank) {
+      double low = (b == 0) ? 0 : (double)(1ULL << (b - 1)), high = (b == 0) ? 0 : low * 2;
+      double value = low + (high - low) * (rank - seen) / counts[b];
+      return value < max_ns ? value : max_ns;
+    }
+    seen += counts[b];
+  }
+  return max_ns;
+}
+
+long long TimingPercentile(timing_stage_t stage, double fraction) {
+  long long counts[N_BUCKETS], total_ns;
+  long long n_samples = TimingSnapshot(stage, counts, &total_ns);
+  return n_samples == 0 ? 0 : (long long)Percentile(&histograms[stage], counts, n_samples, fraction);
+}
+
+// Picks a unit that keeps ns readable.
+static void FormatNs(double ns, char text[16]) {
+  if (ns < 1e3) snprintf(text, 16, "%.0fns", ns);
+  else if (ns < 1e6) snprintf(text, 16, "%.1fus", ns / 1e3);
+  else if (ns < 1e9) snprintf(text, 16, "%.1fms", ns / 1e6);
+  else snprintf(text, 16, "%.2fs", ns / 1e9);
+}
+
+void TimingReport(FILE *out) {
+  fprintf(out, "%-14s %8s %10s %10s %10s %10s %10s %10s\n",
+          "stage", "count", "total", "mean", "p50", "p90", "p99", "max");
+  for (int stage = 0; stage < N_STAGES; stage++) {
+    const histogram_t *h = &histograms[stage];
+    long long counts[N_BUCKETS], total_ns;
+
+    // Other threads may still be recording, so work from one copy of the counts.
+    long long n_samples = TimingSnapshot(stage, counts, &total_ns);
+    if (n_samples == 0) continue;
+
+    double total = total_ns;
+    double values[6] = { total, total / n_samples, Percentile(h, counts, n_samples, 0.50),
+                         Percentile(h, counts, n_samples, 0.90), Percentile(h, counts, n_samples, 0.99),
+                         __atomic_load_n(&h->max_ns, __ATOMIC_RELAXED) };
+    fprintf(out, "%-14s %8lld", kStageNames[stage], n_samples);
+    for (int i = 0; i < 6; i++) {
+      char text[16];
+      FormatNs(values[i], text);
+      fprintf(out, " %10s", text);
+    }
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,54 @@
+
+#ifndef __TIMING_
+#define __TIMING_
+
+#include <stdio.h>
+
+// Latency histograms for each stage of building and searching the index.  Every
+// sample lands in a power-of-two bucket of nanoseconds, so a histogram is a fixed
+// 64 counters no matter how many samples it takes, and any thread can record into
+// it without a lock.  Percentiles are interpolated within their bucket, so they're
+// good to within a factor of two and usually much better.
+
+typedef enum {
+  STAGE_FEED_FETCH,      // fetching one rss feed
+  STAGE_FEED_PARSE,      // pulling the items out of one feed
+  STAGE_ARTICLE_FETCH,   // fetching one article
+  STAGE_DECODE,          // inflating one compressed feed or article, part of its fetch
+  STAGE_TOKENIZE,        // scanning one article for words, less the time spent indexing them
+  STAGE_INDEX,           // recording one article's words in the db
+  STAGE_SORT,            // ranking one word's postings
+  STAGE_QUERY,           // answering one query
+  N_STAGES
+} timing_stage_t;
+
+// Bucket 0 holds samples of 0 ns; bucket b > 0 holds samples in [2^(b-1), 2^b).
+#define TIMING_N_BUCKETS 64
+
+// Nanoseconds on the monotonic clock.  Only differences mean anything.
+long long TimingNow(void);
+
+// Adds one sample of ns nanoseconds to stage's histogram.  Safe from any thread.
+void TimingRecord(timing_stage_t stage, long long ns);
+
+// Records the time since start (a TimingNow reading) and returns the current time,
+// so back to back stages can share a reading.
+long long TimingRecordSince(timing_stage_t stage, long long start);
+
+// Copies stage's bucket counts into counts and its summed time into *total_ns,
+// and returns the number of samples.  Other threads may keep recording meanwhile,
+// so total_ns can be a sample or two ahead of the counts.
+long long TimingSnapshot(timing_stage_t stage, long long counts[TIMING_N_BUCKETS], long long *total_ns);
+
+// The value below which fraction of stage's samples fall, in nanoseconds, or 0 if
+// it has none.  Safe from any thread, as TimingSnapshot is.
+long long TimingPercentile(timing_stage_t stage, double fraction);
+
+// A short name for stage, fit to be a metric label.
+const char *TimingStageName(timing_stage_t stage);
+
+// Prints count, total, mean, p50, p90, p99 and max of every stage that has samples,
+// one line each.
+void TimingReport(FILE *out);
+
+#endif // __TIMING_
@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "trace.h"
+#include "timing.h"
+
+#define RING_N_EVENTS (1 << 14)
+
+typedef struct {
+  long long ts_ns;
+  const char *name;       // NULL for an end event
+  const char *arg_name;   // only ever set on end events
+  long long arg;
+} trace_event_t;
+
+typedef struct trace_ring {
+  trace_event_t events[RING_N_EVENTS];
+  long long n_recorded;   // events[n_recorded % RING_N_EVENTS] is written next
+  int tid;
+  const char *thread_name;
+  struct trace_ring *next;
+} trace_ring_t;
+
+static bool enabled = false;
+static const char *trace_path = NULL;
+static long long start_ns;
+static trace_ring_t *rings = NULL;   // every thread's ring, newest first
+static int n_rings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_ring_t *ring = NULL;
+
+void TraceOpen(const char *path) {
+  trace_path = path;
+  start_ns = TimingNow();
+  __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+}
+
+// The calling thread's ring, allocated the first time the thread records.
+static trace_ring_t *ThisRing(void) {
+  if (ring != NULL) return ring;
+  ring = malloc(sizeof(trace_ring_t));
+  ring->n_recorded = 0;
+  ring->thread_name = NULL;
+  pthread_mutex_lock(&rings_lock);
+  ring->tid = ++n_rings;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  return ring;
+}
+
+static void Record(const char *name, const char *arg_name, long long arg) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+  trace_ring_t *r = ThisRing();
+  trace_event_t *event = &r->events[r->n_recorded++ % RING_N_EVENTS];
+  event->ts_ns = TimingNow();
+  event->name = name;
+  event->arg_name = arg_name;
+  event->arg = arg;
+}
+
+void TraceNameThread(const char *name) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return;
+  ThisRing()->thread_name = name;
+}
+
+void TraceBegin(const char *name) {
+  Record(name, NULL, 0);
+}
+
+void TraceEnd(void) {
+  Record(NULL, NULL, 0);
+}
+
+void TraceEndWith(const char *arg_name, long long value) {
+  Record(NULL, arg_name, value);
+}
+
+// Writes one thread's events oldest first.  Once a ring has wrapped, its oldest
+// events may be the ends of spans whose beginnings were overwritten, so ends with
+// no open span are dropped.
+static void WriteRing(FILE *out, const trace_ring_t *r, bool *first) {
+  long long oldest = r->n_recorded > RING_N_EVENTS ? r->n_recorded - RING_N_EVENTS : 0;
+  int depth = 0;
+
+  fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"",
+          *first ? "" : ",", r->tid);
+  if (r->thread_name != NULL) fprintf(out, "%s\"}}", r->thread_name);
+  else fprintf(out, "thread %d\"}}", r->tid);
+  *first = false;
+
+  for (long long i = oldest; i < r->n_recorded; i++) {
+    const trace_event_t *event = &r->events[i % RING_N_EVENTS];
+    double ts = (event->ts_ns - start_ns) / 1e3;   // microseconds
+    if (event->name != NULL) {
+      depth++;
+      fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"pid\":1,\"tid\":%d,\"ts\":%.3f}", event->name, r->tid, ts);
+    }
+    else if (depth > 0) {
+      depth--;
+      fprintf(out, ",\n{\"ph\":\"E\",\"pid\":1,\"tid\":%d,\"ts\":%.3f", r->tid, ts);
+      if (event->arg_name != NULL) fprintf(out, ",\"args\":{\"%s\":%lld}", event->arg_name, event->arg);
+      fprintf(out, "}");
+    }
+  }
+}
+
+bool TraceClose(void) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) return true;
+  __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+
+  FILE *out = fopen(trace_path, "w");
+  if (out == NULL) perror(trace_path);
+
+  pthread_mutex_lock(&rings_lock);
+  bool first = true;
+  if (out != NULL) fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  while (rings != NULL) {
+    trace_ring_t *r = rings;
+    rings = r->next;
+    if (out != NULL) WriteRing(out, r, &first);
+    free(r);
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  // The rings are gone, including the calling thread's.
+  ring = NULL;
+  if (out == NULL) return false;
+  fprintf(out, "\n]}\n");
+  return fclose(out) == 0;
+}
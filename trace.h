@@ -0,0 +1,36 @@
+
+#ifndef __TRACE_
+#define __TRACE_
+
+#include "bool.h"
+
+// An opt-in timeline of what every thread was doing, written as Chrome trace-event
+// JSON (load it in chrome://tracing or ui.perfetto.dev).
+//
+// Each thread records begin and end events into a ring buffer of its own, so
+// recording takes no lock.  A thread that records more than the ring holds loses
+// its oldest events.  The rings outlive their threads and are written out by
+// TraceClose.  Spans must nest within a thread, as begin/end pairs do in a trace.
+//
+// Until TraceOpen is called, every Trace function returns at once.
+
+// Starts recording.  The trace is written to path by TraceClose.
+void TraceOpen(const char *path);
+
+// Writes every thread's events to the path given to TraceOpen and stops recording.
+// Call it once the threads being traced have all finished.  Returns false if the
+// file couldn't be written.
+bool TraceClose(void);
+
+// Names the calling thread in the timeline.  Threads not named show up as
+// "thread <n>".  name must outlive the trace; string literals do.
+void TraceNameThread(const char *name);
+
+// Opens and closes a span on the calling thread.  name must outlive the trace.
+void TraceBegin(const char *name);
+void TraceEnd(void);
+
+// Closes a span and attaches a number to it, shown as an argument of the span.
+void TraceEndWith(const char *arg_name, long long value);
+
+#endif // __TRACE_
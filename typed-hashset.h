@@ -0,0 +1,148 @@
+#ifndef __typed_hashset_
+#define __typed_hashset_
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "memtrack.h"
+
+/**
+ * File: typed-hashset.h
+ * ---------------------
+ * A hashset specialized at compile time for one element type, keyed on some
+ * field of that element.
+ *
+ *   DECLARE_TYPED_HASHSET(name, prefix, type, key_type, KEY, HASH, EQUAL)
+ *
+ * KEY(const type *elem) yields the element's key, HASH(key) a full-width unsigned
+ * hash code, and EQUAL(key1, key2) true if the keys match.  All three should be
+ * macros or static inline functions.  That generates the type name along with
+ * prefixNew, prefixDispose, prefixCount, prefixAt, prefixLookup and prefixEnter.
+ * DECLARE_TYPED_HASHSET_TAGGED takes a memtrack.h tag as well, and charges the
+ * memory of every such set to it.  Untagged sets are charged to MEM_OTHER.
+ *
+ * Unlike hashset.h, elements never move once entered: they live in fixed-size
+ * pages that are allocated as the set grows, so their addresses can be handed
+ * out and kept.  Elements are also numbered in the order they were entered, and
+ * prefixAt(h, i) returns the i'th one, which is how callers iterate.
+ *
+ * The index is open addressed with linear probing.  Each slot caches the full hash
+ * code so almost every mismatch is rejected without touching the element.
+ */
+
+#define TYPED_HASHSET_PAGE_SHIFT 8
+#define TYPED_HASHSET_PAGE_SIZE (1 << TYPED_HASHSET_PAGE_SHIFT)
+
+typedef struct {
+  unsigned hash;
+  int index;      // element number, or -1 if the slot is empty
+} typed_hashset_slot_t;
+
+#define DECLARE_TYPED_HASHSET(name, prefix, type, key_type, KEY, HASH, EQUAL)      \
+  DECLARE_TYPED_HASHSET_TAGGED(name, prefix, type, key_type, KEY, HASH, EQUAL, MEM_OTHER)
+
+#define DECLARE_TYPED_HASHSET_TAGGED(name, prefix, type, key_type, KEY, HASH, EQUAL, tag) \
+typedef struct {                                                                   \
+  type **pages;                                                                    \
+  int n_pages;                                                                     \
+  int count;                                                                       \
+  typed_hashset_slot_t *slots;                                                     \
+  int n_slots;   /* always a power of two, and at least twice count */             \
+} name;                                                                            \
+                                                                                   \
+static inline void prefix##New(name *h, int expected_count) {                      \
+  h->n_slots = 16;                                                                 \
+  while (h->n_slots < 2 * expected_count) h->n_slots *= 2;                         \
+  h->slots = MemMalloc(tag, h->n_slots * sizeof(typed_hashset_slot_t));            \
+  assert(h->slots != NULL);                                                        \
+  memset(h->slots, 0xff, h->n_slots * sizeof(typed_hashset_slot_t));               \
+  h->pages = NULL;                                                                 \
+  h->n_pages = 0;                                                                  \
+  h->count = 0;                                                                    \
+}                                                                                  \
+                                                                                   \
+/* Frees the set's own memory.  Callers with elements that own memory free  */     \
+/* that first, by walking the elements with prefixAt. */                             \
+static inline void prefix##Dispose(name *h) {                                      \
+  for (int i = 0; i < h->n_pages; i++)                                             \
+    MemFree(tag, h->pages[i], TYPED_HASHSET_PAGE_SIZE * sizeof(type));             \
+  MemFree(tag, h->pages, h->n_pages * sizeof(type*));                              \
+  MemFree(tag, h->slots, h->n_slots * sizeof(typed_hashset_slot_t));               \
+  h->pages = NULL;                                                                 \
+  h->slots = NULL;                                                                 \
+  h->n_pages = h->count = h->n_slots = 0;                                          \
+}                                                                                  \
+                                                                                   \
+static inline int prefix##Count(const name *h) {                                   \
+  return h->count;                                                                 \
+}                                                                                  \
+                                                                                   \
+static inline type *prefix##At(const name *h, int index) {                         \
+  assert(index >= 0 && index < h->count);                                          \
+  return &h->pages[index >> TYPED_HASHSET_PAGE_SHIFT]                              \
+                  [index & (TYPED_HASHSET_PAGE_SIZE - 1)];                         \
+}                                                                                  \
+                                                                                   \
+/* Returns the slot holding key, or the empty slot where it would go. */           \
+static inline typed_hashset_slot_t *prefix##Probe(const name *h, key_type key,     \
+                                                unsigned hash) {                   \
+  unsigned mask = h->n_slots - 1;                                                  \
+  for (unsigned i = hash & mask; ; i = (i + 1) & mask) {                           \
+    typed_hashset_slot_t *slot = &h->slots[i];                                     \
+    if (slot->index < 0) return slot;                                              \
+    if (slot->hash == hash && EQUAL(KEY(prefix##At(h, slot->index)), key))         \
+      return slot;                                                                 \
+  }                                                                                \
+}                                                                                  \
+                                                                                   \
+static inline type *prefix##Lookup(const name *h, key_type key) {                  \
+  typed_hashset_slot_t *slot = prefix##Probe(h, key, HASH(key));                   \
+  return slot->index < 0 ? NULL : prefix##At(h, slot->index);                      \
+}                                                                                  \
+                                                                                   \
+static void prefix##Grow(name *h) {                                                \
+  typed_hashset_slot_t *old_slots = h->slots;                                      \
+  int n_old_slots = h->n_slots;                                                    \
+  h->n_slots *= 2;                                                                 \
+  h->slots = MemMalloc(tag, h->n_slots * sizeof(typed_hashset_slot_t));            \
+  assert(h->slots != NULL);                                                        \
+  memset(h->slots, 0xff, h->n_slots * sizeof(typed_hashset_slot_t));               \
+  unsigned mask = h->n_slots - 1;                                                  \
+  for (int i = 0; i < n_old_slots; i++) {                                          \
+    if (old_slots[i].index < 0) continue;                                          \
+    unsigned j = old_slots[i].hash & mask;                                         \
+    while (h->slots[j].index >= 0) j = (j + 1) & mask;                             \
+    h->slots[j] = old_slots[i];                                                    \
+  }                                                                                \
+  MemFree(tag, old_slots, n_old_slots * sizeof(typed_hashset_slot_t));             \
+}                                                                                  \
+                                                                                   \
+/* Copies elem into the set, replacing any element with the same key, and */       \
+/* returns the address of the copy. */                                             \
+static inline type *prefix##Enter(name *h, const type *elem) {                     \
+  unsigned hash = HASH(KEY(elem));                                                 \
+  typed_hashset_slot_t *slot = prefix##Probe(h, KEY(elem), hash);                  \
+  if (slot->index >= 0) {                                                          \
+    type *existing = prefix##At(h, slot->index);                                   \
+    *existing = *elem;                                                             \
+    return existing;                                                               \
+  }                                                                                \
+  if (2 * (h->count + 1) > h->n_slots) {                                           \
+    prefix##Grow(h);                                                               \
+    slot = prefix##Probe(h, KEY(elem), hash);                                      \
+  }                                                                                \
+  if ((h->count & (TYPED_HASHSET_PAGE_SIZE - 1)) == 0) {                           \
+    h->pages = MemRealloc(tag, h->pages, h->n_pages * sizeof(type*),               \
+                          (h->n_pages + 1) * sizeof(type*));                       \
+    h->pages[h->n_pages] = MemMalloc(tag, TYPED_HASHSET_PAGE_SIZE * sizeof(type)); \
+    assert(h->pages != NULL && h->pages[h->n_pages] != NULL);                      \
+    h->n_pages++;                                                                  \
+  }                                                                                \
+  slot->hash = hash;                                                               \
+  slot->index = h->count++;                                                        \
+  type *copy = prefix##At(h, slot->index);                                         \
+  *copy = *elem;                                                                   \
+  return copy;                                                                     \
+}
+
+#endif
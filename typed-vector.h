@@ -0,0 +1,132 @@
+#ifndef __typed_vector_
+#define __typed_vector_
+
+#include <stdlib.h>
+#include <assert.h>
+#include "memtrack.h"
+
+/**
+ * File: typed-vector.h
+ * --------------------
+ * A vector specialized at compile time for one element type.  It mirrors the
+ * vector.h interface, but since the element type is known, elements are moved
+ * with plain assignment instead of memcpy, indexing is ordinary pointer arithmetic,
+ * and the sort comparison is inlined rather than called through a function pointer.
+ *
+ * DECLARE_TYPED_VECTOR(occurrance_vector_t, OccurranceVector, occurrance_t)
+ * declares the type occurrance_vector_t along with OccurranceVectorNew,
+ * OccurranceVectorDispose, OccurranceVectorLength, OccurranceVectorNth,
+ * OccurranceVectorLast and OccurranceVectorAppend, all static inline.
+ *
+ * DECLARE_TYPED_VECTOR_TAGGED(occurrance_vector_t, OccurranceVector, occurrance_t, MEM_POSTINGS)
+ * does the same, but charges the memory of every such vector to that tag in the
+ * memory accounts (see memtrack.h).  Untagged vectors are charged to MEM_OTHER.
+ *
+ * DECLARE_TYPED_VECTOR_SORT(occurrance_vector_t, OccurranceVector, occurrance_t, less)
+ * adds OccurranceVectorSort, where less(const type *a, const type *b) returns true if
+ * a belongs before b.  less should be a static inline function or a macro so the
+ * compiler can fold it into the sort loop.
+ */
+
+#define DECLARE_TYPED_VECTOR(name, prefix, type)                                   \
+  DECLARE_TYPED_VECTOR_TAGGED(name, prefix, type, MEM_OTHER)
+
+#define DECLARE_TYPED_VECTOR_TAGGED(name, prefix, type, tag)                       \
+typedef struct {                                                                   \
+  type *elems;                                                                     \
+  int length;                                                                      \
+  int allocated;                                                                   \
+} name;                                                                            \
+                                                                                   \
+static inline void prefix##New(name *v, int initial_allocation) {                  \
+  assert(initial_allocation >= 0);                                                 \
+  v->length = 0;                                                                   \
+  v->allocated = initial_allocation > 0 ? initial_allocation : 4;                  \
+  v->elems = MemMalloc(tag, v->allocated * sizeof(type));                          \
+  assert(v->elems != NULL);                                                        \
+}                                                                                  \
+                                                                                   \
+static inline void prefix##Dispose(name *v) {                                      \
+  MemFree(tag, v->elems, v->allocated * sizeof(type));                             \
+  v->elems = NULL;                                                                 \
+  v->length = v->allocated = 0;                                                    \
+}                                                                                  \
+                                                                                   \
+static inline int prefix##Length(const name *v) {                                  \
+  return v->length;                                                                \
+}                                                                                  \
+                                                                                   \
+static inline type *prefix##Nth(const name *v, int position) {                     \
+  assert(position >= 0 && position < v->length);                                   \
+  return &v->elems[position];                                                      \
+}                                                                                  \
+                                                                                   \
+/* NULL if the vector is empty. */                                                 \
+static inline type *prefix##Last(const name *v) {                                  \
+  return v->length > 0 ? &v->elems[v->length - 1] : NULL;                          \
+}                                                                                  \
+                                                                                   \
+/* Drops the last element. */                                                     \
+static inline void prefix##RemoveLast(name *v) {                                   \
+  assert(v->length > 0);                                                           \
+  v->length--;                                                                     \
+}                                                                                  \
+                                                                                   \
+static inline void prefix##Append(name *v, const type *elem) {                     \
+  if (v->length == v->allocated) {                                                 \
+    v->elems = MemRealloc(tag, v->elems, v->allocated * sizeof(type),              \
+                          2 * v->allocated * sizeof(type));                        \
+    v->allocated *= 2;                                                             \
+    assert(v->elems != NULL);                                                      \
+  }                                                                                \
+  v->elems[v->length++] = *elem;                                                   \
+}
+
+// Quicksort (median of three, recursing into the smaller side) that hands short
+// ranges to insertion sort.
+#define DECLARE_TYPED_VECTOR_SORT(name, prefix, type, less)                        \
+static inline void prefix##Swap(type *a, type *b) {                                \
+  type tmp = *a;                                                                   \
+  *a = *b;                                                                         \
+  *b = tmp;                                                                        \
+}                                                                                  \
+                                                                                   \
+static void prefix##InsertionSort(type *elems, int n) {                            \
+  for (int i = 1; i < n; i++) {                                                    \
+    type elem = elems[i];                                                          \
+    int j = i;                                                                     \
+    for (; j > 0 && less(&elem, &elems[j - 1]); j--)                               \
+      elems[j] = elems[j - 1];                                                     \
+    elems[j] = elem;                                                               \
+  }                                                                                \
+}                                                                                  \
+                                                                                   \
+static void prefix##QuickSort(type *elems, int n) {                                \
+  while (n > 16) {                                                                 \
+    int mid = n / 2, i = 0, j = n - 1;                                             \
+    if (less(&elems[mid], &elems[0])) prefix##Swap(&elems[mid], &elems[0]);        \
+    if (less(&elems[n - 1], &elems[0])) prefix##Swap(&elems[n - 1], &elems[0]);    \
+    if (less(&elems[n - 1], &elems[mid])) prefix##Swap(&elems[n - 1], &elems[mid]); \
+    type pivot = elems[mid];                                                       \
+    while (i <= j) {                                                               \
+      while (less(&elems[i], &pivot)) i++;                                         \
+      while (less(&pivot, &elems[j])) j--;                                         \
+      if (i <= j) prefix##Swap(&elems[i++], &elems[j--]);                          \
+    }                                                                              \
+    if (j + 1 < n - i) {                                                           \
+      prefix##QuickSort(elems, j + 1);                                             \
+      elems += i;                                                                  \
+      n -= i;                                                                      \
+    } else {                                                                       \
+      prefix##QuickSort(elems + i, n - i);                                         \
+      n = j + 1;                                                                   \
+    }                                                                              \
+  }                                                                                \
+  prefix##InsertionSort(elems, n);                                                 \
+}                                                                                  \
+                                                                                   \
+static inline void prefix##Sort(name *v) {                                         \
+  prefix##QuickSort(v->elems, v->length);                                          \
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <assert.h>
+#include "url-set.h"
+#include "memtrack.h"
+
+void UrlSetNew(url_set_t *set, int expected_count) {
+  unsigned n_slots = 16;
+  while (n_slots < 2u * expected_count) n_slots *= 2;
+  set->slots = MemMalloc(MEM_URL_SET, n_slots * sizeof(uint64_t));
+  assert(set->slots != NULL);
+  memset(set->slots, 0, n_slots * sizeof(uint64_t));
+  set->mask = n_slots - 1;
+  // at most three quarters full, so probe runs stay short.
+  set->capacity = n_slots / 4 * 3;
+  set->n_added = set->n_repeats = set->n_overflows = 0;
+}
+
+void UrlSetDispose(url_set_t *set) {
+  MemFree(MEM_URL_SET, set->slots, (set->mask + 1) * sizeof(uint64_t));
+  set->slots = NULL;
+}
+
+// Canonical form /////////////////
+
+// Appends length bytes of s to buffer at *n, as far as they fit.
+static void Append(char *buffer, int buffer_length, int *n, const char *s, int length) {
+  if (length > buffer_length - 1 - *n) length = buffer_length - 1 - *n;
+  if (length <= 0) return;
+  memcpy(buffer + *n, s, length);
+  *n += length;
+}
+
+void UrlCanonicalize(const char *url, char *buffer, int buffer_length) {
+  int n = 0;
+  assert(buffer_length > 0);
+
+  while (isspace((unsigned char)*url)) url++;
+  const char *end = url + strlen(url);
+  while (end > url && isspace((unsigned char)end[-1])) end--;
+  const char *fragment = memchr(url, '#', end - url);
+  if (fragment != NULL) end = fragment;
+
+  if (strncasecmp(url, "http://", 7) == 0) url += 7;
+  else if (strncasecmp(url, "https://", 8) == 0) url += 8;
+
+  // host, lowercased, and a port unless it's the default.
+  const char *host_end = url;
+  while (host_end < end && *host_end != '/' && *host_end != '?') host_end++;
+  const char *port = host_end;
+  while (port > url && isdigit((unsigned char)port[-1])) port--;
+  int port_length = host_end - port;
+  bool default_port = port > url && port[-1] == ':' && ((port_length == 2 && strncmp(port, "80", 2) == 0) ||
+                                                        (port_length == 3 && strncmp(port, "443", 3) == 0));
+  const char *host_copy_end = default_port ? port - 1 : host_end;
+  for (const char *c = url; c < host_copy_end && n < buffer_length - 1; c++)
+    buffer[n++] = tolower((unsigned char)*c);
+
+  const char *query = memchr(host_end, '?', end - host_end);
+  const char *path_end = query != NULL ? query : end;
+  if (path_end == host_end) Append(buffer, buffer_length, &n, "/", 1);
+  else Append(buffer, buffer_length, &n, host_end, path_end - host_end);
+
+  // the query, less its tracking parameters.
+  bool first = true;
+  for (const char *param = query; param != NULL && param < end; ) {
+    param++;   // past the '?' or '&'
+    const char *param_end = memchr(param, '&', end - param);
+    if (param_end == NULL) param_end = end;
+    if (param_end > param && strncasecmp(param, "utm_", 4) != 0) {
+      Append(buffer, buffer_length, &n, first ? "?" : "&", 1);
+      Append(buffer, buffer_length, &n, param, param_end - param);
+      first = false;
+    }
+    param = param_end < end ? param_end : NULL;
+  }
+  buffer[n] = '\0';
+}
+
+uint64_t UrlFingerprint(const char *url) {
+  char canonical[2048];
+  UrlCanonicalize(url, canonical, sizeof(canonical));
+
+  // 64-bit FNV-1a, then the splitmix64 finalizer to spread it over every bit.
+  uint64_t hash = 14695981039346656037ull;
+  for (const char *c = canonical; *c != '\0'; c++) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ull;
+  }
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ull;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebull;
+  hash ^= hash >> 31;
+  return hash != 0 ? hash : 1;   // 0 marks an empty slot
+}
+
+// Set /////////////////
+
+bool UrlSetAdd(url_set_t *set, const char *url) {
+  uint64_t fingerprint = UrlFingerprint(url);
+
+  for (unsigned i = (unsigned)fingerprint & set->mask; ; i = (i + 1) & set->mask) {
+    uint64_t seen = __atomic_load_n(&set->slots[i], __ATOMIC_ACQUIRE);
+    if (seen == fingerprint) {
+      __atomic_fetch_add(&set->n_repeats, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+    if (seen != 0) continue;
+
+    // An empty slot: the url isn't in the set.  Claim the slot, unless the set is
+    // full, or someone else claims it first, in which case look again at what they put.
+    if (__atomic_load_n(&set->n_added, __ATOMIC_RELAXED) >= set->capacity) {
+      __atomic_fetch_add(&set->n_overflows, 1, __ATOMIC_RELAXED);
+      return true;
+    }
+    if (__atomic_compare_exchange_n(&set->slots[i], &seen, fingerprint, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      __atomic_fetch_add(&set->n_added, 1, __ATOMIC_RELAXED);
+      return true;
+    }
+    if (seen == fingerprint) {
+      __atomic_fetch_add(&set->n_repeats, 1, __ATOMIC_RELAXED);
+      return false;
+    }
+  }
+}
+
+void UrlSetReport(const url_set_t *set) {
+  printf("Article urls: %d unique, %d repeats skipped",
+         __atomic_load_n(&set->n_added, __ATOMIC_RELAXED), __atomic_load_n(&set->n_repeats, __ATOMIC_RELAXED));
+  int n_overflows = __atomic_load_n(&set->n_overflows, __ATOMIC_RELAXED);
+  if (n_overflows > 0) printf(", %d fetched unchecked after the set filled", n_overflows);
+  printf(".\n");
+}
@@ -0,0 +1,48 @@
+
+#ifndef __URL_SET_
+#define __URL_SET_
+
+#include <stdint.h>
+#include "bool.h"
+
+// A set of 64-bit fingerprints of canonical urls, shared by every downloader thread
+// without a lock.  It's an open-addressed table with linear probing, sized once up
+// front.  A slot goes from empty (0) to holding a fingerprint with a single
+// compare-and-swap and never changes after that, so nothing is ever moved or deleted.
+// Two urls whose fingerprints collide count as the same url; with n urls that's
+// about one chance in 2^64 / n^2.
+//
+// The set only takes as many urls as it was sized for.  Past that UrlSetAdd always
+// answers "new", since a fetch it can't record is better than one it wrongly skips.
+
+typedef struct {
+  uint64_t *slots;
+  unsigned mask;              // the number of slots, less one
+  int capacity;               // most urls the set takes
+  int n_added, n_repeats, n_overflows;   // read and written atomically
+} url_set_t;
+
+// Sizes the set for expected_count urls.
+void UrlSetNew(url_set_t *set, int expected_count);
+void UrlSetDispose(url_set_t *set);
+
+/**
+ * Writes the form of url that's compared into buffer, cut short to fit if need
+ * be.  Surrounding whitespace, the scheme (http and https are taken to serve the
+ * same page), a default port, the fragment and any utm_ tracking parameters are
+ * dropped, the host is lowercased, and an empty path becomes "/".
+ */
+void UrlCanonicalize(const char *url, char *buffer, int buffer_length);
+
+// The 64-bit fingerprint of url's canonical form.  Never 0.
+uint64_t UrlFingerprint(const char *url);
+
+// Adds url to the set.  Returns true if it wasn't there before, or if the set is
+// full; false if it was.  Safe from any thread.
+bool UrlSetAdd(url_set_t *set, const char *url);
+
+// Prints how many urls were added, how many repeats were turned away, and how
+// many urls came after the set filled up.
+void UrlSetReport(const url_set_t *set);
+
+#endif // __URL_SET_
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "vector.h"
+
+// Used when the client passes 0 for initialAllocation.
+static const int kDefaultAllocation = 4;
+
+static inline void *ElemAddr(const vector *v, int position) {
+  return (char*)v->elems + (size_t)position * v->elemSize;
+}
+
+// Makes room for at least one more element.  The allocation doubles rather than
+// growing by a fixed chunk, so appends stay constant time on long vectors, and
+// the allocated length is still always a multiple of allocationChunk.
+static void Grow(vector *v) {
+  if (v->logicalLength < v->allocatedLength) return;
+  v->allocatedLength = (v->allocatedLength == 0) ? v->allocationChunk : 2 * v->allocatedLength;
+  v->elems = realloc(v->elems, (size_t)v->allocatedLength * v->elemSize);
+  assert(v->elems != NULL);
+}
+
+void VectorNew(vector *v, int elemSize, VectorFreeFunction freeFn, int initialAllocation)
+{
+  assert(elemSize > 0);
+  assert(initialAllocation >= 0);
+  v->elemSize = elemSize;
+  v->freeFn = freeFn;
+  v->logicalLength = 0;
+  v->allocationChunk = (initialAllocation == 0) ? kDefaultAllocation : initialAllocation;
+  // nothing is allocated until the first element arrives.  Plenty of vectors
+  // (hashset buckets especially) never get one.
+  v->allocatedLength = 0;
+  v->elems = NULL;
+}
+
+void VectorDispose(vector *v)
+{
+  if (v->freeFn != NULL)
+    for (int i = 0; i < v->logicalLength; i++) v->freeFn(ElemAddr(v, i));
+  free(v->elems);
+  v->elems = NULL;
+  v->logicalLength = v->allocatedLength = 0;
+}
+
+int VectorLength(const vector *v)
+{
+  return v->logicalLength;
+}
+
+void *VectorNth(const vector *v, int position)
+{
+  assert(position >= 0 && position < v->logicalLength);
+  return ElemAddr(v, position);
+}
+
+void VectorReplace(vector *v, const void *elemAddr, int position)
+{
+  assert(elemAddr != NULL);
+  void *target = VectorNth(v, position);
+  if (v->freeFn != NULL) v->freeFn(target);
+  memcpy(target, elemAddr, v->elemSize);
+}
+
+void VectorInsert(vector *v, const void *elemAddr, int position)
+{
+  assert(elemAddr != NULL);
+  assert(position >= 0 && position <= v->logicalLength);
+  Grow(v);
+  void *target = ElemAddr(v, position);
+  memmove(ElemAddr(v, position + 1), target, (size_t)(v->logicalLength - position) * v->elemSize);
+  memcpy(target, elemAddr, v->elemSize);
+  v->logicalLength++;
+}
+
+void VectorAppend(vector *v, const void *elemAddr)
+{
+  assert(elemAddr != NULL);
+  Grow(v);
+  memcpy(ElemAddr(v, v->logicalLength), elemAddr, v->elemSize);
+  v->logicalLength++;
+}
+
+void VectorDelete(vector *v, int position)
+{
+  void *target = VectorNth(v, position);
+  if (v->freeFn != NULL) v->freeFn(target);
+  memmove(target, ElemAddr(v, position + 1), (size_t)(v->logicalLength - position - 1) * v->elemSize);
+  v->logicalLength--;
+}
+
+void VectorSort(vector *v, VectorCompareFunction compare)
+{
+  assert(compare != NULL);
+  if (v->logicalLength > 1) qsort(v->elems, v->logicalLength, v->elemSize, compare);
+}
+
+void VectorMap(vector *v, VectorMapFunction mapFn, void *auxData)
+{
+  assert(mapFn != NULL);
+  for (int i = 0; i < v->logicalLength; i++) mapFn(ElemAddr(v, i), auxData);
+}
+
+static const int kNotFound = -1;
+int VectorSearch(const vector *v, const void *key, VectorCompareFunction searchFn, int startIndex, bool isSorted)
+{
+  assert(key != NULL && searchFn != NULL);
+  assert(startIndex >= 0 && startIndex <= v->logicalLength);
+  if (startIndex == v->logicalLength) return kNotFound;
+
+  if (isSorted) {
+    void *found = bsearch(key, ElemAddr(v, startIndex), v->logicalLength - startIndex, v->elemSize, searchFn);
+    return (found == NULL) ? kNotFound : ((char*)found - (char*)v->elems) / v->elemSize;
+  }
+  for (int i = startIndex; i < v->logicalLength; i++)
+    if (searchFn(key, ElemAddr(v, i)) == 0) return i;
+  return kNotFound;
+}